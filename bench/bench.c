@@ -0,0 +1,842 @@
+/*
+DBLite benchmark harness
+
+Drives the engine directly (no repl, no parsing, no printing) and reports
+ops/sec and p50 / p99 / p99.9 latency for each workload:
+
+insert_sequential -> keys 1..N in order into an empty table
+insert_random     -> a random permutation of 1..N into an empty table
+insert_zipfian    -> N inserts of Zipfian distributed keys; repeats are
+                     rejected as duplicates, like in the repl
+bulk_load         -> the random permutation loaded with table_bulk_load on
+                     every core; one op per load
+insert_batch      -> the random permutation inserted with table_insert_rows,
+                     INSERT_BATCH_ROWS rows per op
+insert_batch_sequential -> keys 1..N inserted with table_insert_rows, so
+                     the rows of a batch share leaves
+lookup_uniform    -> point lookups of uniformly chosen existing keys
+lookup_zipfian    -> point lookups of Zipfian chosen existing keys
+lookup_batch      -> the uniform lookups with table_get_rows, GET_BATCH_KEYS
+                     keys per op
+scan              -> range scans of SCAN_LENGTH rows from a random key
+scan_full         -> FULL_SCANS scans of the whole table on one thread
+scan_cursor       -> the same scans with scan_cursor_fetch, which returns
+                     views of the rows instead of copies, CURSOR_BATCH_ROWS
+                     rows per call
+scan_parallel     -> the same scans with table_scan_parallel, unordered,
+                     on every core
+scan_cursor_range -> result cursors over ranges of up to CURSOR_RANGE_KEYS
+                     keys from random keys, in a table of half the keys,
+                     read alternately with scan_cursor_next and
+                     scan_cursor_fetch; after the timing, a range that
+                     returned the wrong number of rows counts as failed
+mixed             -> 50% lookups of existing keys, 50% inserts of new keys
+
+Every workload runs at several dataset sizes, from one that fits in the
+CPU's last level cache to 10x that size or as many rows as
+TABLE_MAX_PAGES holds, whichever is smaller. Datasets are named after
+the multiple of the cache they really are.
+
+Build and run with `make bench`. Results are written as JSON to the file
+given as the first argument (stdout if none), so runs of two versions
+can be compared. `-quick` runs small datasets only. `-pagesize n` creates
+the databases with n byte pages (4096 by default), so page sizes can be
+compared too, and `-keysize 8` with 64-bit keys.
+*/
+#define DBLITE_NO_MAIN
+#include "../db.c"
+
+// required for `pow` in the Zipfian generator
+#include <math.h>
+
+#define SCAN_LENGTH 100
+#define INSERT_BATCH_ROWS 10000
+#define GET_BATCH_KEYS 1024
+#define FULL_SCANS 5
+#define CURSOR_BATCH_ROWS 64
+#define CURSOR_RANGE_KEYS 800
+// lookups and scans per dataset are capped so large datasets finish quickly
+#define MAX_READ_OPS 1000000
+#define ZIPFIAN_THETA 0.99
+
+/*
+Random numbers
+
+xorshift64* is fast and good enough to pick keys; the benchmark must not
+be dominated by its random number generator.
+*/
+typedef struct
+{
+  uint64_t state;
+} Random;
+
+uint64_t random_next(Random *random)
+{
+  random->state ^= random->state >> 12;
+  random->state ^= random->state << 25;
+  random->state ^= random->state >> 27;
+  return random->state * 0x2545F4914F6CDD1DULL;
+}
+
+// a uniformly chosen number in [0, bound)
+uint64_t random_below(Random *random, uint64_t bound)
+{
+  return random_next(random) % bound;
+}
+
+double random_unit(Random *random)
+{
+  return (random_next(random) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+Zipfian numbers in [0, n), as generated by YCSB (Gray et al., "Quickly
+Generating Billion-Record Synthetic Databases"). Rank 0 is the most
+popular; ranks are scattered over the key space by zipfian_key so the
+hot keys are not all in the same leaf.
+*/
+typedef struct
+{
+  uint64_t n;
+  double theta;
+  double alpha;
+  double zeta_n;
+  double eta;
+} Zipfian;
+
+void zipfian_init(Zipfian *zipfian, uint64_t n, double theta)
+{
+  double zeta_2 = 1.0 + pow(0.5, theta);
+  double zeta_n = 0;
+  for (uint64_t i = 1; i <= n; i++)
+  {
+    zeta_n += 1.0 / pow((double)i, theta);
+  }
+
+  zipfian->n = n;
+  zipfian->theta = theta;
+  zipfian->alpha = 1.0 / (1.0 - theta);
+  zipfian->zeta_n = zeta_n;
+  zipfian->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta_2 / zeta_n);
+}
+
+uint64_t zipfian_next(Zipfian *zipfian, Random *random)
+{
+  double u = random_unit(random);
+  double uz = u * zipfian->zeta_n;
+  if (uz < 1.0)
+  {
+    return 0;
+  }
+  if (uz < 1.0 + pow(0.5, zipfian->theta))
+  {
+    return 1;
+  }
+  uint64_t rank = (uint64_t)(zipfian->n * pow(zipfian->eta * u - zipfian->eta + 1.0, zipfian->alpha));
+  return rank < zipfian->n ? rank : zipfian->n - 1;
+}
+
+// map a Zipfian rank to a key in [1, n]
+uint32_t zipfian_key(uint64_t rank, uint64_t n)
+{
+  // multiplicative (Fibonacci) hash, then fold into the key space
+  uint64_t hash = (rank + 1) * 0x9E3779B97F4A7C15ULL;
+  hash ^= hash >> 29;
+  return (uint32_t)(hash % n) + 1;
+}
+
+/*
+Timing
+*/
+uint64_t now_ns()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+int compare_uint64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+Engine access
+
+A database lives in a temporary file. It is discarded without flushing
+when the workload is done; writing it back is not part of any workload.
+*/
+typedef struct
+{
+  Table *table;
+  char filename[64];
+} BenchDatabase;
+
+uint32_t bench_page_size = DEFAULT_PAGE_SIZE;
+uint32_t bench_key_size = DEFAULT_KEY_SIZE;
+
+void bench_database_open(BenchDatabase *database)
+{
+  strcpy(database->filename, "/tmp/dblite-bench-XXXXXX");
+  int fd = mkstemp(database->filename);
+  if (fd == -1)
+  {
+    printf("Unable to create benchmark database\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  unlink(database->filename);
+  database->table = db_open(database->filename, bench_page_size, bench_key_size);
+}
+
+void bench_database_discard(BenchDatabase *database)
+{
+  Pager *pager = database->table->pager;
+  close(pager->file_descriptor);
+  page_arena_free(pager->frames, pager->frames_size);
+  free(pager->compression_buffer);
+  free(pager);
+  free(database->table);
+  unlink(database->filename);
+}
+
+ExecuteResult bench_insert(Table *table, uint32_t key)
+{
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  statement.row_to_insert.id = key;
+  statement.row_to_insert.username = (StringView){"benchuser", 9};
+  statement.row_to_insert.email = (StringView){"bench@example.com", 17};
+  return execute_insert(&statement, table);
+}
+
+bool bench_lookup(Table *table, uint32_t key, Row *row)
+{
+  Cursor cursor;
+  table_find(table, key, &cursor);
+  void *node = get_page(table->pager, cursor.page_num);
+  if (cursor.cell_num >= *leaf_node_num_cells(node) ||
+      leaf_node_key(node, cursor.cell_num) != key)
+  {
+    return false;
+  }
+  deserialize_row(cursor_value(&cursor), row);
+  return true;
+}
+
+uint32_t bench_scan(Table *table, uint32_t start_key, uint32_t length, Row *row)
+{
+  Cursor cursor;
+  table_seek(table, start_key, &cursor);
+  uint32_t rows = 0;
+  while (!cursor.end_of_table && rows < length)
+  {
+    deserialize_row(cursor_value(&cursor), row);
+    cursor_advance(&cursor);
+    rows++;
+  }
+  return rows;
+}
+
+uint64_t bench_scan_cursor(Table *table)
+{
+  RowView rows[CURSOR_BATCH_ROWS];
+  ScanCursor cursor;
+  scan_cursor_open(table, 0, MAX_KEY, &cursor);
+  uint64_t count = 0;
+  uint32_t fetched;
+  while ((fetched = scan_cursor_fetch(&cursor, rows, CURSOR_BATCH_ROWS)) > 0)
+  {
+    count += fetched;
+  }
+  scan_cursor_close(&cursor);
+  return count;
+}
+
+// rows seen by each worker of a parallel scan, a cache line apart
+typedef struct
+{
+  uint64_t rows;
+  uint8_t padding[56];
+} WorkerCount;
+
+void bench_count_row(Row *row, uint32_t worker, void *context)
+{
+  (void)row;
+  WorkerCount *counts = context;
+  counts[worker].rows++;
+}
+
+uint64_t bench_scan_parallel(Table *table, uint32_t workers)
+{
+  WorkerCount counts[SCAN_MAX_WORKERS] = {{0}};
+  table_scan_parallel(table, workers, false, bench_count_row, counts);
+  uint64_t rows = 0;
+  for (uint32_t i = 0; i < SCAN_MAX_WORKERS; i++)
+  {
+    rows += counts[i].rows;
+  }
+  return rows;
+}
+
+/*
+Results
+*/
+typedef struct
+{
+  const char *workload;
+  const char *dataset;
+  uint64_t rows;
+  uint64_t ops;
+  uint64_t failed; // duplicate keys or missing rows
+  uint64_t elapsed_ns;
+  uint64_t *latencies;
+} Measurement;
+
+void measurement_start(Measurement *measurement, const char *workload,
+                       const char *dataset, uint64_t rows, uint64_t ops)
+{
+  measurement->workload = workload;
+  measurement->dataset = dataset;
+  measurement->rows = rows;
+  measurement->ops = ops;
+  measurement->failed = 0;
+  measurement->elapsed_ns = 0;
+  measurement->latencies = malloc(ops * sizeof(uint64_t));
+}
+
+uint64_t percentile(uint64_t *sorted, uint64_t count, double fraction)
+{
+  uint64_t index = (uint64_t)(fraction * (count - 1));
+  return sorted[index];
+}
+
+bool first_result = true;
+
+void measurement_report(Measurement *measurement, FILE *output)
+{
+  qsort(measurement->latencies, measurement->ops, sizeof(uint64_t), compare_uint64);
+  double seconds = measurement->elapsed_ns / 1e9;
+  double ops_per_sec = measurement->ops / seconds;
+  uint64_t p50 = percentile(measurement->latencies, measurement->ops, 0.50);
+  uint64_t p99 = percentile(measurement->latencies, measurement->ops, 0.99);
+  uint64_t p999 = percentile(measurement->latencies, measurement->ops, 0.999);
+
+  fprintf(output, "%s    {\"workload\": \"%s\", \"dataset\": \"%s\", \"rows\": %llu, "
+                  "\"ops\": %llu, \"failed\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+                  "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+          first_result ? "" : ",\n",
+          measurement->workload, measurement->dataset,
+          (unsigned long long)measurement->rows, (unsigned long long)measurement->ops,
+          (unsigned long long)measurement->failed, seconds, ops_per_sec,
+          (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999);
+  first_result = false;
+
+  fprintf(stderr, "%-18s %-10s %10llu rows %12.0f ops/s  p50 %6llu ns  p99 %7llu ns  p99.9 %8llu ns\n",
+          measurement->workload, measurement->dataset, (unsigned long long)measurement->rows,
+          ops_per_sec, (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999);
+
+  free(measurement->latencies);
+}
+
+/*
+Workloads
+
+Each op is timed on its own. clock_gettime costs roughly 20 ns, which is
+included in every latency and in ops/sec.
+*/
+void run_inserts(const char *workload, const char *dataset, uint32_t *keys,
+                 uint64_t count, FILE *output)
+{
+  BenchDatabase database;
+  bench_database_open(&database);
+
+  Measurement measurement;
+  measurement_start(&measurement, workload, dataset, count, count);
+  uint64_t started = now_ns();
+  for (uint64_t i = 0; i < count; i++)
+  {
+    uint64_t op_started = now_ns();
+    ExecuteResult result = bench_insert(database.table, keys[i]);
+    uint64_t op_finished = now_ns();
+    measurement.latencies[i] = op_finished - op_started;
+    if (result != EXECUTE_SUCCESS)
+    {
+      measurement.failed++;
+    }
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+
+  bench_database_discard(&database);
+}
+
+void run_bulk_load(const char *dataset, uint32_t *keys, uint64_t count, FILE *output)
+{
+  Row *rows = calloc(count, sizeof(Row));
+  for (uint64_t i = 0; i < count; i++)
+  {
+    rows[i].id = keys[i];
+    strcpy(rows[i].username, "benchuser");
+    strcpy(rows[i].email, "bench@example.com");
+  }
+
+  BenchDatabase database;
+  bench_database_open(&database);
+
+  Measurement measurement;
+  measurement_start(&measurement, "bulk_load", dataset, count, 1);
+  uint64_t started = now_ns();
+  ExecuteResult result = table_bulk_load(database.table, rows, count, sysconf(_SC_NPROCESSORS_ONLN));
+  measurement.elapsed_ns = now_ns() - started;
+  measurement.latencies[0] = measurement.elapsed_ns;
+  measurement.failed = (result != EXECUTE_SUCCESS);
+  measurement_report(&measurement, output);
+
+  bench_database_discard(&database);
+  free(rows);
+}
+
+void run_insert_batches(const char *workload, const char *dataset, uint32_t *keys,
+                        uint64_t count, FILE *output)
+{
+  RowView *rows = malloc(count * sizeof(RowView));
+  for (uint64_t i = 0; i < count; i++)
+  {
+    rows[i].id = keys[i];
+    rows[i].username = (StringView){"benchuser", 9};
+    rows[i].email = (StringView){"bench@example.com", 17};
+  }
+
+  BenchDatabase database;
+  bench_database_open(&database);
+
+  uint64_t batches = (count + INSERT_BATCH_ROWS - 1) / INSERT_BATCH_ROWS;
+  Measurement measurement;
+  measurement_start(&measurement, workload, dataset, count, batches);
+  uint64_t started = now_ns();
+  for (uint64_t b = 0; b < batches; b++)
+  {
+    uint64_t first = b * INSERT_BATCH_ROWS;
+    uint32_t length = (count - first < INSERT_BATCH_ROWS) ? count - first : INSERT_BATCH_ROWS;
+    uint64_t op_started = now_ns();
+    ExecuteResult result = table_insert_rows(database.table, rows + first, length);
+    measurement.latencies[b] = now_ns() - op_started;
+    if (result != EXECUTE_SUCCESS)
+    {
+      measurement.failed++;
+    }
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+
+  bench_database_discard(&database);
+  free(rows);
+}
+
+void run_reads(const char *dataset, uint32_t *keys, uint64_t rows, Zipfian *zipfian,
+               Random *random, FILE *output)
+{
+  BenchDatabase database;
+  bench_database_open(&database);
+  for (uint64_t i = 0; i < rows; i++)
+  {
+    bench_insert(database.table, keys[i]);
+  }
+
+  Row row;
+  Measurement measurement;
+  uint64_t lookups = rows < MAX_READ_OPS ? rows : MAX_READ_OPS;
+
+  measurement_start(&measurement, "lookup_uniform", dataset, rows, lookups);
+  uint64_t started = now_ns();
+  for (uint64_t i = 0; i < lookups; i++)
+  {
+    uint32_t key = random_below(random, rows) + 1;
+    uint64_t op_started = now_ns();
+    bool found = bench_lookup(database.table, key, &row);
+    measurement.latencies[i] = now_ns() - op_started;
+    measurement.failed += !found;
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+
+  uint64_t batches = (lookups + GET_BATCH_KEYS - 1) / GET_BATCH_KEYS;
+  uint64_t *batch_keys = malloc(GET_BATCH_KEYS * sizeof(uint64_t));
+  Row *batch_rows = malloc(GET_BATCH_KEYS * sizeof(Row));
+  measurement_start(&measurement, "lookup_batch", dataset, rows, batches);
+  started = now_ns();
+  for (uint64_t b = 0; b < batches; b++)
+  {
+    for (uint32_t i = 0; i < GET_BATCH_KEYS; i++)
+    {
+      batch_keys[i] = random_below(random, rows) + 1;
+    }
+    uint64_t op_started = now_ns();
+    uint32_t found = table_get_rows(database.table, batch_keys, GET_BATCH_KEYS, batch_rows);
+    measurement.latencies[b] = now_ns() - op_started;
+    // repeated keys are returned once
+    measurement.failed += (found == 0);
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+  free(batch_rows);
+  free(batch_keys);
+
+  measurement_start(&measurement, "lookup_zipfian", dataset, rows, lookups);
+  started = now_ns();
+  for (uint64_t i = 0; i < lookups; i++)
+  {
+    uint32_t key = zipfian_key(zipfian_next(zipfian, random), rows);
+    uint64_t op_started = now_ns();
+    bool found = bench_lookup(database.table, key, &row);
+    measurement.latencies[i] = now_ns() - op_started;
+    measurement.failed += !found;
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+
+  uint64_t scans = lookups / SCAN_LENGTH > 0 ? lookups / SCAN_LENGTH : 1;
+  measurement_start(&measurement, "scan", dataset, rows, scans);
+  started = now_ns();
+  for (uint64_t i = 0; i < scans; i++)
+  {
+    uint32_t key = random_below(random, rows) + 1;
+    uint64_t op_started = now_ns();
+    uint32_t scanned = bench_scan(database.table, key, SCAN_LENGTH, &row);
+    measurement.latencies[i] = now_ns() - op_started;
+    // scans that start near the end of the table return fewer rows
+    measurement.failed += (scanned == 0);
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+
+  measurement_start(&measurement, "scan_full", dataset, rows, FULL_SCANS);
+  started = now_ns();
+  for (uint64_t i = 0; i < FULL_SCANS; i++)
+  {
+    uint64_t op_started = now_ns();
+    uint32_t scanned = bench_scan(database.table, 0, UINT32_MAX, &row);
+    measurement.latencies[i] = now_ns() - op_started;
+    measurement.failed += (scanned != rows);
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+
+  measurement_start(&measurement, "scan_cursor", dataset, rows, FULL_SCANS);
+  started = now_ns();
+  for (uint64_t i = 0; i < FULL_SCANS; i++)
+  {
+    uint64_t op_started = now_ns();
+    uint64_t scanned = bench_scan_cursor(database.table);
+    measurement.latencies[i] = now_ns() - op_started;
+    measurement.failed += (scanned != rows);
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+
+  uint32_t workers = sysconf(_SC_NPROCESSORS_ONLN);
+  measurement_start(&measurement, "scan_parallel", dataset, rows, FULL_SCANS);
+  started = now_ns();
+  for (uint64_t i = 0; i < FULL_SCANS; i++)
+  {
+    uint64_t op_started = now_ns();
+    uint64_t scanned = bench_scan_parallel(database.table, workers);
+    measurement.latencies[i] = now_ns() - op_started;
+    measurement.failed += (scanned != rows);
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+
+  // half of the ops insert keys above the existing ones, half look up existing keys
+  uint64_t mixed = lookups;
+  uint32_t next_key = rows + 1;
+  measurement_start(&measurement, "mixed", dataset, rows, mixed);
+  started = now_ns();
+  for (uint64_t i = 0; i < mixed; i++)
+  {
+    bool insert = random_next(random) & 1;
+    uint32_t key = insert ? next_key++ : (uint32_t)random_below(random, rows) + 1;
+    uint64_t op_started = now_ns();
+    bool succeeded = insert ? bench_insert(database.table, key) == EXECUTE_SUCCESS
+                            : bench_lookup(database.table, key, &row);
+    measurement.latencies[i] = now_ns() - op_started;
+    measurement.failed += !succeeded;
+  }
+  measurement.elapsed_ns = now_ns() - started;
+  measurement_report(&measurement, output);
+
+  bench_database_discard(&database);
+}
+
+// the index of the first of count sorted keys that is not below key
+uint64_t lower_bound(uint64_t *sorted, uint64_t count, uint64_t key)
+{
+  uint64_t low = 0;
+  uint64_t high = count;
+  while (low < high)
+  {
+    uint64_t middle = low + (high - low) / 2;
+    if (sorted[middle] < key)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/*
+Read the rows of [first_key, last_key] with a result cursor and return
+how many there were. max is the rows per scan_cursor_fetch, or 0 to read
+one row at a time with scan_cursor_next.
+*/
+uint64_t bench_cursor_range(Table *table, uint64_t first_key, uint64_t last_key, uint32_t max)
+{
+  uint64_t count = 0;
+  RowView rows[CURSOR_BATCH_ROWS * 4];
+  ScanCursor cursor;
+  scan_cursor_open(table, first_key, last_key, &cursor);
+  uint32_t fetched;
+  do
+  {
+    if (max == 0)
+    {
+      fetched = scan_cursor_next(&cursor, &rows[0]);
+    }
+    else
+    {
+      fetched = scan_cursor_fetch(&cursor, rows, max);
+    }
+    count += fetched;
+  } while (fetched > 0);
+  scan_cursor_close(&cursor);
+  return count;
+}
+
+void run_cursor_ranges(const char *dataset, uint32_t *keys, uint64_t rows, Random *random, FILE *output)
+{
+  // half of the permuted keys, so ranges start and end between stored keys
+  uint64_t count = rows / 2 > 0 ? rows / 2 : 1;
+  BenchDatabase database;
+  bench_database_open(&database);
+  for (uint64_t i = 0; i < count; i++)
+  {
+    bench_insert(database.table, keys[i]);
+  }
+
+  uint64_t ranges = count < MAX_READ_OPS ? count : MAX_READ_OPS;
+  ranges = ranges / SCAN_LENGTH > 0 ? ranges / SCAN_LENGTH : 1;
+  uint64_t *first_keys = malloc(ranges * sizeof(uint64_t));
+  uint64_t *last_keys = malloc(ranges * sizeof(uint64_t));
+  uint32_t *maxes = malloc(ranges * sizeof(uint32_t));
+  uint64_t *counts = malloc(ranges * sizeof(uint64_t));
+  for (uint64_t i = 0; i < ranges; i++)
+  {
+    first_keys[i] = random_below(random, rows + 2);
+    last_keys[i] = first_keys[i] + random_below(random, CURSOR_RANGE_KEYS);
+    // fetches of more rows than SCAN_RING_FRAMES leaves hold stop early and resume mid-leaf
+    maxes[i] = (i & 1) ? 1 + random_below(random, CURSOR_BATCH_ROWS * 4) : 0;
+  }
+
+  Measurement measurement;
+  measurement_start(&measurement, "scan_cursor_range", dataset, count, ranges);
+  uint64_t started = now_ns();
+  for (uint64_t i = 0; i < ranges; i++)
+  {
+    uint64_t op_started = now_ns();
+    counts[i] = bench_cursor_range(database.table, first_keys[i], last_keys[i], maxes[i]);
+    measurement.latencies[i] = now_ns() - op_started;
+  }
+  measurement.elapsed_ns = now_ns() - started;
+
+  // after the timing: a range that returned the wrong number of rows
+  // failed (tests/insert.tcl checks the rows themselves)
+  uint64_t *sorted = malloc(count * sizeof(uint64_t));
+  for (uint64_t i = 0; i < count; i++)
+  {
+    sorted[i] = keys[i];
+  }
+  qsort(sorted, count, sizeof(uint64_t), compare_uint64);
+  for (uint64_t i = 0; i < ranges; i++)
+  {
+    uint64_t expected = lower_bound(sorted, count, last_keys[i] + 1) - lower_bound(sorted, count, first_keys[i]);
+    measurement.failed += counts[i] != expected;
+  }
+  measurement_report(&measurement, output);
+
+  free(counts);
+  free(maxes);
+  free(last_keys);
+  free(first_keys);
+  free(sorted);
+  bench_database_discard(&database);
+}
+
+/*
+Dataset sizes
+
+Sizes are multiples of the last level cache. A row takes about
+PAGE_SIZE / LEAF_NODE_MAX_CELLS bytes of a full leaf. The page cache is
+not an evicting buffer pool, so every dataset must fit in
+TABLE_MAX_PAGES; larger ones are capped (sequential inserts leave leaves
+half full, and the mixed workload adds rows on top).
+*/
+uint64_t last_level_cache_bytes()
+{
+  long size = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (size <= 0)
+  {
+    size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  }
+#endif
+  // e.g macOS, or a VM that does not report its caches
+  return size > 0 ? (uint64_t)size : 8 * 1024 * 1024;
+}
+
+uint64_t max_rows()
+{
+  uint64_t leaves = (uint64_t)TABLE_MAX_PAGES / 2;
+  return leaves * LEAF_NODE_LEFT_SPLIT_COUNT / 2;
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *output = stdout;
+  bool quick = false;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-quick") == 0)
+    {
+      quick = true;
+    }
+    else if (strcmp(argv[i], "-pagesize") == 0 && i + 1 < argc)
+    {
+      bench_page_size = strtoul(argv[++i], NULL, 10);
+      if (!is_valid_page_size(bench_page_size))
+      {
+        printf("Page size must be a power of two from %d to %d.\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-keysize") == 0 && i + 1 < argc)
+    {
+      bench_key_size = strtoul(argv[++i], NULL, 10);
+      if (!is_valid_key_size(bench_key_size))
+      {
+        printf("Key size must be 4 or 8 bytes.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else
+    {
+      output = fopen(argv[i], "w");
+      if (output == NULL)
+      {
+        printf("Unable to open '%s'\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  // datasets are sized from the layout before any database is opened
+  DbHeader layout = {DB_HEADER_MAGIC, DB_HEADER_VERSION, bench_page_size, 1, bench_key_size, 0};
+  set_page_layout(&layout);
+
+  uint64_t cache_bytes = last_level_cache_bytes();
+  uint64_t bytes_per_row = PAGE_SIZE / LEAF_NODE_MAX_CELLS;
+
+  /*
+    A dataset that TABLE_MAX_PAGES caps is named after the multiple it
+    really is, and one capped to the same rows as the one before it is
+    dropped.
+  */
+  double factors[] = {0.25, 1.0, 10.0};
+  uint32_t num_factors = sizeof(factors) / sizeof(factors[0]);
+  uint64_t dataset_rows[num_factors];
+  char datasets[num_factors][32];
+  uint32_t num_datasets = 0;
+  for (uint32_t f = 0; f < num_factors; f++)
+  {
+    uint64_t rows = quick ? 1000 * (f + 1) : (uint64_t)(factors[f] * cache_bytes / bytes_per_row);
+    if (rows > max_rows())
+    {
+      fprintf(stderr, "%gx_llc capped at %llu rows by TABLE_MAX_PAGES\n", factors[f],
+              (unsigned long long)max_rows());
+      rows = max_rows();
+    }
+    if (num_datasets > 0 && rows == dataset_rows[num_datasets - 1])
+    {
+      continue;
+    }
+    dataset_rows[num_datasets] = rows;
+    snprintf(datasets[num_datasets], sizeof(datasets[num_datasets]), "%.3gx_llc",
+             (double)rows * bytes_per_row / cache_bytes);
+    num_datasets++;
+  }
+
+  fprintf(output, "{\n  \"page_size\": %u,\n  \"key_size\": %u,\n  \"table_max_pages\": %u,\n"
+                  "  \"node_format_version\": %u,\n  \"llc_bytes\": %llu,\n  \"datasets\": [",
+          PAGE_SIZE, KEY_SIZE, TABLE_MAX_PAGES, NODE_FORMAT_VERSION, (unsigned long long)cache_bytes);
+  for (uint32_t d = 0; d < num_datasets; d++)
+  {
+    fprintf(output, "%s\n    {\"dataset\": \"%s\", \"rows\": %llu, \"llc_multiple\": %.4f}",
+            d == 0 ? "" : ",", datasets[d], (unsigned long long)dataset_rows[d],
+            (double)dataset_rows[d] * bytes_per_row / cache_bytes);
+  }
+  fprintf(output, "\n  ],\n  \"results\": [\n");
+
+  Random random = {0x5DEECE66DULL};
+  for (uint32_t d = 0; d < num_datasets; d++)
+  {
+    uint64_t rows = dataset_rows[d];
+    uint32_t *keys = malloc(rows * sizeof(uint32_t));
+
+    for (uint64_t i = 0; i < rows; i++)
+    {
+      keys[i] = i + 1;
+    }
+    run_inserts("insert_sequential", datasets[d], keys, rows, output);
+    run_insert_batches("insert_batch_sequential", datasets[d], keys, rows, output);
+
+    // Fisher-Yates shuffle into a random permutation
+    for (uint64_t i = rows - 1; i > 0; i--)
+    {
+      uint64_t j = random_below(&random, i + 1);
+      uint32_t key = keys[i];
+      keys[i] = keys[j];
+      keys[j] = key;
+    }
+    run_inserts("insert_random", datasets[d], keys, rows, output);
+    run_bulk_load(datasets[d], keys, rows, output);
+    run_insert_batches("insert_batch", datasets[d], keys, rows, output);
+
+    Zipfian zipfian;
+    zipfian_init(&zipfian, rows, ZIPFIAN_THETA);
+    uint32_t *zipfian_keys = malloc(rows * sizeof(uint32_t));
+    for (uint64_t i = 0; i < rows; i++)
+    {
+      zipfian_keys[i] = zipfian_key(zipfian_next(&zipfian, &random), rows);
+    }
+    run_inserts("insert_zipfian", datasets[d], zipfian_keys, rows, output);
+    free(zipfian_keys);
+
+    run_reads(datasets[d], keys, rows, &zipfian, &random, output);
+    run_cursor_ranges(datasets[d], keys, rows, &random, output);
+    free(keys);
+  }
+
+  fprintf(output, "\n  ]\n}\n");
+  if (output != stdout)
+  {
+    fclose(output);
+  }
+  return EXIT_SUCCESS;
+}
@@ -1,3 +1,6 @@
+// required for `fallocate` hole punching and `copy_file_range`
+#define _GNU_SOURCE
+
 // required for stdin
 #include <stdio.h>
 
@@ -19,24 +22,77 @@
 // required for `close`, `lseek`
 #include <unistd.h>
 
+// required for `mmap`, `munmap`, `madvise`
+#include <sys/mman.h>
+
+// required for `sendfile`, the fallback when copy_file_range is unsupported
+#include <sys/sendfile.h>
+
+// required for the parallel scan's and the server's worker threads
+#include <pthread.h>
+
+// required for server mode: sockets, `epoll`, `signalfd`
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+
+// required for `poll`, to copy a backup while the repl waits for input
+#include <poll.h>
+
 // required for `bool`
 #include <stdbool.h>
 
+// required for `va_list` in report_error
+#include <stdarg.h>
+
+// required for `clock_gettime`
+#include <time.h>
+
+// required for `uint32_t`, `uint8_t`
+#include <stdint.h>
+
+// required for `offsetof`
+#include <stddef.h>
+
+// SSE2 / AVX2 intrinsics for the key search kernels
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DBLITE_X86 1
+#endif
+
 /* Forward declarations of structures */
 typedef struct InputBuffer InputBuffer;
+typedef struct Pager Pager;
+typedef struct ScanRing ScanRing;
 
 /*
 InputBuffer represents the an input object for the DBLite repl
 InputBuffer is defined as a struct type
 char* is used for the buffer because it represents a string of input
+
+Input is read from the file descriptor in large chunks. Each line is
+found with memchr and NUL terminated in place inside the chunk, so
+reading a line does not copy it.
 */
 struct InputBuffer
 {
-  char *buffer;         // the input buffer (input from an IO device, in this case, the shell)
-  size_t buffer_length; // size_t is an unsigned long (at least 32 bits)
-  ssize_t input_length; // ssize_t is a long
+  char *buffer;          // the current line; points into chunk
+  ssize_t input_length;  // length of the current line, without the newline
+  char *chunk;           // bytes read from the file descriptor
+  size_t chunk_capacity; // size of the chunk allocation
+  size_t chunk_length;   // bytes of chunk holding input
+  size_t chunk_offset;   // start of the next unread line in chunk
+  int file_descriptor;   // where input is read from (stdin for the repl)
+  bool end_of_input;     // the file descriptor has no more data
 };
 
+#define INPUT_CHUNK_SIZE (64 * 1024)
+
 // MetaCommandResult defines all possible results of running a meta command
 // If a meta command is recognized, use meta_command_success
 // meta commands in SQlite include .exit, .help e.t.c commands that are run in the shell and start with '.'
@@ -53,6 +109,7 @@ typedef enum
   PREPARE_SUCCESS,
   PREPARE_STRING_TOO_LONG,
   PREPARE_NEGATIVE_ID,
+  PREPARE_ID_TOO_LARGE,
   PREPARE_UNRECOGNIZED_STATEMENT,
   PREPARE_SYNTAX_ERROR
 } PrepareResult;
@@ -83,18 +140,38 @@ typedef enum
 // email is an array of characters; a string
 typedef struct
 {
-  uint32_t id;
+  uint64_t id;
   // '+1' allocates an extra position for the null character
   // we use a char array here because we want to edit it
   char username[COLUMN_USERNAME_SIZE + 1];
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+// StringView is a string that is not NUL terminated and not owned,
+// e.g a token inside the input buffer
+typedef struct
+{
+  const char *data;
+  uint32_t length;
+} StringView;
+
+// RowView is a row to insert whose strings still live where they were parsed
+typedef struct
+{
+  uint64_t id;
+  StringView username;
+  StringView email;
+} RowView;
+
 // Statement defines a statement to be processed by the compiler
 typedef struct
 {
   StatementType type;
-  Row row_to_insert; // only used by insert statement
+  RowView row_to_insert; // only used by insert statement; valid until the next read_input
+  uint32_t num_rows;     // an insert of more than one row has its values here instead,
+  StringView values;     // and a select of some ids has the ids (num_rows of them)
+  uint64_t first_key;    // a select reads the rows of [first_key, last_key]
+  uint64_t last_key;
 } Statement;
 
 // returns the size of an attribute of a struct
@@ -106,23 +183,362 @@ typedef struct
 A serialized row looks like this:
 COLUMN    SIZE(bytes)   OFFSET
 id        4             0
-username  32            4
-email     255           36
-total     291
+username  33            4
+email     256           37
+total     293
+
+The id takes as many bytes as the table's keys (KEY_SIZE), so rows of a
+table with 64-bit keys are 4 bytes longer; set_page_layout sets ID_SIZE
+and the offsets after it.
 */
-const uint32_t ID_SIZE = size_of_attribute(Row, id);
+uint32_t ID_SIZE = sizeof(uint32_t);
 const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
 const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
 const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+uint32_t USERNAME_OFFSET;
+uint32_t EMAIL_OFFSET;
+uint32_t ROW_SIZE;
+
+void print_row(RowView *row)
+{
+  printf("(%llu, %.*s, %.*s)\n", (unsigned long long)row->id, (int)row->username.length, row->username.data,
+         (int)row->email.length, row->email.data);
+}
+
+/*
+OutputMode defines how select results are written
+
+OUTPUT_REPL   -> (id, username, email) lines, as typed in the repl
+OUTPUT_CSV    -> id,username,email lines; fields are quoted when needed
+OUTPUT_BINARY -> one frame per row:
+                 [uint32 frame length][uint32 id, or uint64 with 64-bit keys]
+                 [uint8 username length][username]
+                 [uint16 email length][email]
+                 integers are in host byte order
+*/
+typedef enum
+{
+  OUTPUT_REPL,
+  OUTPUT_CSV,
+  OUTPUT_BINARY
+} OutputMode;
+
+// the size of stdout's buffer in batch mode
+#define BATCH_OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+/*
+Shell holds the state of the front end: how it was started and, in batch
+mode, the counters for the summary printed on exit.
+
+batch -> no prompt, no "Executed." lines; errors go to stderr
+*/
+typedef struct
+{
+  bool batch;
+  OutputMode output_mode;
+  uint64_t line_number;
+  uint64_t statements;
+  uint64_t errors;
+  uint64_t rows;
+  struct timespec started;
+  uint32_t threads; // select scans the table on this many threads; see also bulk_load_workers
+} Shell;
+
+Shell shell = {false, OUTPUT_REPL, 0, 0, 0, 0, {0, 0}, 1};
+
+// writes a CSV field, quoting it if it contains a separator or a quote
+void write_csv_field(StringView field, FILE *stream)
+{
+  bool quote = false;
+  for (uint32_t i = 0; i < field.length && !quote; i++)
+  {
+    char c = field.data[i];
+    quote = c == ',' || c == '"' || c == '\r' || c == '\n';
+  }
+  if (!quote)
+  {
+    fwrite(field.data, 1, field.length, stream);
+    return;
+  }
+
+  putc('"', stream);
+  for (uint32_t i = 0; i < field.length; i++)
+  {
+    if (field.data[i] == '"')
+    {
+      putc('"', stream);
+    }
+    putc(field.data[i], stream);
+  }
+  putc('"', stream);
+}
+
+void write_row_csv(RowView *row)
+{
+  // format the id by hand; printf's format parsing is the slow part
+  char digits[20];
+  uint64_t id = row->id;
+  int i = sizeof(digits);
+  do
+  {
+    digits[--i] = '0' + id % 10;
+    id /= 10;
+  } while (id);
+  fwrite(digits + i, 1, sizeof(digits) - i, stdout);
+
+  putc(',', stdout);
+  write_csv_field(row->username, stdout);
+  putc(',', stdout);
+  write_csv_field(row->email, stdout);
+  putc('\n', stdout);
+}
+
+void write_row_binary(RowView *row)
+{
+  uint8_t username_length = row->username.length;
+  uint16_t email_length = row->email.length;
+  uint32_t frame_length = ID_SIZE + sizeof(username_length) + username_length +
+                          sizeof(email_length) + email_length;
+
+  fwrite(&frame_length, sizeof(frame_length), 1, stdout);
+  // the low ID_SIZE bytes of the id; like the pages, this assumes a little-endian host
+  fwrite(&row->id, ID_SIZE, 1, stdout);
+  fwrite(&username_length, sizeof(username_length), 1, stdout);
+  fwrite(row->username.data, 1, username_length, stdout);
+  fwrite(&email_length, sizeof(email_length), 1, stdout);
+  fwrite(row->email.data, 1, email_length, stdout);
+}
+
+// write a result row in the shell's output mode
+void output_row_view(RowView *row)
+{
+  shell.rows++;
+  switch (shell.output_mode)
+  {
+  case OUTPUT_REPL:
+    print_row(row);
+    break;
+  case OUTPUT_CSV:
+    write_row_csv(row);
+    break;
+  case OUTPUT_BINARY:
+    write_row_binary(row);
+    break;
+  }
+}
+
+void output_row(Row *row)
+{
+  RowView view = {row->id, {row->username, strlen(row->username)}, {row->email, strlen(row->email)}};
+  output_row_view(&view);
+}
+
+/*
+Report a failed statement or command
+
+In the repl the message is printed like any other output. In batch mode
+it goes to stderr with the line number, so it does not mix with results.
+*/
+void report_error(const char *format, ...)
+{
+  va_list arguments;
+  va_start(arguments, format);
+  if (shell.batch)
+  {
+    shell.errors++;
+    fprintf(stderr, "Line %llu: ", (unsigned long long)shell.line_number);
+    vfprintf(stderr, format, arguments);
+  }
+  else
+  {
+    vprintf(format, arguments);
+  }
+  va_end(arguments);
+}
+
+/*
+Output writer
+
+In batch mode stdout is replaced by a stream (fopencookie) whose buffer,
+when full or flushed, is copied into one of OUTPUT_BLOCKS blocks and
+handed to a writer thread. Formatting the next rows overlaps with the
+write of the ones before, which matters when stdout is a pipe to a slow
+reader; only when every block is waiting to be written does the main
+thread wait. output_flush returns once everything printed so far has
+been written, and runs at exit so nothing queued is lost.
+*/
+#define OUTPUT_BLOCKS 4
+
+typedef struct
+{
+  int fd;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  char *blocks[OUTPUT_BLOCKS];
+  size_t lengths[OUTPUT_BLOCKS];
+  uint32_t first;  // the block being written or next to be
+  uint32_t queued; // blocks waiting to be written, from first
+  bool started;
+} OutputWriter;
+
+OutputWriter output_writer;
+
+void *output_writer_thread(void *argument)
+{
+  OutputWriter *writer = argument;
+  pthread_mutex_lock(&writer->lock);
+  for (;;)
+  {
+    while (writer->queued == 0)
+    {
+      pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+    char *block = writer->blocks[writer->first];
+    size_t length = writer->lengths[writer->first];
+    pthread_mutex_unlock(&writer->lock);
+
+    size_t written = 0;
+    while (written < length)
+    {
+      ssize_t result = write(writer->fd, block + written, length - written);
+      if (result == -1)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+        _exit(EXIT_FAILURE);
+      }
+      written += result;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->first = (writer->first + 1) % OUTPUT_BLOCKS;
+    writer->queued--;
+    pthread_cond_broadcast(&writer->changed);
+  }
+  return NULL;
+}
+
+// the stream's write function: queue a copy of its buffer
+ssize_t output_writer_write(void *cookie, const char *data, size_t length)
+{
+  OutputWriter *writer = cookie;
+  pthread_mutex_lock(&writer->lock);
+  while (writer->queued == OUTPUT_BLOCKS)
+  {
+    pthread_cond_wait(&writer->changed, &writer->lock);
+  }
+  uint32_t block = (writer->first + writer->queued) % OUTPUT_BLOCKS;
+  pthread_mutex_unlock(&writer->lock);
+
+  // only the writer thread reads blocks, and never one that is not queued
+  if (writer->blocks[block] == NULL || length > BATCH_OUTPUT_BUFFER_SIZE)
+  {
+    writer->blocks[block] = realloc(writer->blocks[block], length > BATCH_OUTPUT_BUFFER_SIZE ? length : BATCH_OUTPUT_BUFFER_SIZE);
+  }
+  memcpy(writer->blocks[block], data, length);
+  writer->lengths[block] = length;
+
+  pthread_mutex_lock(&writer->lock);
+  writer->queued++;
+  pthread_cond_broadcast(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+  return length;
+}
+
+// wait until everything printed so far has been written
+void output_flush()
+{
+  fflush(stdout);
+  if (!output_writer.started)
+  {
+    return;
+  }
+  pthread_mutex_lock(&output_writer.lock);
+  while (output_writer.queued > 0)
+  {
+    pthread_cond_wait(&output_writer.changed, &output_writer.lock);
+  }
+  pthread_mutex_unlock(&output_writer.lock);
+}
+
+// replace stdout with a stream written by the writer thread
+void output_writer_start()
+{
+  OutputWriter *writer = &output_writer;
+  writer->fd = STDOUT_FILENO;
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->changed, NULL);
+
+  cookie_io_functions_t functions = {NULL, output_writer_write, NULL, NULL};
+  FILE *stream = fopencookie(writer, "w", functions);
+  if (stream == NULL || pthread_create(&writer->thread, NULL, output_writer_thread, writer) != 0)
+  {
+    // keep writing to stdout directly
+    setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER_SIZE);
+    return;
+  }
+  pthread_detach(writer->thread);
+  setvbuf(stream, NULL, _IOFBF, BATCH_OUTPUT_BUFFER_SIZE);
+  stdout = stream;
+  writer->started = true;
+  // atexit handlers run before stdio flushes its streams
+  atexit(output_flush);
+}
 
-void print_row(Row *row)
+// in batch mode, print what was done before exiting
+void print_batch_summary()
 {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+  if (!shell.batch)
+  {
+    return;
+  }
+
+  struct timespec finished;
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  double seconds = (finished.tv_sec - shell.started.tv_sec) +
+                   (finished.tv_nsec - shell.started.tv_nsec) / 1e9;
+
+  output_flush();
+  fprintf(stderr, "Summary: %llu statements, %llu errors, %llu rows, %.3f s\n",
+          (unsigned long long)shell.statements, (unsigned long long)shell.errors,
+          (unsigned long long)shell.rows, seconds);
 }
 
+/*
+Rows with a KEY_BITS-bit id, with every size and offset a constant, so
+the copies compile to a few moves instead of calls to memcpy (see
+Specialized layouts).
+*/
+#define DEFINE_ROW_LAYOUT(KEY_BITS)                                                                \
+  static inline void serialize_row_view_##KEY_BITS(RowView *source, void *destination)             \
+  {                                                                                                \
+    uint##KEY_BITS##_t id = source->id;                                                            \
+    memcpy(destination, &id, sizeof(id));                                                          \
+    memcpy(destination + sizeof(id), source->username.data, source->username.length);              \
+    memset(destination + sizeof(id) + source->username.length, 0,                                  \
+           COLUMN_USERNAME_SIZE + 1 - source->username.length);                                    \
+    memcpy(destination + sizeof(id) + COLUMN_USERNAME_SIZE + 1, source->email.data,                \
+           source->email.length);                                                                  \
+    memset(destination + sizeof(id) + COLUMN_USERNAME_SIZE + 1 + source->email.length, 0,          \
+           COLUMN_EMAIL_SIZE + 1 - source->email.length);                                          \
+  }                                                                                                \
+                                                                                                   \
+  static inline void deserialize_row_##KEY_BITS(void *source, Row *destination)                    \
+  {                                                                                                \
+    uint##KEY_BITS##_t id;                                                                         \
+    memcpy(&id, source, sizeof(id));                                                               \
+    destination->id = id;                                                                          \
+    memcpy(destination->username, source + sizeof(id), COLUMN_USERNAME_SIZE + 1);                  \
+    memcpy(destination->email, source + sizeof(id) + COLUMN_USERNAME_SIZE + 1, COLUMN_EMAIL_SIZE + 1); \
+  }
+
+DEFINE_ROW_LAYOUT(32)
+DEFINE_ROW_LAYOUT(64)
+
 // store the row in a memory location
 void serialize_row(Row *source, void *destination)
 {
@@ -135,16 +551,136 @@ void serialize_row(Row *source, void *destination)
   memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
 }
 
+/*
+Store a row view in a memory location
+The strings are copied straight from where they were parsed; the rest of
+each column is zero filled.
+*/
+void serialize_row_view(RowView *source, void *destination)
+{
+#ifndef DBLITE_GENERIC_LAYOUT
+  if (ID_SIZE == sizeof(uint32_t))
+  {
+    serialize_row_view_32(source, destination);
+    return;
+  }
+  serialize_row_view_64(source, destination);
+  return;
+#endif
+  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
+  memcpy(destination + USERNAME_OFFSET, source->username.data, source->username.length);
+  memset(destination + USERNAME_OFFSET + source->username.length, 0,
+         USERNAME_SIZE - source->username.length);
+  memcpy(destination + EMAIL_OFFSET, source->email.data, source->email.length);
+  memset(destination + EMAIL_OFFSET + source->email.length, 0,
+         EMAIL_SIZE - source->email.length);
+}
+
 void deserialize_row(void *source, Row *destination)
 {
+#ifndef DBLITE_GENERIC_LAYOUT
+  if (ID_SIZE == sizeof(uint32_t))
+  {
+    deserialize_row_32(source, destination);
+    return;
+  }
+  deserialize_row_64(source, destination);
+  return;
+#endif
   // get all the content from memory block position ID_OFFSET, of size ID_SIZE, and copy into destination->id
+  // (the low bytes of the id; a 4-byte id leaves the rest zero)
+  destination->id = 0;
   memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
   memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
   memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
-const uint32_t PAGE_SIZE = 4096;
-const uint32_t TABLE_MAX_PAGES = 100;
+/*
+A view of a stored row: the strings are not copied but point into the
+row's memory. Columns are zero padded, so they are NUL terminated too.
+*/
+void deserialize_row_view(void *source, RowView *destination)
+{
+  destination->id = 0;
+  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+  destination->username.data = source + USERNAME_OFFSET;
+  destination->username.length = strnlen(source + USERNAME_OFFSET, COLUMN_USERNAME_SIZE);
+  destination->email.data = source + EMAIL_OFFSET;
+  destination->email.length = strnlen(source + EMAIL_OFFSET, COLUMN_EMAIL_SIZE);
+}
+
+/*
+Page size
+
+Each file picks its page size when it is created and records it in the
+database header (see DbHeader). PAGE_SIZE and the layout values derived
+from it (LEAF_NODE_MAX_CELLS, INTERNAL_NODE_MAX_CELLS, ...) are set by
+set_page_layout when the file is opened, so one process works with one
+page size at a time.
+*/
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+
+uint32_t PAGE_SIZE = DEFAULT_PAGE_SIZE;
+// a macro because it sizes the `pages` array in the Pager
+// it can be raised at build time, e.g -DTABLE_MAX_PAGES=1048576 for benchmarks
+#ifndef TABLE_MAX_PAGES
+#define TABLE_MAX_PAGES 100
+#endif
+
+/*
+Key size
+
+Ids are the table's keys. A file picks 32-bit or 64-bit keys when it is
+created and records the choice in the database header, like the page
+size. 32-bit keys keep the key arrays small: a leaf's keys fit in one
+cache line and an internal node searches twice as many keys per line.
+Files created before the choice existed have 32-bit keys.
+
+KEY_SIZE and MAX_KEY (the largest id) are set by set_page_layout. Keys
+are passed around as uint64_t either way; only the pages store them in
+KEY_SIZE bytes.
+*/
+#define DEFAULT_KEY_SIZE 4
+
+uint32_t KEY_SIZE = DEFAULT_KEY_SIZE;
+uint64_t MAX_KEY = UINT32_MAX;
+
+bool is_valid_key_size(uint32_t key_size)
+{
+  return key_size == sizeof(uint32_t) || key_size == sizeof(uint64_t);
+}
+
+/*
+Database header
+
+Page 0 of a database file describes the file rather than holding a node:
+
+ * byte 0 - 15: magic, "dblite database" and a NUL
+ * byte 16 - 19: header version
+ * byte 20 - 23: page size
+ * byte 24 - 27: root page number (1; the root never moves)
+ * byte 28 - 31: key size, 4 or 8 bytes (see Key size)
+ * byte 32 - 35: CRC32C of bytes 0 - 31
+
+The rest of the page is zero. Version 1 headers have no key size; their
+checksum is at byte 28 and their keys are 32 bits. Files written before
+the header existed start with the root node on page 0 and use 4 KB
+pages; they are opened as they are, with a header version of 0 in memory.
+*/
+#define DB_HEADER_MAGIC "dblite database"
+#define DB_HEADER_VERSION 2
+
+typedef struct
+{
+  char magic[16];
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t root_page_num;
+  uint32_t key_size;
+  uint32_t checksum;
+} DbHeader;
 
 /*
 The Pager accesses the page cache and the file.
@@ -153,15 +689,36 @@ The Table object makes requests for pages through the pager
 Data is saved to a file via multiple page-sized memory blocks.
 Reads are made via pages.
 
-file_length -> the size of each page
+file_length -> the size of the file
+header -> the database header, read or written when the file is opened
+compress -> compress pages as they are flushed (see PAGE COMPRESSION)
+block_size -> the file system's block size, the unit of space a
+              compressed page can save
+frames -> the page frame arena; one allocation for the whole page cache
+load_locks -> taken by get_page on a cache miss, one per stripe of pages
+              (see get_page)
 */
-typedef struct
+#define PAGE_LOAD_STRIPES 64
+
+struct Pager
 {
   int file_descriptor;
-  uint32_t file_length;
+  off_t file_length;
   uint32_t num_pages;
+  DbHeader header;
+  bool compress;
+  uint32_t block_size;
+  uint8_t *compression_buffer;
+  // readers decompress through compression_buffer one at a time
+  pthread_mutex_t compression_lock;
+  void *frames;
+  size_t frames_size;
+  pthread_mutex_t load_locks[PAGE_LOAD_STRIPES];
   void *pages[TABLE_MAX_PAGES];
-} Pager;
+};
+
+// a backup in progress (see .backup)
+typedef struct Backup Backup;
 
 /*
 The Table replaces the B-Tree in the real SQLite implementation.
@@ -171,27 +728,109 @@ typedef struct
 {
   Pager *pager;
   uint32_t root_page_num;
+  uint32_t defrag_slot;      // where the next defrag step resumes; 0 starts a pass
+  uint32_t defrag_num_pages; // num_pages when the current defrag pass started
+  Backup *backup;            // the backup db_close must finish first, if any
 } Table;
 
 // a cursor represents a location in a table
+// cursors live on the caller's stack; the find functions fill them in
 typedef struct
 {
   Table *table;
   uint32_t page_num; // pointer to the current page
   uint32_t cell_num; // pointer to the current cell (row)
   bool end_of_table; // Indicates a position one post the last element
+  ScanRing *ring;    // a scan's cursor reads leaves through it (see Scan ring); NULL otherwise
 } Cursor;
 
+/*
+Runtime statistics
+
+Counters are bumped where the work happens (get_page, pager_flush, the
+split functions, cursor_advance) and read with db_stats or `.stats`.
+They are global, like the shell state, because there is one table per
+process, and per thread: the workers of a parallel scan count into their
+own copy, which is added to the caller's with stats_add when they finish. Each statement type has a latency histogram; bucket i counts
+statements that took [2^i, 2^(i+1)) microseconds, bucket 0 anything
+under 2 us and the last bucket anything slower.
+
+tree_height and average_leaf_fill are not counters; db_stats computes
+them from the tree when asked.
+*/
+#define STATS_LATENCY_BUCKETS 24
+#define STATS_STATEMENT_TYPES (STATEMENT_DELETE + 1)
+
+typedef struct
+{
+  uint64_t page_cache_hits;
+  uint64_t page_cache_misses;
+  uint64_t pages_read;
+  uint64_t pages_written;
+  uint64_t bytes_fsynced;
+  uint64_t leaf_splits;
+  uint64_t internal_splits;
+  uint64_t cursor_advances;
+  uint64_t inserts_grouped; // inserts that skipped the descent (see Insert groups)
+  uint64_t scan_ring_reads; // leaves scans read without loading them (see Scan ring)
+  uint64_t checksums_verified;
+  uint64_t checksum_bytes; // bytes of pages checksummed when read
+  uint64_t pages_compressed;
+  uint64_t compressed_bytes; // what the compressed pages take on disk
+  uint64_t statements[STATS_STATEMENT_TYPES];
+  uint64_t latency[STATS_STATEMENT_TYPES][STATS_LATENCY_BUCKETS];
+  uint32_t tree_height;
+  double average_leaf_fill; // 0.0 - 1.0 of LEAF_NODE_MAX_CELLS
+} DbStats;
+
+_Thread_local DbStats stats;
+
+// add the counters of one set of stats to another
+void stats_add(DbStats *total, const DbStats *counters)
+{
+  total->page_cache_hits += counters->page_cache_hits;
+  total->page_cache_misses += counters->page_cache_misses;
+  total->pages_read += counters->pages_read;
+  total->pages_written += counters->pages_written;
+  total->bytes_fsynced += counters->bytes_fsynced;
+  total->leaf_splits += counters->leaf_splits;
+  total->internal_splits += counters->internal_splits;
+  total->cursor_advances += counters->cursor_advances;
+  total->inserts_grouped += counters->inserts_grouped;
+  total->scan_ring_reads += counters->scan_ring_reads;
+  total->checksums_verified += counters->checksums_verified;
+  total->checksum_bytes += counters->checksum_bytes;
+  total->pages_compressed += counters->pages_compressed;
+  total->compressed_bytes += counters->compressed_bytes;
+  for (uint32_t type = 0; type < STATS_STATEMENT_TYPES; type++)
+  {
+    total->statements[type] += counters->statements[type];
+    for (uint32_t bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++)
+    {
+      total->latency[type][bucket] += counters->latency[type][bucket];
+    }
+  }
+}
+
+// bytes written since the last fsync; counted as fsynced by pager_sync
+uint64_t stats_unsynced_bytes;
+
 // 'constructor' for InputBuffer
 // struct properties are accessed via ->
-InputBuffer *new_input_buffer()
+InputBuffer *new_input_buffer(int file_descriptor)
 {
   // allocate memory of the size of the InputBuffer then cast the result to a
   // pointer to the InputBuffer
   InputBuffer *input_buffer = (InputBuffer *)malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;     // initial buffer is empty
-  input_buffer->buffer_length = 0; // limit on size of buffer
+  input_buffer->buffer = NULL; // no line read yet
   input_buffer->input_length = 0;
+  // one extra byte so the last line can be NUL terminated even without a newline
+  input_buffer->chunk = malloc(INPUT_CHUNK_SIZE + 1);
+  input_buffer->chunk_capacity = INPUT_CHUNK_SIZE;
+  input_buffer->chunk_length = 0;
+  input_buffer->chunk_offset = 0;
+  input_buffer->file_descriptor = file_descriptor;
+  input_buffer->end_of_input = false;
 
   return input_buffer;
 }
@@ -219,8 +858,32 @@ const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
 const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_SIZE + IS_ROOT_OFFSET;
+// the layout version of the node body, see NODE_FORMAT_VERSION
+const uint32_t NODE_FORMAT_SIZE = sizeof(uint8_t);
+const uint32_t NODE_FORMAT_OFFSET = PARENT_POINTER_OFFSET + PARENT_POINTER_SIZE;
+// CRC32C of the page, computed with this field left out; see page_checksum
+const uint32_t NODE_CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t NODE_CHECKSUM_OFFSET = NODE_FORMAT_OFFSET + NODE_FORMAT_SIZE;
 // size of the header
-const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+const uint8_t COMMON_NODE_HEADER_SIZE =
+    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE + NODE_FORMAT_SIZE + NODE_CHECKSUM_SIZE;
+
+/*
+Node format versions
+
+Pages written before the format byte existed (version 1) have the low byte
+of their cell / key count at NODE_FORMAT_OFFSET. That count is always
+small, so versioned pages set NODE_FORMAT_VERSION_FLAG to tell them apart.
+
+Version 1: 6 byte common header, leaf cells are [key][row] and internal
+           cells are [child][key], interleaved.
+Version 2: packed key arrays; leaf rows are reached through a slot array.
+Version 3: version 2 with a page checksum; the header grows to 11 bytes.
+*/
+#define NODE_FORMAT_VERSION_FLAG 0x80
+#define NODE_FORMAT_LEGACY 1
+#define NODE_FORMAT_UNCHECKSUMMED 2
+#define NODE_FORMAT_VERSION 3
 
 /*
 Leaf Node format
@@ -239,19 +902,48 @@ const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_C
 
 /*
 Leaf Node Body Layout
+
+The keys are packed into an array at the front of the body. Cell i's row
+lives in the payload area at the position stored in slot i. A binary
+search over the keys then only touches the key array (a couple of cache
+lines) and the row bytes are read once, for the cell that was found.
+Inserting a cell shifts keys and slots; rows never move.
+
+ * byte 19 - 70: key 0 ... key 12 [leaf] 13 x 32 bits
+ * byte 71 - 96: slot 0 ... slot 12 [leaf] 13 x 16 bits
+ * byte 97 - 3905: payload 0 ... payload 12 [leaf] 13 x 293 bytes
+
+With 64-bit keys a 4 KB leaf holds 13 keys of 64 bits and rows of 297 bytes.
 */
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+// the key array starts right after the header
+const uint32_t LEAF_NODE_KEYS_OFFSET = LEAF_NODE_HEADER_SIZE;
+
+// these depend on the key size; set_page_layout fills them in
+uint32_t LEAF_NODE_KEY_SIZE;
 // The size of a row (cell)
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-// a page is a leaf node; it has multiple cells
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+uint32_t LEAF_NODE_VALUE_SIZE;
+// a cell is still a key, a slot and a value, they are just stored apart
+uint32_t LEAF_NODE_CELL_SIZE;
 
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+// these depend on the page size; set_page_layout fills them in
+// a page is a leaf node; it has multiple cells
+uint32_t LEAF_NODE_SPACE_FOR_CELLS;
+uint32_t LEAF_NODE_MAX_CELLS;
+// the slot array starts after room for LEAF_NODE_MAX_CELLS keys
+uint32_t LEAF_NODE_SLOTS_OFFSET;
+uint32_t LEAF_NODE_VALUES_OFFSET;
+
+// the most cells any layout can give a leaf: a MAX_PAGE_SIZE page of the
+// smallest cells (32-bit keys). Code that marks slots in a stack array sizes
+// it with this; set_page_layout checks LEAF_NODE_MAX_CELLS stays under it.
+#define LEAF_NODE_MAX_CELLS_LIMIT \
+  (MAX_PAGE_SIZE / (sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(((Row *)0)->username) + sizeof(((Row *)0)->email)))
+// slots are 16 bits wide
+_Static_assert(LEAF_NODE_MAX_CELLS_LIMIT <= UINT16_MAX, "leaf slots must fit in 16 bits");
+
+uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT;
+uint32_t LEAF_NODE_LEFT_SPLIT_COUNT;
 
 /*
  * Internal Node Header Layout
@@ -259,13 +951,16 @@ const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NOD
  * 1. byte 0: node_type [common] 8 bits
  * 2. byte 1: is_root [common] 8 bits
  * 3. byte 2 - 5: parent pointer [common] 32 bits
- * 4. byte 6 - 9: num keys [internal] 32 bits
- * 5. byte 10 - 13: right child pointer [internal] 32 bits
- * 6. byte 14 - 17: child pointer 0 [internal] 32 bits
- * 7. byte 18 - 21: key 0 [internal] 32 bits
+ * 4. byte 6: format version [common] 8 bits
+ * 5. byte 7 - 10: checksum [common] 32 bits
+ * 6. byte 11 - 14: num keys [internal] 32 bits
+ * 7. byte 15 - 18: right child pointer [internal] 32 bits
+ * 8. byte 19 - 22: key 0 [internal] 32 bits
  * ...
- * byte 4086 - 4089: child pointer 509 [internal] <always 1 more child pointer than keys>
- * byte 4090 - 4093: key 509
+ * 9. key INTERNAL_NODE_MAX_CELLS - 1
+ * 10. child pointer 0 [internal] 32 bits
+ * ...
+ * 11. child pointer INTERNAL_NODE_MAX_CELLS - 1 <the right child is in the header>
  */
 // the keys in an internal node are references to pages (leaf nodes)
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
@@ -280,1169 +975,7310 @@ const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NO
 /*
 * Internal Node Body Layout
 
-* The body is an array of cells where each cell contains a child pointer and a key.
-* Every key should be the maximum key contained in the child to its left.
+* The body is an array of keys followed by an array of child pointers.
+* Key i is the maximum key contained in child i (the child to its left).
+* Keeping the keys contiguous lets internal_node_find_child search them
+* without stepping over the child pointers.
 */
-const uint32_t INTERNAL_NODE_CELL_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE =
-    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_CELL_KEY_SIZE;
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+// set by set_page_layout: keys are KEY_SIZE bytes
+uint32_t INTERNAL_NODE_CELL_KEY_SIZE;
+uint32_t INTERNAL_NODE_CELL_SIZE;
+// the right child of an empty internal node; no node is ever on page UINT32_MAX
+const uint32_t INVALID_PAGE_NUM = UINT32_MAX;
+const uint32_t INTERNAL_NODE_KEYS_OFFSET = INTERNAL_NODE_HEADER_SIZE;
 
-/**
- * LEAF NODE FUNCTIONS
- */
-// returns a pointer to the start of the leaf node's cells
-uint32_t *leaf_node_num_cells(void *node)
-{
-  return node + LEAF_NODE_NUM_CELLS_OFFSET;
-}
+// set by set_page_layout: as many keys and children as fit in a page
+uint32_t INTERNAL_NODE_MAX_CELLS;
+uint32_t INTERNAL_NODE_CHILDREN_OFFSET;
 
-// returns a pointer to the start of a cell's key based on
-// the cell's number
-void *leaf_node_cell(void *node, uint32_t cell_num)
-{
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
-}
+// internal nodes in files without a database header hold 3 keys; the tests
+// split internal nodes in such files (tests/lib/small_internal_nodes.tcl)
+const uint32_t HEADERLESS_INTERNAL_NODE_MAX_CELLS = 3;
 
-// returns a pointer to the start of a cell's (row) key
-uint32_t *leaf_node_key(void *node, uint32_t cell_num)
-{
-  return leaf_node_cell(node, cell_num);
-}
+/*
+Specialized layouts
+
+The layout values above are variables because the page size and key size
+come from the file. For the layouts most files use, listed here,
+DEFINE_NODE_LAYOUT generates a copy of the descent with both fixed, and
+set_page_layout picks the copy that matches the file; other files use
+the generic code. Building with -DDBLITE_GENERIC_LAYOUT turns the copies
+off, to compare the two.
+*/
+#define SPECIALIZED_NODE_LAYOUTS(X) \
+  X(4K_32, 4096, uint32_t)          \
+  X(4K_64, 4096, uint64_t)
 
-// returns a pointer to the start of a cell's value
-void *leaf_node_value(void *node, uint32_t cell_num)
+typedef enum
 {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
-}
+  NODE_LAYOUT_GENERIC,
+#define NODE_LAYOUT_ENUM(NAME, PAGE, KEY) NODE_LAYOUT_##NAME,
+  SPECIALIZED_NODE_LAYOUTS(NODE_LAYOUT_ENUM)
+#undef NODE_LAYOUT_ENUM
+} NodeLayout;
 
-// fetch the next leaf for a leaf node
-uint32_t *leaf_node_next_leaf(void *node)
-{
-  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
-}
+// set by set_page_layout
+NodeLayout node_layout = NODE_LAYOUT_GENERIC;
 
-/**
- * INTERNAL NODE FUNCTIONS
- */
-// return a pointer to the number of keys for an internal node
-uint32_t *internal_node_num_keys(void *node)
+/*
+Fill in the layout values for a file
+
+A 4 KB page holds 13 rows per leaf and 509 keys per internal node; a
+64 KB page holds 219 rows and 8189 keys. With 64-bit keys, internal
+nodes hold 339 and 5459 keys. The right child lives in the header, so an
+internal node has one more child than keys. Files from before the
+database header keep their small internal nodes, since the position of
+the child array depends on how many keys fit.
+*/
+void set_page_layout(DbHeader *header)
 {
-  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
-}
+  PAGE_SIZE = header->page_size;
+
+  KEY_SIZE = header->key_size;
+  MAX_KEY = KEY_SIZE == sizeof(uint64_t) ? UINT64_MAX : UINT32_MAX;
+  ID_SIZE = KEY_SIZE;
+  USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
+  EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
+  ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+
+  LEAF_NODE_KEY_SIZE = KEY_SIZE;
+  LEAF_NODE_VALUE_SIZE = ROW_SIZE;
+  LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE + LEAF_NODE_VALUE_SIZE;
+  INTERNAL_NODE_CELL_KEY_SIZE = KEY_SIZE;
+  INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_CELL_KEY_SIZE;
+
+  LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+  LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+  if (LEAF_NODE_MAX_CELLS > LEAF_NODE_MAX_CELLS_LIMIT)
+  {
+    printf("Leaf nodes of %u cells exceed LEAF_NODE_MAX_CELLS_LIMIT.\n", LEAF_NODE_MAX_CELLS);
+    exit(EXIT_FAILURE);
+  }
+  LEAF_NODE_SLOTS_OFFSET = LEAF_NODE_KEYS_OFFSET + LEAF_NODE_MAX_CELLS * LEAF_NODE_KEY_SIZE;
+  LEAF_NODE_VALUES_OFFSET = LEAF_NODE_SLOTS_OFFSET + LEAF_NODE_MAX_CELLS * LEAF_NODE_SLOT_SIZE;
+  LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
+  LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
 
-// return a pointer to the right child of an internal node
-uint32_t *internal_node_right_child(void *node)
-{
-  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+  INTERNAL_NODE_MAX_CELLS = (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE;
+  if (header->version == 0)
+  {
+    INTERNAL_NODE_MAX_CELLS = HEADERLESS_INTERNAL_NODE_MAX_CELLS;
+  }
+  INTERNAL_NODE_CHILDREN_OFFSET =
+      INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_CELL_KEY_SIZE;
+
+  node_layout = NODE_LAYOUT_GENERIC;
+#ifndef DBLITE_GENERIC_LAYOUT
+#define NODE_LAYOUT_MATCH(NAME, PAGE, KEY)                                   \
+  if (header->version != 0 && PAGE_SIZE == PAGE && KEY_SIZE == sizeof(KEY)) \
+  {                                                                          \
+    node_layout = NODE_LAYOUT_##NAME;                                        \
+  }
+  SPECIALIZED_NODE_LAYOUTS(NODE_LAYOUT_MATCH)
+#undef NODE_LAYOUT_MATCH
+#endif
 }
 
-// return a pointer to a child at cell_num of an internal node
-uint32_t *internal_node_cell(void *node, uint32_t cell_num)
+// page sizes are powers of two so pages line up with the device's blocks
+bool is_valid_page_size(uint32_t page_size)
 {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+  return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE && (page_size & (page_size - 1)) == 0;
 }
 
 /**
- * The key of an internal node immediately follows the cell (child)
- * This method is a getter and setter
+ * KEY SEARCH
+ *
+ * Both node types keep their keys in a sorted, contiguous array of
+ * KEY_SIZE keys, so a single lower bound search serves leaf_node_find and
+ * internal_node_find_child.
+ *
+ * Large arrays are first narrowed with a branchless bisection (the
+ * comparison becomes a conditional move rather than a branch). The last
+ * KEY_SEARCH_LINEAR_KEYS keys are then compared all at once: since the
+ * array is sorted, the number of keys smaller than the search key is the
+ * position of the lower bound.
  */
-uint32_t *internal_node_key(void *node, uint32_t key_num)
-{
-  return (void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
-}
+#define KEY_SEARCH_LINEAR_KEYS 32
 
-/**
- * Find a child node of a internal node via its child_num ref
- */
-uint32_t *internal_node_child(void *node, uint32_t child_num)
+uint32_t key_array_lower_bound_scalar(const uint32_t *keys, uint32_t num_keys, uint32_t key)
 {
-  uint32_t num_keys = *internal_node_num_keys(node);
-  if (child_num > num_keys)
+  const uint32_t *base = keys;
+  uint32_t n = num_keys;
+  while (n > KEY_SEARCH_LINEAR_KEYS)
   {
-    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-    exit(EXIT_FAILURE);
+    uint32_t half = n / 2;
+    base = (base[half - 1] < key) ? base + half : base;
+    n -= half;
   }
-  else if (child_num == num_keys)
+
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < n; i++)
   {
-    return internal_node_right_child(node);
-  }
-  else
-  {
-    return internal_node_cell(node, child_num);
+    count += (base[i] < key);
   }
+  return (uint32_t)(base - keys) + count;
 }
 
-NodeType get_node_type(void *node)
-{
-  uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
-  return (NodeType)value;
-}
+#ifdef DBLITE_X86
+/*
+SSE2 and AVX2 only compare signed integers. Flipping the sign bit of
+both sides turns an unsigned comparison into a signed one.
+*/
+#define KEY_SEARCH_SIGN_BIT ((int)0x80000000)
 
-/**
- * get the last key of a node
- *
- * For internal nodes:
- * 1. Get the key number for the last key by subtracting 1 from num of keys
- * 2. Get the cell at the key number from 1
- * 3. Shift forward by cell size
- */
-uint32_t get_node_max_key(void *node)
+// SSE2 is part of the x86-64 baseline, so this path needs no CPU check
+uint32_t key_array_lower_bound_sse2(const uint32_t *keys, uint32_t num_keys, uint32_t key)
 {
-  switch (get_node_type(node))
+  const uint32_t *base = keys;
+  uint32_t n = num_keys;
+  while (n > KEY_SEARCH_LINEAR_KEYS)
   {
-  case NODE_INTERNAL:
-    return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-  case NODE_LEAF:
-    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    uint32_t half = n / 2;
+    base = (base[half - 1] < key) ? base + half : base;
+    n -= half;
   }
-}
-
-void set_node_type(void *node, NodeType type)
-{
-  uint8_t value = type;
-  /**
-   * store the sum of the node and NODE_TYPE_OFFSET in a uint8_t
-   * if the value is greater than a uint8_t, it will be truncated to a uint8_t
-   *
-   * Since the node type is constrained to a uint8_t size, then the result
-   * of this truncation will be the node type
-   */
-  *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
-}
 
-void set_node_root(void *node, bool is_root)
-{
-  uint8_t value = is_root;
-  *((uint8_t *)(node + IS_ROOT_OFFSET)) = value;
+  __m128i sign = _mm_set1_epi32(KEY_SEARCH_SIGN_BIT);
+  __m128i needle = _mm_xor_si128(_mm_set1_epi32((int)key), sign);
+  uint32_t count = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(base + i)), sign);
+    // one bit per key that is smaller than the needle
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(needle, block)));
+    count += __builtin_popcount(mask);
+  }
+  for (; i < n; i++)
+  {
+    count += (base[i] < key);
+  }
+  return (uint32_t)(base - keys) + count;
 }
 
-void initialize_leaf_node(void *node)
+__attribute__((target("avx2"))) uint32_t key_array_lower_bound_avx2(const uint32_t *keys, uint32_t num_keys, uint32_t key)
 {
-  set_node_type(node, NODE_LEAF);
-  set_node_root(node, false);
-  *leaf_node_num_cells(node) = 0;
-  *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
-}
+  const uint32_t *base = keys;
+  uint32_t n = num_keys;
+  while (n > KEY_SEARCH_LINEAR_KEYS)
+  {
+    uint32_t half = n / 2;
+    base = (base[half - 1] < key) ? base + half : base;
+    n -= half;
+  }
 
-void initialize_internal_node(void *node)
-{
-  set_node_type(node, NODE_INTERNAL);
-  set_node_root(node, false);
-  *internal_node_num_keys(node) = 0;
+  __m256i sign = _mm256_set1_epi32(KEY_SEARCH_SIGN_BIT);
+  __m256i needle = _mm256_xor_si256(_mm256_set1_epi32((int)key), sign);
+  uint32_t count = 0;
+  uint32_t i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(base + i)), sign);
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle, block)));
+    count += __builtin_popcount(mask);
+  }
+  for (; i < n; i++)
+  {
+    count += (base[i] < key);
+  }
+  return (uint32_t)(base - keys) + count;
 }
+#endif
 
-// </TREE DEFINITIONS>
-
-// display a prompt requesting input
-void print_prompt() { printf("db > "); }
-
-void read_input(InputBuffer *input_buffer)
+// the same searches for tables with 64-bit keys
+uint32_t key_array_lower_bound_64_scalar(const uint64_t *keys, uint32_t num_keys, uint64_t key)
 {
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-
-  /*
-  &(input_buffer->buffer)
-
-  a pointer to the variable we use to point to the buffer containing the read line.
-  If it set to NULL it is mallocatted by getline and should thus be freed by the user, even if the command fails.
-
-  Use & to retrieve the address of a variable. the address of a variable is a pointer
-  input_buffer points to the buffer; it's a pointer
-  */
-
-  /*
- getline returns a ssize_t, the size of the buffer read from input
- */
-
-  if (bytes_read <= 0)
+  const uint64_t *base = keys;
+  uint32_t n = num_keys;
+  while (n > KEY_SEARCH_LINEAR_KEYS)
   {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+    uint32_t half = n / 2;
+    base = (base[half - 1] < key) ? base + half : base;
+    n -= half;
   }
 
-  // Ignore trailing newline
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
-}
-
-void close_input_buffer(InputBuffer *input_buffer)
-{
-  free(input_buffer->buffer);
-  free(input_buffer);
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    count += (base[i] < key);
+  }
+  return (uint32_t)(base - keys) + count;
 }
 
+#ifdef DBLITE_X86
 /*
-Write the content of a page into memory
+SSE2 has no 64-bit comparison (it came with SSE4.2), so 64-bit keys use
+the scalar search unless the CPU has AVX2, which compares four at a time.
 */
-void pager_flush(Pager *pager, uint32_t page_num)
+#define KEY_SEARCH_SIGN_BIT_64 ((long long)0x8000000000000000ULL)
+
+__attribute__((target("avx2"))) uint32_t key_array_lower_bound_64_avx2(const uint64_t *keys, uint32_t num_keys, uint64_t key)
 {
-  if (pager->pages[page_num] == NULL)
+  const uint64_t *base = keys;
+  uint32_t n = num_keys;
+  while (n > KEY_SEARCH_LINEAR_KEYS)
   {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+    uint32_t half = n / 2;
+    base = (base[half - 1] < key) ? base + half : base;
+    n -= half;
   }
 
-  // page_num = 1 && PAGE_SIZE = 4096
-  // results in the pointer moving to the beginning of the second page
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-  if (offset == -1)
+  __m256i sign = _mm256_set1_epi64x(KEY_SEARCH_SIGN_BIT_64);
+  __m256i needle = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), sign);
+  uint32_t count = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4)
   {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+    __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(base + i)), sign);
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, block)));
+    count += __builtin_popcount(mask);
+  }
+  for (; i < n; i++)
+  {
+    count += (base[i] < key);
   }
+  return (uint32_t)(base - keys) + count;
+}
+#endif
 
-  // write the content of a page, at <size> size, into the file
-  // the file is identified by the descriptor (0 for stdin, 1 for stdout)
-  ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+typedef uint32_t (*KeySearchFunction)(const uint32_t *keys, uint32_t num_keys, uint32_t key);
+typedef uint32_t (*KeySearchFunction64)(const uint64_t *keys, uint32_t num_keys, uint64_t key);
 
-  if (bytes_written == -1)
+// chosen by key_search_init (see dblite_init), once we know what the CPU supports
+KeySearchFunction key_array_lower_bound_impl = NULL;
+KeySearchFunction64 key_array_lower_bound_64_impl = NULL;
+
+void key_search_init()
+{
+  key_array_lower_bound_64_impl = key_array_lower_bound_64_scalar;
+  key_array_lower_bound_impl = key_array_lower_bound_scalar;
+#ifdef DBLITE_X86
+  key_array_lower_bound_impl = key_array_lower_bound_sse2;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
   {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+    key_array_lower_bound_impl = key_array_lower_bound_avx2;
+    key_array_lower_bound_64_impl = key_array_lower_bound_64_avx2;
   }
+#endif
 }
 
-/*
-db_close();
+/**
+ * Returns the index of the first key that is >= key,
+ * or num_keys if every key is smaller.
+ * keys is an array of KEY_SIZE keys.
+ */
+uint32_t key_array_lower_bound(const void *keys, uint32_t num_keys, uint64_t key)
+{
+  if (KEY_SIZE == sizeof(uint64_t))
+  {
+    return key_array_lower_bound_64_impl(keys, num_keys, key);
+  }
+  // every 32-bit key is smaller than a key that does not fit in 32 bits
+  if (key > UINT32_MAX)
+  {
+    return num_keys;
+  }
+  return key_array_lower_bound_impl(keys, num_keys, (uint32_t)key);
+}
 
-flushes the page cache to disk
-closes the database file
-frees the memory for the Pager and Table data structures
+/**
+ * LEAF NODE FUNCTIONS
+ */
+// returns a pointer to the start of the leaf node's cells
+uint32_t *leaf_node_num_cells(void *node)
+{
+  return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
 
-*/
-void db_close(Table *table)
+// returns a pointer to the leaf node's key array (KEY_SIZE keys)
+void *leaf_node_keys(void *node)
 {
-  Pager *pager = table->pager;
+  return node + LEAF_NODE_KEYS_OFFSET;
+}
 
-  for (uint32_t i = 0; i < pager->num_pages; i++)
+// returns a cell's (row) key
+uint64_t leaf_node_key(void *node, uint32_t cell_num)
+{
+  void *key = node + LEAF_NODE_KEYS_OFFSET + cell_num * LEAF_NODE_KEY_SIZE;
+  if (LEAF_NODE_KEY_SIZE == sizeof(uint64_t))
   {
-    if (pager->pages[i] == NULL)
-    {
-      continue;
-    }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+    return *(uint64_t *)key;
   }
+  return *(uint32_t *)key;
+}
 
-  int result = close(pager->file_descriptor);
-  if (result == -1)
+void leaf_node_set_key(void *node, uint32_t cell_num, uint64_t value)
+{
+  void *key = node + LEAF_NODE_KEYS_OFFSET + cell_num * LEAF_NODE_KEY_SIZE;
+  if (LEAF_NODE_KEY_SIZE == sizeof(uint64_t))
   {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+    *(uint64_t *)key = value;
   }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+  else
   {
-    void *page = pager->pages[i];
-    if (page)
-    {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+    *(uint32_t *)key = (uint32_t)value;
   }
-  free(pager);
-  free(table);
 }
 
-void print_constants()
+// returns a pointer to a cell's slot; the index of its row in the payload area
+uint16_t *leaf_node_slot(void *node, uint32_t cell_num)
 {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+  return node + LEAF_NODE_SLOTS_OFFSET + cell_num * LEAF_NODE_SLOT_SIZE;
 }
 
-// tokenize the insert statement using strtok
-// then validate input tokens before performing an insert operation
-// check for input length and throw error if too long
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement)
+// returns a pointer to the row stored in a payload slot
+void *leaf_node_payload(void *node, uint32_t slot)
 {
-  statement->type = STATEMENT_INSERT;
+  return node + LEAF_NODE_VALUES_OFFSET + slot * LEAF_NODE_VALUE_SIZE;
+}
 
-  char *keyword = strtok(input_buffer->buffer, " ");
-  char *id_string = strtok(NULL, " ");
-  char *username = strtok(NULL, " ");
-  char *email = strtok(NULL, " ");
+// returns a pointer to the start of a cell's value
+void *leaf_node_value(void *node, uint32_t cell_num)
+{
+  return leaf_node_payload(node, *leaf_node_slot(node, cell_num));
+}
 
-  if (id_string == NULL || username == NULL || email == NULL)
+/**
+ * Returns a payload slot that no cell of the node is using.
+ * The node must not be full.
+ */
+uint32_t leaf_node_free_slot(void *node)
+{
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint8_t used[LEAF_NODE_MAX_CELLS_LIMIT] = {0};
+  for (uint32_t i = 0; i < num_cells; i++)
   {
-    return PREPARE_SYNTAX_ERROR;
+    used[*leaf_node_slot(node, i)] = 1;
   }
 
-  int id = atoi(id_string);
-  if (id < 0)
+  uint32_t slot = 0;
+  while (used[slot])
   {
-    return PREPARE_NEGATIVE_ID;
+    slot++;
   }
+  return slot;
+}
 
-  if (strlen(username) > COLUMN_USERNAME_SIZE)
-  {
-    return PREPARE_STRING_TOO_LONG;
-  }
-  if (strlen(email) > COLUMN_EMAIL_SIZE)
+/**
+ * Writes a cell into a leaf node that has room for it.
+ * Cells from cell_num onwards shift right by one; only their keys and
+ * slots move, the rows stay where they are.
+ */
+void leaf_node_insert_cell(void *node, uint32_t cell_num, uint64_t key, RowView *value)
+{
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t slot = leaf_node_free_slot(node);
+
+  if (cell_num < num_cells)
   {
-    return PREPARE_STRING_TOO_LONG;
+    // e.g if cell num is 1, shift [1..num_cells) to [2..num_cells]
+    // new content will be written at [1]
+    uint32_t num_to_shift = num_cells - cell_num;
+    memmove(leaf_node_keys(node) + (cell_num + 1) * LEAF_NODE_KEY_SIZE,
+            leaf_node_keys(node) + cell_num * LEAF_NODE_KEY_SIZE,
+            num_to_shift * LEAF_NODE_KEY_SIZE);
+    memmove(leaf_node_slot(node, cell_num + 1), leaf_node_slot(node, cell_num),
+            num_to_shift * LEAF_NODE_SLOT_SIZE);
   }
 
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
+  // increase the number of cells in the page (node)
+  *(leaf_node_num_cells(node)) += 1;
+  leaf_node_set_key(node, cell_num, key);
+  *(leaf_node_slot(node, cell_num)) = slot;
+  serialize_row_view(value, leaf_node_payload(node, slot));
+}
 
-  return PREPARE_SUCCESS;
+// fetch the next leaf for a leaf node
+uint32_t *leaf_node_next_leaf(void *node)
+{
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
-// Set the statement type based on the content of the input buffer
-// &(statement->row_to_insert.id) stores the value of the digit read into the address
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement)
+/**
+ * INTERNAL NODE FUNCTIONS
+ */
+// return a pointer to the number of keys for an internal node
+uint32_t *internal_node_num_keys(void *node)
 {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0)
-  {
-    return prepare_insert(input_buffer, statement);
-  }
+  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
 
-  if (strncmp(input_buffer->buffer, "select", 6) == 0)
+// return a pointer to the right child of an internal node
+uint32_t *internal_node_right_child(void *node)
+{
+  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+// return a pointer to a child at cell_num of an internal node
+uint32_t *internal_node_cell(void *node, uint32_t cell_num)
+{
+  return node + INTERNAL_NODE_CHILDREN_OFFSET + cell_num * INTERNAL_NODE_CHILD_SIZE;
+}
+
+// returns a pointer to the internal node's key array (KEY_SIZE keys)
+void *internal_node_keys(void *node)
+{
+  return node + INTERNAL_NODE_KEYS_OFFSET;
+}
+
+/**
+ * The key of an internal node is the max key of the child at the same index
+ */
+uint64_t internal_node_key(void *node, uint32_t key_num)
+{
+  void *key = node + INTERNAL_NODE_KEYS_OFFSET + key_num * INTERNAL_NODE_CELL_KEY_SIZE;
+  if (INTERNAL_NODE_CELL_KEY_SIZE == sizeof(uint64_t))
   {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+    return *(uint64_t *)key;
   }
+  return *(uint32_t *)key;
+}
 
-  if (strncmp(input_buffer->buffer, "update", 6) == 0)
+void internal_node_set_key(void *node, uint32_t key_num, uint64_t value)
+{
+  void *key = node + INTERNAL_NODE_KEYS_OFFSET + key_num * INTERNAL_NODE_CELL_KEY_SIZE;
+  if (INTERNAL_NODE_CELL_KEY_SIZE == sizeof(uint64_t))
   {
-    statement->type = STATEMENT_UPDATE;
-    return PREPARE_SUCCESS;
+    *(uint64_t *)key = value;
   }
-
-  if (strncmp(input_buffer->buffer, "delete", 6) == 0)
+  else
   {
-    statement->type = STATEMENT_DELETE;
-    return PREPARE_SUCCESS;
+    *(uint32_t *)key = (uint32_t)value;
   }
-
-  return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
 /**
- * Get a page
+ * Find a child node of a internal node via its child_num ref
  */
-void *get_page(Pager *pager, uint32_t page_num)
+uint32_t *internal_node_child(void *node, uint32_t child_num)
 {
-  if (page_num > TABLE_MAX_PAGES)
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (child_num > num_keys)
   {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
+    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
     exit(EXIT_FAILURE);
   }
-
-  if (pager->pages[page_num] == NULL)
+  else if (child_num == num_keys)
   {
-    // Cache miss. Allocate memory and load from file.
-    void *page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-    // We might save a partial page at the end of the file
-    if (pager->file_length % PAGE_SIZE)
+    uint32_t *right_child = internal_node_right_child(node);
+    if (*right_child == INVALID_PAGE_NUM)
     {
-      num_pages += 1;
-    }
-
-    if (page_num <= num_pages)
-    {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1)
-      {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
-
-    pager->pages[page_num] = page;
-
-    if (page_num >= pager->num_pages)
-    {
-      pager->num_pages = page_num + 1;
+      printf("Tried to access right child of node, but was invalid page\n");
+      exit(EXIT_FAILURE);
     }
+    return right_child;
+  }
+  else
+  {
+    return internal_node_cell(node, child_num);
   }
-  return pager->pages[page_num];
 }
 
-/**
- * Returns a cursor pointing to a page and row on the table.
- * It will return one of three results:
- *
-  - the position of the key,
-  - the position of another key that we’ll need to move if we want to insert the new key, or
-  - the position one past the last key
-
- *
- * table - The table
- * key - The identifying key for the data object (row)
- * page_num - The page where the data is to be found
- *
-*/
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key)
+NodeType get_node_type(void *node)
 {
-  void *node = get_page(table->pager, page_num);
-  // number of cells in the node (page)
-  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
+  return (NodeType)value;
+}
 
-  Cursor *cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
+void *get_page(Pager *pager, uint32_t page_num);
 
-  // Binary search for the cell (row) that contains the key
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = num_cells;
-  while (one_past_max_index != min_index)
+/**
+ * get the last key of a node
+ *
+ * For internal nodes, the keys only cover the children to the left of
+ * each key. The maximum key is in the right child, so follow right
+ * children down to a leaf.
+ */
+uint64_t get_node_max_key(Pager *pager, void *node)
+{
+  while (get_node_type(node) == NODE_INTERNAL)
   {
-    uint32_t mid_index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, mid_index);
-    // when key is found
-    if (key == key_at_index)
-    {
-      cursor->cell_num = mid_index;
-      return cursor;
-    }
-    // if key cannot be found in right sub-array
-    if (key < key_at_index)
-    {
-      one_past_max_index = mid_index;
-    }
-    else
-    {
-      // if this is always called until the loop stops, then
-      // the cell_num will be one_past_max_index
-      min_index = mid_index + 1;
-    }
+    node = get_page(pager, *internal_node_right_child(node));
   }
+  return leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+}
+
+void set_node_type(void *node, NodeType type)
+{
+  uint8_t value = type;
+  /**
+   * store the sum of the node and NODE_TYPE_OFFSET in a uint8_t
+   * if the value is greater than a uint8_t, it will be truncated to a uint8_t
+   *
+   * Since the node type is constrained to a uint8_t size, then the result
+   * of this truncation will be the node type
+   */
+  *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
+}
 
-  // min_index is the index of the cell that we'll need to move
-  cursor->cell_num = min_index;
-  return cursor;
+void set_node_root(void *node, bool is_root)
+{
+  uint8_t value = is_root;
+  *((uint8_t *)(node + IS_ROOT_OFFSET)) = value;
 }
 
 /**
- * Recursive function to find a cursor pointing to the key
- * to insert the data.
- *
- * 1. Find which child will contain the key
- * 2. Call the internal_node_find() on the child
+ * In order to get a reference to the parent,
+ * we need to start recording in each node a pointer to its parent node.
  */
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key)
+uint32_t *node_parent(void *node) { return node + PARENT_POINTER_OFFSET; }
+
+bool is_node_root(void *node)
 {
-  void *node = get_page(table->pager, page_num);
+  // the first 8 bits of a node define the node's type
+  // + the is_root_offset, we obtain whether the node is root or not
+  uint8_t value = *((uint8_t *)(node + IS_ROOT_OFFSET));
+  return (bool)value;
+}
 
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
+void set_node_format(void *node, uint8_t version)
+{
+  *((uint8_t *)(node + NODE_FORMAT_OFFSET)) = NODE_FORMAT_VERSION_FLAG | version;
+}
 
-  void *child = get_page(table->pager, child_num);
-  switch (get_node_type(child))
+// pages without the version flag predate the format byte
+uint8_t get_node_format(void *node)
+{
+  uint8_t value = *((uint8_t *)(node + NODE_FORMAT_OFFSET));
+  if (!(value & NODE_FORMAT_VERSION_FLAG))
   {
-  case NODE_LEAF:
-    // find the cell to insert the data into
-    return leaf_node_find(table, child_num, key);
-  case NODE_INTERNAL:
-    // recursive call to find the internal node
-    return internal_node_find(table, child_num, key);
+    return NODE_FORMAT_LEGACY;
   }
+  return value & ~NODE_FORMAT_VERSION_FLAG;
+}
+
+void initialize_leaf_node(void *node)
+{
+  set_node_type(node, NODE_LEAF);
+  set_node_format(node, NODE_FORMAT_VERSION);
+  set_node_root(node, false);
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
+}
+
+void initialize_internal_node(void *node)
+{
+  set_node_type(node, NODE_INTERNAL);
+  set_node_format(node, NODE_FORMAT_VERSION);
+  set_node_root(node, false);
+  *internal_node_num_keys(node) = 0;
+  /*
+  Necessary because the root page number is 0; by not initializing an internal
+  node's right child to an invalid page number when initializing the node, we may
+  end up with 0 as the node's right child, which makes the node a parent of the root
+  */
+  *internal_node_right_child(node) = INVALID_PAGE_NUM;
 }
 
+/*
+Version 1 node layout, kept so that older files can be upgraded
+*/
+const uint32_t LEGACY_NODE_COUNT_OFFSET = 6;   // num cells / num keys
+const uint32_t LEGACY_NODE_POINTER_OFFSET = 10; // next leaf / right child
+const uint32_t LEGACY_NODE_BODY_OFFSET = 14;
+// version 1 files have 32-bit keys, so this is a 4-byte key and a 293-byte row
+const uint32_t LEGACY_LEAF_NODE_CELL_SIZE = 2 * sizeof(uint32_t) + COLUMN_USERNAME_SIZE + 1 + COLUMN_EMAIL_SIZE + 1;
+const uint32_t LEGACY_INTERNAL_NODE_CELL_SIZE = 2 * sizeof(uint32_t);
+
 /**
- * Returns a cursor pointing to a position in the table
- * cursor points to either an internal node or leaf node
+ * Rewrites a version 1 node in place using the current layout.
  *
- * table - The table
- * key - The identifying key for the data object (row); key
- *       could be an id.
+ * 1. Copy the old page aside
+ * 2. Re-initialize the node, keeping its type, root flag and parent
+ * 3. Copy each interleaved cell into the key / slot / payload (leaf)
+ * or key / child (internal) arrays
  */
-Cursor *table_find(Table *table, uint32_t key)
+void upgrade_legacy_node(void *node)
 {
-  uint32_t root_page_num = table->root_page_num;
-  void *root_node = get_page(table->pager, root_page_num);
+  uint8_t legacy[PAGE_SIZE];
+  memcpy(legacy, node, PAGE_SIZE);
 
-  if (get_node_type(root_node) == NODE_LEAF)
-  {
-    return leaf_node_find(table, root_page_num, key);
-  }
-  else
+  bool is_root = is_node_root(legacy);
+  uint32_t parent = *node_parent(legacy);
+  uint32_t count = *(uint32_t *)(legacy + LEGACY_NODE_COUNT_OFFSET);
+  uint32_t pointer = *(uint32_t *)(legacy + LEGACY_NODE_POINTER_OFFSET);
+  uint8_t *body = legacy + LEGACY_NODE_BODY_OFFSET;
+
+  switch (get_node_type(legacy))
   {
-    return internal_node_find(table, root_page_num, key);
+  case NODE_LEAF:
+    initialize_leaf_node(node);
+    *leaf_node_next_leaf(node) = pointer;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint8_t *cell = body + i * LEGACY_LEAF_NODE_CELL_SIZE;
+      leaf_node_set_key(node, i, *(uint32_t *)cell);
+      *leaf_node_slot(node, i) = i;
+      memcpy(leaf_node_payload(node, i), cell + sizeof(uint32_t), LEAF_NODE_VALUE_SIZE);
+    }
+    *leaf_node_num_cells(node) = count;
+    break;
+  case NODE_INTERNAL:
+    initialize_internal_node(node);
+    *internal_node_right_child(node) = pointer;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint8_t *cell = body + i * LEGACY_INTERNAL_NODE_CELL_SIZE;
+      *internal_node_cell(node, i) = *(uint32_t *)cell;
+      internal_node_set_key(node, i, *(uint32_t *)(cell + INTERNAL_NODE_CHILD_SIZE));
+    }
+    *internal_node_num_keys(node) = count;
+    break;
   }
+
+  set_node_root(node, is_root);
+  *node_parent(node) = parent;
 }
 
-// cursor pointing to the start of the table
-Cursor *table_start(Table *table)
+/*
+Version 2 nodes have the current layout minus the checksum, so the body
+only has to move past it. Nothing is stored in the last bytes of a
+version 2 page.
+*/
+const uint32_t UNCHECKSUMMED_NODE_HEADER_SIZE = 7;
+
+void upgrade_unchecksummed_node(void *node)
 {
-  // use table_find to get the root node
-  Cursor *cursor = table_find(table, 0);
+  memmove(node + COMMON_NODE_HEADER_SIZE, node + UNCHECKSUMMED_NODE_HEADER_SIZE,
+          PAGE_SIZE - COMMON_NODE_HEADER_SIZE);
+  set_node_format(node, NODE_FORMAT_VERSION);
+}
 
-  void *node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);
+/*
+Page checksums
+
+Every page carries a CRC32C (the Castagnoli polynomial, as used by iSCSI
+and ext4) of its contents, computed in pager_flush and checked when the
+page is read back. x86-64 CPUs with SSE4.2 have an instruction for it
+that consumes 8 bytes at a time; elsewhere a byte-at-a-time table is
+used. Both give the same result.
+
+The instruction takes 3 cycles but a new one can start every cycle, so
+a page is checksummed as three independent streams of
+CRC32C_STREAM_BYTES, which are then combined. Combining uses the fact
+that a CRC is linear: crc(A + B) = shift(crc(A), |B|) ^ crc(B), where
+shift runs a CRC past |B| zero bytes. That shift is a fixed 32x32 bit
+matrix, applied here through four byte-indexed tables.
+*/
+#define CRC32C_POLYNOMIAL 0x82F63B78 // bit reversed, as the instruction uses it
+#define CRC32C_STREAM_BYTES 1360    // 3 streams cover the 4085 checksummed bytes of a 4 KB page
 
-  return cursor;
-}
+uint32_t crc32c_table[256];
+uint32_t crc32c_stream_shift[4][256];
 
-// figure out where to read/write in memory for a row
-// the cursor contains a pointer to the current row
-void *cursor_value(Cursor *cursor)
+// multiply a GF(2) 32x32 matrix by a vector
+uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector)
 {
-  uint32_t page_num = cursor->page_num;
-
-  void *page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
+  uint32_t sum = 0;
+  for (uint32_t i = 0; vector; i++, vector >>= 1)
+  {
+    if (vector & 1)
+    {
+      sum ^= matrix[i];
+    }
+  }
+  return sum;
 }
 
-// move cursor to the next row
-void cursor_advance(Cursor *cursor)
+// fills the tables that move a CRC past CRC32C_STREAM_BYTES zero bytes
+void crc32c_build_stream_shift()
 {
-  uint32_t page_num = cursor->page_num;
-  void *node = get_page(cursor->table->pager, page_num);
+  uint32_t shift[32];
+  uint32_t square[32];
 
-  cursor->cell_num += 1;
-  // When we reach the end of a leaf node
-  if (cursor->cell_num >= (*leaf_node_num_cells(node)))
+  // the operator for one zero bit
+  shift[0] = CRC32C_POLYNOMIAL;
+  for (uint32_t i = 1; i < 32; i++)
   {
-    /* Advance to next leaf node */
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
-    if (next_page_num == 0)
+    shift[i] = 1U << (i - 1);
+  }
+  // square it three times: one zero byte
+  for (int n = 0; n < 3; n++)
+  {
+    for (uint32_t i = 0; i < 32; i++)
     {
-      /* This was rightmost leaf */
-      cursor->end_of_table = true;
+      square[i] = gf2_matrix_times(shift, shift[i]);
     }
-    else
+    memcpy(shift, square, sizeof(shift));
+  }
+  // raise the one-byte operator to CRC32C_STREAM_BYTES by repeated squaring
+  uint32_t result[32];
+  for (uint32_t i = 0; i < 32; i++)
+  {
+    result[i] = 1U << i;
+  }
+  for (uint32_t bytes = CRC32C_STREAM_BYTES; bytes; bytes >>= 1)
+  {
+    if (bytes & 1)
     {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+      for (uint32_t i = 0; i < 32; i++)
+      {
+        square[i] = gf2_matrix_times(shift, result[i]);
+      }
+      memcpy(result, square, sizeof(result));
+    }
+    for (uint32_t i = 0; i < 32; i++)
+    {
+      square[i] = gf2_matrix_times(shift, shift[i]);
+    }
+    memcpy(shift, square, sizeof(shift));
+  }
+
+  for (uint32_t byte = 0; byte < 4; byte++)
+  {
+    for (uint32_t value = 0; value < 256; value++)
+    {
+      crc32c_stream_shift[byte][value] = gf2_matrix_times(result, value << (8 * byte));
     }
   }
 }
 
-/**
- * Pages are not recycled so new pages are at the end of the table
- *
- */
-uint32_t get_unused_page_num(Pager *pager)
+uint32_t crc32c_shift_stream(uint32_t crc)
 {
-  return pager->num_pages;
+  return crc32c_stream_shift[0][crc & 0xff] ^ crc32c_stream_shift[1][(crc >> 8) & 0xff] ^
+         crc32c_stream_shift[2][(crc >> 16) & 0xff] ^ crc32c_stream_shift[3][crc >> 24];
 }
 
-void create_new_root(Table *table, uint32_t right_child_page_num)
+uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t length)
 {
-  /*
-    Handle splitting the root.
+  for (size_t i = 0; i < length; i++)
+  {
+    crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
 
-    1. Old root copied to new page, becomes left child.
-    2. Address of right child passed in.
-    3. Re-initialize root page to contain the new root node.
-    4. New root node points to two children.
-  */
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length)
+{
+  uint64_t crc64 = crc;
+  for (; length >= 3 * CRC32C_STREAM_BYTES; data += 3 * CRC32C_STREAM_BYTES, length -= 3 * CRC32C_STREAM_BYTES)
+  {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    for (uint32_t i = 0; i < CRC32C_STREAM_BYTES; i += sizeof(uint64_t))
+    {
+      uint64_t word0, word1, word2;
+      memcpy(&word0, data + i, sizeof(word0));
+      memcpy(&word1, data + CRC32C_STREAM_BYTES + i, sizeof(word1));
+      memcpy(&word2, data + 2 * CRC32C_STREAM_BYTES + i, sizeof(word2));
+      crc64 = _mm_crc32_u64(crc64, word0);
+      crc1 = _mm_crc32_u64(crc1, word1);
+      crc2 = _mm_crc32_u64(crc2, word2);
+    }
+    crc64 = crc32c_shift_stream(crc32c_shift_stream((uint32_t)crc64) ^ (uint32_t)crc1) ^ (uint32_t)crc2;
+  }
+  for (; length >= sizeof(uint64_t); data += sizeof(uint64_t), length -= sizeof(uint64_t))
+  {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  for (; length > 0; data++, length--)
+  {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
 
-  void *root = get_page(table->pager, table->root_page_num);
-  void *right_child = get_page(table->pager, right_child_page_num);
+typedef uint32_t (*ChecksumFunction)(uint32_t crc, const uint8_t *data, size_t length);
 
-  // get an unallocated page to be used as the left child
-  uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void *left_child = get_page(table->pager, left_child_page_num);
+// chosen by crc32c_init (see dblite_init), like key_array_lower_bound_impl
+ChecksumFunction crc32c_impl = NULL;
 
-  /* Left child has data copied from old root */
-  memcpy(left_child, root, PAGE_SIZE);
-  // left child is no longer the root
-  set_node_root(left_child, false);
+// build the tables and pick the fastest implementation the CPU supports
+void crc32c_init()
+{
+  for (uint32_t i = 0; i < 256; i++)
+  {
+    uint32_t entry = i;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      entry = (entry >> 1) ^ ((entry & 1) ? CRC32C_POLYNOMIAL : 0);
+    }
+    crc32c_table[i] = entry;
+  }
+  crc32c_build_stream_shift();
+  crc32c_impl = crc32c_software;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+  {
+    crc32c_impl = crc32c_sse42;
+  }
+#endif
+}
 
-  /* Root node is a new internal node with one key and two children */
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+  return crc32c_impl(crc, data, length);
+}
 
-  // Point both children to the parent
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
+// the standard CRC32C of data: the register starts as all ones and is inverted at the end
+uint32_t crc32c_checksum(const void *data, size_t length)
+{
+  return ~crc32c(~0U, data, length);
 }
 
-bool is_node_root(void *node)
+// the checksum of everything in the page except the checksum field
+uint32_t page_checksum(void *page)
 {
-  // the first 8 bits of a node define the node's type
-  // + the is_root_offset, we obtain whether the node is root or not
-  uint8_t value = *((uint8_t *)(node + IS_ROOT_OFFSET));
-  return (bool)value;
+  uint32_t crc = ~0U;
+  crc = crc32c(crc, page, NODE_CHECKSUM_OFFSET);
+  crc = crc32c(crc, page + NODE_CHECKSUM_OFFSET + NODE_CHECKSUM_SIZE,
+               PAGE_SIZE - NODE_CHECKSUM_OFFSET - NODE_CHECKSUM_SIZE);
+  return ~crc;
 }
 
-/**
- * In order to get a reference to the parent,
- * we need to start recording in each node a pointer to its parent node.
- */
-uint32_t *node_parent(void *node) { return node + PARENT_POINTER_OFFSET; }
+uint32_t *node_checksum(void *node) { return node + NODE_CHECKSUM_OFFSET; }
 
-uint32_t internal_node_find_child(void *parent_node, uint32_t key)
+// checks a page that was just read; the pages and bytes checked are kept in
+// the stats (not the time, which would take two clock reads per page)
+bool verify_page_checksum(void *page)
 {
-  uint32_t num_keys = *internal_node_num_keys(parent_node);
+  stats.checksums_verified++;
+  stats.checksum_bytes += PAGE_SIZE;
+  return page_checksum(page) == *node_checksum(page);
+}
 
-  /* Binary search */
-  uint32_t min_index = 0;
-  uint32_t max_index = num_keys; /* there is one more child than key */
+// </TREE DEFINITIONS>
 
-  /**
-   * Binary search to find the key
-   *
-   * The key to insert must be less in value than the rightmost child's key
-   * and greater than the leftmost child's key.
-   *
-   * min_index holds the value of the position to write the key
-   */
-  while (min_index != max_index)
+// display a prompt requesting input
+void print_prompt() { printf("db > "); }
+
+/*
+Refill the chunk with more input
+
+1. Move the unread part of the chunk to its start
+2. Grow the chunk if a single line fills all of it
+3. Read as much as fits from the file descriptor
+*/
+void fill_input_chunk(InputBuffer *input_buffer)
+{
+  size_t unread = input_buffer->chunk_length - input_buffer->chunk_offset;
+  memmove(input_buffer->chunk, input_buffer->chunk + input_buffer->chunk_offset, unread);
+  input_buffer->chunk_length = unread;
+  input_buffer->chunk_offset = 0;
+
+  if (unread == input_buffer->chunk_capacity)
   {
-    uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(parent_node, index);
-    if (key_to_right >= key)
-    {
-      max_index = index;
-    }
-    else
+    input_buffer->chunk_capacity *= 2;
+    input_buffer->chunk = realloc(input_buffer->chunk, input_buffer->chunk_capacity + 1);
+  }
+
+  // anything printed so far (e.g the prompt) must be visible before we
+  // block; in batch mode input is read on its own thread, and the main
+  // thread flushes when it waits for it instead
+  if (!shell.batch)
+  {
+    fflush(stdout);
+  }
+
+  ssize_t bytes_read = read(input_buffer->file_descriptor,
+                            input_buffer->chunk + unread,
+                            input_buffer->chunk_capacity - unread);
+  if (bytes_read == -1)
+  {
+    if (errno == EINTR)
     {
-      min_index = index + 1;
+      return;
     }
+    printf("Error reading input\n");
+    exit(EXIT_FAILURE);
   }
-
-  return min_index;
+  if (bytes_read == 0)
+  {
+    input_buffer->end_of_input = true;
+  }
+  input_buffer->chunk_length += bytes_read;
 }
 
+/*
+Read the next line into input_buffer->buffer
+Returns false once the input is exhausted
+*/
+bool read_input(InputBuffer *input_buffer)
+{
+  for (;;)
+  {
+    char *line = input_buffer->chunk + input_buffer->chunk_offset;
+    size_t unread = input_buffer->chunk_length - input_buffer->chunk_offset;
+    char *newline = memchr(line, '\n', unread);
+
+    if (newline != NULL || (input_buffer->end_of_input && unread > 0))
+    {
+      // a line without a trailing newline ends at the end of input
+      size_t line_length = newline ? (size_t)(newline - line) : unread;
+
+      // Ignore trailing newline
+      line[line_length] = 0;
+      input_buffer->buffer = line;
+      input_buffer->input_length = line_length;
+      input_buffer->chunk_offset += newline ? line_length + 1 : line_length;
+      return true;
+    }
+
+    if (input_buffer->end_of_input)
+    {
+      return false;
+    }
+
+    fill_input_chunk(input_buffer);
+  }
+}
+
+// whether read_input can return the next line without reading more input
+bool input_line_buffered(InputBuffer *input_buffer)
+{
+  size_t unread = input_buffer->chunk_length - input_buffer->chunk_offset;
+  return input_buffer->end_of_input ||
+         memchr(input_buffer->chunk + input_buffer->chunk_offset, '\n', unread) != NULL;
+}
+
+// whether a line, or the end of input, can be read without blocking
+bool input_waiting(InputBuffer *input_buffer)
+{
+  struct pollfd input = {input_buffer->file_descriptor, POLLIN, 0};
+  return input_line_buffered(input_buffer) || poll(&input, 1, 0) != 0;
+}
+
+void close_input_buffer(InputBuffer *input_buffer)
+{
+  free(input_buffer->chunk);
+  free(input_buffer);
+}
+
+/*
+PAGE COMPRESSION
+
+Leaves are mostly NUL padding (usernames and emails are stored in fixed
+33 and 256 byte columns), so they compress very well. With `-compress`,
+pager_flush compresses each page and writes it at its usual place in
+the file, followed by a hole punched through the rest of the page. The
+file keeps one fixed slot per page, so no page map is needed: the file
+system stores only the blocks the compressed page uses, and reading the
+hole costs no I/O.
+
+Space is saved in whole file system blocks, so this helps with pages
+larger than a block (e.g -pagesize 16384 on a 4 KB block file system).
+A page that would not free at least one block is written as it is.
+
+A compressed page starts with a marker no node type uses:
+
+ * byte 0: COMPRESSED_PAGE_MARKER
+ * byte 1: algorithm (COMPRESSION_LZ4)
+ * byte 4 - 7: compressed length
+ * byte 8 - : LZ4 block
+
+The compressor and decompressor below implement the LZ4 block format,
+so there is no library to link against. The page's own checksum covers
+the uncompressed page and is checked after decompression.
+*/
+#define COMPRESSED_PAGE_MARKER 0xC5
+#define COMPRESSION_LZ4 1
+#define COMPRESSED_PAGE_HEADER_SIZE 8
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // a block always ends with this many literals
+#define LZ4_MATCH_LIMIT 12  // and no match starts this close to the end
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+uint32_t lz4_read32(const uint8_t *p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// writes a length of 15 or more as the 255-byte run LZ4 uses
+uint8_t *lz4_write_length(uint8_t *op, uint32_t length)
+{
+  for (; length >= 255; length -= 255)
+  {
+    *op++ = 255;
+  }
+  *op++ = length;
+  return op;
+}
+
+/*
+Greedy LZ4 compression: a hash table remembers the last position of
+each 4 byte sequence, and a match is taken as soon as one is found.
+Returns the compressed length, or 0 if it does not fit in capacity.
+*/
+uint32_t lz4_compress(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t capacity)
+{
+  uint32_t table[1 << LZ4_HASH_BITS] = {0}; // position + 1 of a sequence; 0 is empty
+  const uint8_t *ip = source;
+  const uint8_t *anchor = source;
+  const uint8_t *end = source + length;
+  uint8_t *op = destination;
+  uint8_t *op_end = destination + capacity;
+
+  while (length > LZ4_MATCH_LIMIT && ip < end - LZ4_MATCH_LIMIT)
+  {
+    uint32_t sequence = lz4_read32(ip);
+    uint32_t hash = (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+    uint32_t candidate = table[hash];
+    uint32_t position = ip - source;
+    table[hash] = position + 1;
+
+    // compare positions first: an empty entry has no pointer to form
+    if (candidate == 0 || position - (candidate - 1) > LZ4_MAX_OFFSET ||
+        lz4_read32(source + candidate - 1) != sequence)
+    {
+      ip++;
+      continue;
+    }
+    const uint8_t *match = source + candidate - 1;
+
+    uint32_t match_length = LZ4_MIN_MATCH;
+    while (ip + match_length < end - LZ4_LAST_LITERALS && match[match_length] == ip[match_length])
+    {
+      match_length++;
+    }
+
+    uint32_t literals = ip - anchor;
+    // token, literal length, literals, offset, match length
+    if (op + 1 + literals / 255 + 1 + literals + 2 + match_length / 255 + 1 > op_end)
+    {
+      return 0;
+    }
+    uint8_t *token = op++;
+    *token = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15)
+    {
+      op = lz4_write_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    uint16_t offset = ip - match;
+    memcpy(op, &offset, sizeof(offset)); // little endian, like the file's integers
+    op += sizeof(offset);
+
+    uint32_t stored_length = match_length - LZ4_MIN_MATCH;
+    *token |= stored_length >= 15 ? 15 : stored_length;
+    if (stored_length >= 15)
+    {
+      op = lz4_write_length(op, stored_length - 15);
+    }
+
+    ip += match_length;
+    anchor = ip;
+  }
+
+  uint32_t literals = end - anchor;
+  if (op + 1 + literals / 255 + 1 + literals > op_end)
+  {
+    return 0;
+  }
+  uint8_t *token = op++;
+  *token = (literals >= 15 ? 15 : literals) << 4;
+  if (literals >= 15)
+  {
+    op = lz4_write_length(op, literals - 15);
+  }
+  memcpy(op, anchor, literals);
+  op += literals;
+
+  return op - destination;
+}
+
+// returns the decompressed length, or 0 if the block is malformed
+uint32_t lz4_decompress(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t capacity)
+{
+  const uint8_t *ip = source;
+  const uint8_t *end = source + length;
+  uint8_t *op = destination;
+  uint8_t *op_end = destination + capacity;
+
+  while (ip < end)
+  {
+    uint8_t token = *ip++;
+
+    uint32_t literals = token >> 4;
+    if (literals == 15)
+    {
+      uint8_t byte;
+      do
+      {
+        if (ip >= end)
+        {
+          return 0;
+        }
+        byte = *ip++;
+        literals += byte;
+      } while (byte == 255);
+    }
+    if (literals > (uint32_t)(end - ip) || literals > (uint32_t)(op_end - op))
+    {
+      return 0;
+    }
+    memcpy(op, ip, literals);
+    ip += literals;
+    op += literals;
+
+    if (ip == end)
+    {
+      // the last sequence has no match
+      break;
+    }
+
+    uint16_t offset;
+    if (end - ip < (ptrdiff_t)sizeof(offset))
+    {
+      return 0;
+    }
+    memcpy(&offset, ip, sizeof(offset));
+    ip += sizeof(offset);
+    if (offset == 0 || offset > op - destination)
+    {
+      return 0;
+    }
+
+    uint32_t match_length = token & 15;
+    if (match_length == 15)
+    {
+      uint8_t byte;
+      do
+      {
+        if (ip >= end)
+        {
+          return 0;
+        }
+        byte = *ip++;
+        match_length += byte;
+      } while (byte == 255);
+    }
+    match_length += LZ4_MIN_MATCH;
+    if (match_length > (uint32_t)(op_end - op))
+    {
+      return 0;
+    }
+
+    // the match may overlap the bytes it produces (e.g a run of NULs)
+    const uint8_t *match = op - offset;
+    for (uint32_t i = 0; i < match_length; i++)
+    {
+      op[i] = match[i];
+    }
+    op += match_length;
+  }
+
+  return op - destination;
+}
+
+/*
+Compress a page into pager->compression_buffer. Returns how many bytes
+to write (whole blocks), or 0 if compressing would not save a block.
+*/
+uint32_t compress_page(Pager *pager, void *page)
+{
+  if (pager->block_size >= PAGE_SIZE)
+  {
+    return 0;
+  }
+
+  uint8_t *frame = pager->compression_buffer;
+  uint32_t capacity = PAGE_SIZE - pager->block_size - COMPRESSED_PAGE_HEADER_SIZE;
+  uint32_t compressed_length = lz4_compress(page, PAGE_SIZE, frame + COMPRESSED_PAGE_HEADER_SIZE, capacity);
+  if (compressed_length == 0)
+  {
+    return 0;
+  }
+
+  memset(frame, 0, COMPRESSED_PAGE_HEADER_SIZE);
+  frame[0] = COMPRESSED_PAGE_MARKER;
+  frame[1] = COMPRESSION_LZ4;
+  memcpy(frame + 4, &compressed_length, sizeof(compressed_length));
+
+  uint32_t frame_length = COMPRESSED_PAGE_HEADER_SIZE + compressed_length;
+  uint32_t written_length = (frame_length + pager->block_size - 1) / pager->block_size * pager->block_size;
+  memset(frame + frame_length, 0, written_length - frame_length);
+  return written_length;
+}
+
+// decompress a page in place; false if it is damaged
+bool decompress_page(Pager *pager, void *page)
+{
+  uint8_t *frame = page;
+  uint32_t compressed_length;
+  memcpy(&compressed_length, frame + 4, sizeof(compressed_length));
+  if (frame[1] != COMPRESSION_LZ4 || compressed_length > PAGE_SIZE - COMPRESSED_PAGE_HEADER_SIZE)
+  {
+    return false;
+  }
+
+  // the workers of a parallel scan load pages at the same time; flushes,
+  // which compress into the buffer, never run alongside them
+  pthread_mutex_lock(&pager->compression_lock);
+  memcpy(pager->compression_buffer, frame + COMPRESSED_PAGE_HEADER_SIZE, compressed_length);
+  bool valid = lz4_decompress(pager->compression_buffer, compressed_length, page, PAGE_SIZE) == PAGE_SIZE;
+  pthread_mutex_unlock(&pager->compression_lock);
+  return valid;
+}
+
+/*
+Pager I/O
+
+Every write and fsync of the database file goes through these two
+pointers, so a program that embeds the engine can interpose on them,
+e.g the crash harness in torture/torture.c injects failures there. They
+have the signatures of pwrite and fsync, which they default to.
+*/
+typedef ssize_t (*PagerWriteFunction)(int fd, const void *data, size_t length, off_t offset);
+typedef int (*PagerSyncFunction)(int fd);
+
+PagerWriteFunction pager_write_function = pwrite;
+PagerSyncFunction pager_sync_function = fsync;
+
+/*
+Write the content of a page into memory
+*/
+void pager_flush(Pager *pager, uint32_t page_num)
+{
+  if (pager->pages[page_num] == NULL)
+  {
+    printf("Tried to flush null page\n");
+    exit(EXIT_FAILURE);
+  }
+
+  *node_checksum(pager->pages[page_num]) = page_checksum(pager->pages[page_num]);
+
+  // page_num = 1 && PAGE_SIZE = 4096
+  // results in the pointer moving to the beginning of the second page
+  off_t offset = (off_t)page_num * PAGE_SIZE;
+  void *data = pager->pages[page_num];
+  uint32_t length = PAGE_SIZE;
+
+  if (pager->compress)
+  {
+    uint32_t compressed_length = compress_page(pager, data);
+    if (compressed_length > 0)
+    {
+      data = pager->compression_buffer;
+      length = compressed_length;
+    }
+  }
+
+  // a compressed page at the end of the file still takes a whole page,
+  // so the file stays a whole number of pages
+  if (length < PAGE_SIZE && offset + PAGE_SIZE > pager->file_length &&
+      ftruncate(pager->file_descriptor, offset + PAGE_SIZE) == -1)
+  {
+    printf("Error extending db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  // write the content of a page, at <size> size, into the file
+  ssize_t bytes_written = pager_write_function(pager->file_descriptor, data, length, offset);
+
+  if (bytes_written == -1)
+  {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (length < PAGE_SIZE)
+  {
+    // release the blocks after the compressed page; a file system that
+    // cannot punch holes keeps them, which wastes the space but is harmless
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(pager->file_descriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              offset + length, PAGE_SIZE - length);
+#endif
+    stats.pages_compressed++;
+    stats.compressed_bytes += length;
+  }
+
+  if (offset + PAGE_SIZE > pager->file_length)
+  {
+    pager->file_length = offset + PAGE_SIZE;
+  }
+  stats.pages_written++;
+  stats_unsynced_bytes += bytes_written;
+}
+
+/*
+Make the pages written so far durable
+*/
+void pager_sync(Pager *pager)
+{
+  if (pager_sync_function(pager->file_descriptor) == -1)
+  {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  stats.bytes_fsynced += stats_unsynced_bytes;
+  stats_unsynced_bytes = 0;
+}
+
+/*
+The page frame arena
+
+All frames of the page cache come from one allocation made when the pager
+is opened, so a cache miss in get_page never calls malloc. Frame i holds
+page i. The arena is a single anonymous mapping: the kernel only backs it
+with memory as frames are touched, and it is rounded up to whole huge
+pages so it can be backed by them.
+
+1. Try an explicit huge page mapping (needs reserved huge pages)
+2. Fall back to normal pages and ask for transparent huge pages
+
+The arena is TABLE_MAX_PAGES pages of the file's page size, which with
+64 KB pages and a large TABLE_MAX_PAGES (as in make bench) is more than
+the machine's memory. The fallback mapping is MAP_NORESERVE, so the
+kernel does not count the untouched frames against it.
+*/
+#define PAGE_ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+void *page_arena_allocate(size_t size, size_t *allocated_size)
+{
+  size_t rounded = (size + PAGE_ARENA_HUGE_PAGE_SIZE - 1) & ~((size_t)PAGE_ARENA_HUGE_PAGE_SIZE - 1);
+  void *arena = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  arena = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (arena == MAP_FAILED)
+  {
+    arena = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED)
+    {
+      printf("Unable to allocate page cache: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(arena, rounded, MADV_HUGEPAGE);
+#endif
+  }
+
+  *allocated_size = rounded;
+  return arena;
+}
+
+void page_arena_free(void *arena, size_t size)
+{
+  munmap(arena, size);
+}
+
+/*
+.backup
+
+Pages only reach the file when the database is closed, so the file
+always holds the state of the last db_close: a consistent tree whose
+pages are not written again until the next one. That committed state is
+what a backup copies. Rows inserted since the file was opened live only
+in the page cache and are not part of it.
+
+Because the file does not change while the database is open, a backup
+needs no lock and no copy of the pages in memory. It is copied in steps
+of BACKUP_STEP_PAGES pages so it can be interleaved with statements,
+and db_close finishes a backup in progress before it writes anything.
+
+A step copies in the kernel with copy_file_range, falling back to
+sendfile and then to read and write where the file system does not
+support it. The holes of a compressed file are skipped with SEEK_DATA,
+so the copy is as sparse as the original.
+
+The destination is opened with O_TRUNC, so a path that names the
+database file itself is refused before it is opened.
+*/
+#define BACKUP_STEP_PAGES 256
+
+struct Backup
+{
+  char *path;
+  int source_descriptor;
+  int destination_descriptor;
+  off_t length; // size of the committed file when the backup began
+  off_t copied; // everything before this offset has been copied
+};
+
+// whether path names the open database file, under this name or another
+bool is_database_file(Pager *pager, const char *path)
+{
+  struct stat path_stat;
+  struct stat database_stat;
+  if (stat(path, &path_stat) == -1 || fstat(pager->file_descriptor, &database_stat) == -1)
+  {
+    return false;
+  }
+  return path_stat.st_dev == database_stat.st_dev && path_stat.st_ino == database_stat.st_ino;
+}
+
+Backup *backup_begin(Table *table, const char *path)
+{
+  if (table->backup != NULL)
+  {
+    printf("A backup is already in progress.\n");
+    return NULL;
+  }
+  if (is_database_file(table->pager, path))
+  {
+    printf("Cannot back up the database onto itself.\n");
+    return NULL;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1)
+  {
+    printf("Unable to open backup file %s: %d\n", path, errno);
+    return NULL;
+  }
+
+  Pager *pager = table->pager;
+  struct stat file_stat;
+  if (fstat(pager->file_descriptor, &file_stat) == -1)
+  {
+    printf("Error reading db file size: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  // sizing the copy up front leaves the skipped holes as holes
+  if (ftruncate(fd, file_stat.st_size) == -1)
+  {
+    printf("Error sizing backup file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  Backup *backup = malloc(sizeof(Backup));
+  backup->path = strdup(path);
+  backup->source_descriptor = pager->file_descriptor;
+  backup->destination_descriptor = fd;
+  backup->length = file_stat.st_size;
+  backup->copied = 0;
+  table->backup = backup;
+  return backup;
+}
+
+/*
+Copy length bytes at offset from one file to the same offset of another
+*/
+void backup_copy_range(Backup *backup, off_t offset, size_t length)
+{
+  int in = backup->source_descriptor;
+  int out = backup->destination_descriptor;
+
+  while (length > 0)
+  {
+    off_t in_offset = offset;
+    off_t out_offset = offset;
+    ssize_t copied = copy_file_range(in, &in_offset, out, &out_offset, length, 0);
+    if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+    {
+      // sendfile writes at the current offset of the output file
+      if (lseek(out, offset, SEEK_SET) == -1)
+      {
+        printf("Error seeking backup file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      in_offset = offset;
+      copied = sendfile(out, in, &in_offset, length);
+    }
+    if (copied == -1 && (errno == EINVAL || errno == ENOSYS))
+    {
+      uint8_t buffer[DEFAULT_PAGE_SIZE];
+      size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+      copied = pread(in, buffer, chunk, offset);
+      if (copied > 0 && pwrite(out, buffer, copied, offset) != copied)
+      {
+        copied = -1;
+      }
+    }
+    if (copied <= 0)
+    {
+      printf("Error copying backup: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    offset += copied;
+    length -= copied;
+  }
+}
+
+/*
+Copy up to max_pages more pages; returns true once the whole file has
+been copied
+*/
+bool backup_step(Backup *backup, uint32_t max_pages)
+{
+  off_t end = backup->copied + (off_t)max_pages * PAGE_SIZE;
+  if (end > backup->length)
+  {
+    end = backup->length;
+  }
+
+  off_t offset = backup->copied;
+  while (offset < end)
+  {
+    off_t data = lseek(backup->source_descriptor, offset, SEEK_DATA);
+    if (data == -1 && errno == ENXIO)
+    {
+      // only a hole is left
+      break;
+    }
+    if (data == -1)
+    {
+      // no SEEK_DATA on this file system; copy everything
+      data = offset;
+    }
+    if (data >= end)
+    {
+      break;
+    }
+    off_t hole = lseek(backup->source_descriptor, data, SEEK_HOLE);
+    if (hole == -1 || hole > end)
+    {
+      hole = end;
+    }
+    backup_copy_range(backup, data, hole - data);
+    offset = hole;
+  }
+
+  backup->copied = end;
+  return backup->copied == backup->length;
+}
+
+/*
+Complete the backup and make it durable; returns the number of pages
+copied
+*/
+uint32_t backup_finish(Table *table, Backup *backup)
+{
+  while (!backup_step(backup, BACKUP_STEP_PAGES))
+  {
+  }
+  if (fsync(backup->destination_descriptor) == -1 || close(backup->destination_descriptor) == -1)
+  {
+    printf("Error syncing backup file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t pages = backup->length / PAGE_SIZE;
+  table->backup = NULL;
+  free(backup->path);
+  free(backup);
+  return pages;
+}
+
+/*
+db_close();
+
+flushes the page cache to disk
+closes the database file
+frees the memory for the Pager and Table data structures
+
+*/
+void db_close(Table *table)
+{
+  Pager *pager = table->pager;
+
+  // the backup copies the file as it was before this flush
+  if (table->backup != NULL)
+  {
+    backup_finish(table, table->backup);
+  }
+
+  for (uint32_t i = 0; i < pager->num_pages; i++)
+  {
+    if (pager->pages[i] == NULL)
+    {
+      continue;
+    }
+    pager_flush(pager, i);
+    pager->pages[i] = NULL;
+  }
+  pager_sync(pager);
+
+  int result = close(pager->file_descriptor);
+  if (result == -1)
+  {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  // every page frame belongs to the arena, so one call releases them all
+  page_arena_free(pager->frames, pager->frames_size);
+  free(pager->compression_buffer);
+  free(pager);
+  free(table);
+}
+
+void print_constants()
+{
+  printf("ROW_SIZE: %d\n", ROW_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+}
+
+/**
+ * Returns the next space separated token of the line and moves *position
+ * past it. The token points into the line; nothing is copied.
+ * Returns false if the line has no more tokens.
+ */
+bool next_token(const char **position, const char *end, StringView *token)
+{
+  const char *start = *position;
+  // skip repeated separators
+  while (start < end && *start == ' ')
+  {
+    start++;
+  }
+  if (start == end)
+  {
+    return false;
+  }
+
+  const char *separator = memchr(start, ' ', end - start);
+  const char *token_end = separator ? separator : end;
+
+  token->data = start;
+  token->length = token_end - start;
+  *position = token_end;
+  return true;
+}
+
+/**
+ * Parses a decimal id the way atoi would: leading digits only. An id
+ * must be from 0 to MAX_KEY, the largest key of the table.
+ */
+PrepareResult parse_id(StringView token, uint64_t *id)
+{
+  const char *digit = token.data;
+  const char *end = token.data + token.length;
+  bool negative = false;
+  if (digit < end && (*digit == '-' || *digit == '+'))
+  {
+    negative = (*digit == '-');
+    digit++;
+  }
+
+  uint64_t value = 0;
+  while (digit < end && *digit >= '0' && *digit <= '9')
+  {
+    uint32_t digit_value = *digit - '0';
+    if (value > (MAX_KEY - digit_value) / 10)
+    {
+      return negative ? PREPARE_NEGATIVE_ID : PREPARE_ID_TOO_LARGE;
+    }
+    value = value * 10 + digit_value;
+    digit++;
+  }
+  // the magnitude was range checked above and is never negated
+  if (negative && value != 0)
+  {
+    return PREPARE_NEGATIVE_ID;
+  }
+  *id = value;
+  return PREPARE_SUCCESS;
+}
+
+// validate the values of one row of an insert
+PrepareResult prepare_insert_row(StringView id_string, StringView username, StringView email, RowView *row)
+{
+  uint64_t id;
+  PrepareResult result = parse_id(id_string, &id);
+  if (result != PREPARE_SUCCESS)
+  {
+    return result;
+  }
+
+  if (username.length > COLUMN_USERNAME_SIZE)
+  {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  if (email.length > COLUMN_EMAIL_SIZE)
+  {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  row->id = id;
+  row->username = username;
+  row->email = email;
+  return PREPARE_SUCCESS;
+}
+
+// tokenize the insert statement in place
+// then validate input tokens before performing an insert operation
+// check for input length and throw error if too long
+// more rows may follow the first: insert 1 foo a@b.c 2 bar d@e.f ...
+PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement)
+{
+  statement->type = STATEMENT_INSERT;
+
+  const char *position = input_buffer->buffer;
+  const char *end = input_buffer->buffer + input_buffer->input_length;
+  StringView keyword, id_string, username, email;
+
+  if (!next_token(&position, end, &keyword) ||
+      !next_token(&position, end, &id_string) ||
+      !next_token(&position, end, &username) ||
+      !next_token(&position, end, &email))
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  PrepareResult result = prepare_insert_row(id_string, username, email, &statement->row_to_insert);
+  statement->num_rows = 1;
+  statement->values = (StringView){id_string.data, end - id_string.data};
+
+  while (result == PREPARE_SUCCESS && next_token(&position, end, &id_string))
+  {
+    if (!next_token(&position, end, &username) || !next_token(&position, end, &email))
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    RowView row;
+    result = prepare_insert_row(id_string, username, email, &row);
+    statement->num_rows++;
+  }
+
+  return result;
+}
+
+/**
+ * Returns the next item of a list separated by commas and/or spaces,
+ * like next_token.
+ */
+bool next_list_item(const char **position, const char *end, StringView *item)
+{
+  const char *start = *position;
+  while (start < end && (*start == ' ' || *start == ','))
+  {
+    start++;
+  }
+  if (start == end)
+  {
+    return false;
+  }
+
+  const char *item_end = start;
+  while (item_end < end && *item_end != ' ' && *item_end != ',')
+  {
+    item_end++;
+  }
+
+  item->data = start;
+  item->length = item_end - start;
+  *position = item_end;
+  return true;
+}
+
+bool string_view_equals(StringView view, const char *text)
+{
+  return view.length == strlen(text) && strncmp(view.data, text, view.length) == 0;
+}
+
+// select where id between 10 and 20: the key range of the statement
+PrepareResult prepare_select_range(const char *position, const char *end, Statement *statement)
+{
+  StringView first;
+  StringView word;
+  StringView last;
+  StringView extra;
+  if (!next_token(&position, end, &first) ||
+      !next_token(&position, end, &word) || !string_view_equals(word, "and") ||
+      !next_token(&position, end, &last) || next_token(&position, end, &extra))
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  PrepareResult result = parse_id(first, &statement->first_key);
+  if (result == PREPARE_SUCCESS)
+  {
+    result = parse_id(last, &statement->last_key);
+  }
+  return result;
+}
+
+/*
+select, select where id in (1, 2, 3) for the rows of some ids, or
+select where id between 10 and 20 for the rows of a key range
+*/
+PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement)
+{
+  statement->type = STATEMENT_SELECT;
+  statement->num_rows = 0;
+  statement->first_key = 0;
+  statement->last_key = MAX_KEY;
+
+  const char *position = input_buffer->buffer + 6;
+  const char *end = input_buffer->buffer + input_buffer->input_length;
+  StringView word;
+  if (!next_token(&position, end, &word))
+  {
+    return PREPARE_SUCCESS;
+  }
+  if (!string_view_equals(word, "where") ||
+      !next_token(&position, end, &word) || !string_view_equals(word, "id") ||
+      !next_token(&position, end, &word))
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (string_view_equals(word, "between"))
+  {
+    return prepare_select_range(position, end, statement);
+  }
+  if (!string_view_equals(word, "in"))
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  // the ids are the rest of the line, in parentheses
+  while (position < end && *position == ' ')
+  {
+    position++;
+  }
+  while (end > position && end[-1] == ' ')
+  {
+    end--;
+  }
+  if (end - position < 2 || *position != '(' || end[-1] != ')')
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  statement->values = (StringView){position + 1, end - position - 2};
+
+  position = statement->values.data;
+  end = statement->values.data + statement->values.length;
+  StringView id_string;
+  uint64_t id;
+  while (next_list_item(&position, end, &id_string))
+  {
+    PrepareResult result = parse_id(id_string, &id);
+    if (result != PREPARE_SUCCESS)
+    {
+      return result;
+    }
+    statement->num_rows++;
+  }
+  return statement->num_rows > 0 ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+// Set the statement type based on the content of the input buffer
+// &(statement->row_to_insert.id) stores the value of the digit read into the address
+PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement)
+{
+  if (strncmp(input_buffer->buffer, "insert", 6) == 0)
+  {
+    return prepare_insert(input_buffer, statement);
+  }
+
+  if (strncmp(input_buffer->buffer, "select", 6) == 0)
+  {
+    return prepare_select(input_buffer, statement);
+  }
+
+  if (strncmp(input_buffer->buffer, "update", 6) == 0)
+  {
+    statement->type = STATEMENT_UPDATE;
+    return PREPARE_SUCCESS;
+  }
+
+  if (strncmp(input_buffer->buffer, "delete", 6) == 0)
+  {
+    statement->type = STATEMENT_DELETE;
+    return PREPARE_SUCCESS;
+  }
+
+  return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+/*
+Read a page from the file into a page-sized buffer
+
+Pages past the end of the file read as nothing and are left as they
+are. A page that is cut short or fails its checksum is corruption and
+stops the program rather than being used. Pages written by older
+versions are upgraded as they are loaded; they reach the file in the
+new format, with a checksum, on the next flush.
+*/
+void pager_read_page(Pager *pager, uint32_t page_num, void *page)
+{
+  uint32_t num_pages = pager->file_length / PAGE_SIZE;
+
+  // We might save a partial page at the end of the file
+  if (pager->file_length % PAGE_SIZE)
+  {
+    num_pages += 1;
+  }
+
+  if (page_num > num_pages)
+  {
+    return;
+  }
+
+  ssize_t bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+  if (bytes_read == -1)
+  {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  if (bytes_read == 0)
+  {
+    return;
+  }
+  stats.pages_read++;
+
+  if (bytes_read != PAGE_SIZE)
+  {
+    printf("Short read of page %d. Corrupt file.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  if (*(uint8_t *)page == COMPRESSED_PAGE_MARKER && !decompress_page(pager, page))
+  {
+    printf("Page %d could not be decompressed. Corrupt file.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  switch (get_node_format(page))
+  {
+  case NODE_FORMAT_LEGACY:
+    upgrade_legacy_node(page);
+    break;
+  case NODE_FORMAT_UNCHECKSUMMED:
+    upgrade_unchecksummed_node(page);
+    break;
+  case NODE_FORMAT_VERSION:
+    if (!verify_page_checksum(page))
+    {
+      printf("Checksum mismatch on page %d. Corrupt file.\n", page_num);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  default:
+    printf("Page %d has unknown format %d. Corrupt file.\n", page_num, get_node_format(page));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Get a page
+ *
+ * Several threads may read pages at once (server mode, parallel scans).
+ * A miss takes the lock of the page's stripe and looks again, so each
+ * page is read and upgraded once, and the page is published with a
+ * release store so a thread that finds it also sees its contents. A hit
+ * takes no lock.
+ */
+void *get_page(Pager *pager, uint32_t page_num)
+{
+  if (page_num >= TABLE_MAX_PAGES)
+  {
+    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
+    exit(EXIT_FAILURE);
+  }
+
+  void *page = __atomic_load_n(&pager->pages[page_num], __ATOMIC_ACQUIRE);
+  if (page != NULL)
+  {
+    stats.page_cache_hits++;
+    return page;
+  }
+
+  pthread_mutex_t *lock = &pager->load_locks[page_num % PAGE_LOAD_STRIPES];
+  pthread_mutex_lock(lock);
+  page = pager->pages[page_num];
+  if (page == NULL)
+  {
+    // Cache miss. Take the page's frame from the arena and load from file.
+    stats.page_cache_misses++;
+    page = pager->frames + (size_t)page_num * PAGE_SIZE;
+    pager_read_page(pager, page_num, page);
+    __atomic_store_n(&pager->pages[page_num], page, __ATOMIC_RELEASE);
+
+    if (page_num >= pager->num_pages)
+    {
+      pager->num_pages = page_num + 1;
+    }
+  }
+  else
+  {
+    stats.page_cache_hits++;
+  }
+  pthread_mutex_unlock(lock);
+  return page;
+}
+
+/*
+Pinned pages
+
+The root and every internal node are loaded when the file is opened
+(see pin_internal_nodes), and internal nodes made later are made in the
+page cache, so they are always there. A descent reads them with
+pinned_page, straight from the pages array: no bounds check, no miss
+path, no counting (page cache hits count the leaves). It follows that a
+child that is not in the page cache is a leaf.
+
+Leaves are the only pages a scan could push out of a cache, and scans
+do not load them (see Scan ring).
+*/
+void *pinned_page(Pager *pager, uint32_t page_num)
+{
+  return __atomic_load_n(&pager->pages[page_num], __ATOMIC_ACQUIRE);
+}
+
+/*
+Scan ring
+
+A full scan touches every leaf once. Loaded with get_page, every leaf
+would stay in the page cache for good, taking memory from the pages
+lookups use, and be written back when the file is closed. Instead a scan
+reads the leaves that are not in the page cache into a ring of
+SCAN_RING_FRAMES frames of its own and reuses the frames as it goes; the
+leaves that are in the page cache are read where they are. A leaf read
+through the ring stays readable until the ring has read SCAN_RING_FRAMES
+more, so rows must be copied out before then.
+
+Nothing is written while a scan runs, so a leaf that is not in the page
+cache is the same in the file.
+*/
+#define SCAN_RING_FRAMES 4
+
+struct ScanRing
+{
+  void *frames;
+  uint32_t page_nums[SCAN_RING_FRAMES]; // the leaf in each frame
+  uint32_t next;                        // the frame the next read goes into
+};
+
+void scan_ring_init(ScanRing *ring)
+{
+  ring->frames = malloc(SCAN_RING_FRAMES * PAGE_SIZE);
+  for (uint32_t frame = 0; frame < SCAN_RING_FRAMES; frame++)
+  {
+    ring->page_nums[frame] = INVALID_PAGE_NUM;
+  }
+  ring->next = 0;
+}
+
+void scan_ring_free(ScanRing *ring)
+{
+  free(ring->frames);
+}
+
+// a leaf for a scan: from the page cache if it is there, else through the ring
+void *scan_ring_page(Pager *pager, ScanRing *ring, uint32_t page_num)
+{
+  void *page = pinned_page(pager, page_num);
+  if (page != NULL)
+  {
+    stats.page_cache_hits++;
+    return page;
+  }
+
+  for (uint32_t frame = 0; frame < SCAN_RING_FRAMES; frame++)
+  {
+    if (ring->page_nums[frame] == page_num)
+    {
+      return ring->frames + (size_t)frame * PAGE_SIZE;
+    }
+  }
+
+  uint32_t frame = ring->next;
+  ring->next = (frame + 1) % SCAN_RING_FRAMES;
+  page = ring->frames + (size_t)frame * PAGE_SIZE;
+  pager_read_page(pager, page_num, page);
+  ring->page_nums[frame] = page_num;
+  stats.scan_ring_reads++;
+  return page;
+}
+
+// the leaf a cursor points into
+void *cursor_leaf(Cursor *cursor)
+{
+  if (cursor->ring != NULL)
+  {
+    return scan_ring_page(cursor->table->pager, cursor->ring, cursor->page_num);
+  }
+  return get_page(cursor->table->pager, cursor->page_num);
+}
+
+/*
+A descent through nodes of one specialized layout (see Specialized
+layouts). With the page size and key type fixed, the number of cells per
+node and the offset of the child array are constants. A leaf holds a
+dozen or so keys, so its search compares all of them, counting those
+smaller than the key, in a loop the compiler unrolls; an internal node
+holds hundreds, so its search is a binary search of a fixed number of
+steps that picks each half without a branch. Children are read without
+internal_node_child's checks. get_page and pinned_page are called just
+as in the generic descent, so the statistics are the same.
+*/
+#define DEFINE_NODE_LAYOUT(NAME, PAGE, KEY)                                                          \
+  static inline uint32_t leaf_node_lower_bound_##NAME(void *node, uint64_t key)                    \
+  {                                                                                                \
+    const uint32_t max_cells = (PAGE - LEAF_NODE_HEADER_SIZE) /                                    \
+                               (2 * sizeof(KEY) + LEAF_NODE_SLOT_SIZE + USERNAME_SIZE + EMAIL_SIZE); \
+    const KEY *keys = node + LEAF_NODE_KEYS_OFFSET;                                                \
+    uint32_t num_cells = *leaf_node_num_cells(node);                                               \
+    if (key > (KEY)-1)                                                                             \
+    {                                                                                              \
+      return num_cells;                                                                            \
+    }                                                                                              \
+    uint32_t count = 0;                                                                            \
+    _Pragma("GCC unroll 32") for (uint32_t i = 0; i < max_cells; i++)                              \
+    {                                                                                              \
+      count += (i < num_cells) & (keys[i] < (KEY)key);                                             \
+    }                                                                                              \
+    return count;                                                                                  \
+  }                                                                                                \
+                                                                                                   \
+  static inline uint32_t internal_node_lower_bound_##NAME(void *node, uint64_t key)                \
+  {                                                                                                \
+    const uint32_t max_cells = (PAGE - INTERNAL_NODE_HEADER_SIZE) /                                \
+                               (sizeof(KEY) + INTERNAL_NODE_CHILD_SIZE);                           \
+    const KEY *keys = node + INTERNAL_NODE_KEYS_OFFSET;                                            \
+    uint32_t num_keys = *internal_node_num_keys(node);                                             \
+    if (key > (KEY)-1)                                                                             \
+    {                                                                                              \
+      return num_keys;                                                                             \
+    }                                                                                              \
+    /* pos keys are smaller than the key; each step tries to add step more */                     \
+    uint32_t pos = 0;                                                                              \
+    _Pragma("GCC unroll 32") for (uint32_t step = 1u << (31 - __builtin_clz(max_cells)); step > 0; \
+                                  step >>= 1)                                                      \
+    {                                                                                              \
+      uint32_t next = pos + step;                                                                  \
+      pos = (next <= num_keys && keys[next - 1] < (KEY)key) ? next : pos;                          \
+    }                                                                                              \
+    return pos;                                                                                    \
+  }                                                                                                \
+                                                                                                   \
+  static inline uint32_t internal_node_child_##NAME(void *node, uint32_t index)                    \
+  {                                                                                                \
+    const uint32_t max_cells = (PAGE - INTERNAL_NODE_HEADER_SIZE) /                                \
+                               (sizeof(KEY) + INTERNAL_NODE_CHILD_SIZE);                           \
+    if (index == *internal_node_num_keys(node))                                                    \
+    {                                                                                              \
+      return *internal_node_right_child(node);                                                     \
+    }                                                                                              \
+    const uint32_t *children = node + INTERNAL_NODE_KEYS_OFFSET + max_cells * sizeof(KEY);         \
+    return children[index];                                                                        \
+  }                                                                                                \
+                                                                                                   \
+  static void table_find_##NAME(Table *table, uint64_t key, Cursor *cursor)                        \
+  {                                                                                                \
+    uint32_t page_num = table->root_page_num;                                                      \
+    void *node = get_page(table->pager, page_num);                                                 \
+    while (get_node_type(node) == NODE_INTERNAL)                                                   \
+    {                                                                                              \
+      page_num = internal_node_child_##NAME(node, internal_node_lower_bound_##NAME(node, key));    \
+      /* internal nodes are pinned, so a child that is not loaded is a leaf */                     \
+      node = pinned_page(table->pager, page_num);                                                  \
+      if (node == NULL)                                                                            \
+      {                                                                                            \
+        break;                                                                                     \
+      }                                                                                            \
+    }                                                                                              \
+    node = get_page(table->pager, page_num);                                                       \
+    cursor->table = table;                                                                         \
+    cursor->page_num = page_num;                                                                   \
+    cursor->cell_num = leaf_node_lower_bound_##NAME(node, key);                                    \
+    cursor->end_of_table = false;                                                                  \
+    cursor->ring = NULL;                                                                           \
+  }                                                                                                \
+                                                                                                   \
+  static uint32_t table_find_leaf_##NAME(Table *table, uint32_t height, uint64_t key, uint64_t *bound) \
+  {                                                                                                \
+    uint32_t page_num = table->root_page_num;                                                      \
+    *bound = UINT64_MAX;                                                                           \
+    for (uint32_t level = 1; level < height; level++)                                              \
+    {                                                                                              \
+      void *node = pinned_page(table->pager, page_num);                                            \
+      uint32_t index = internal_node_lower_bound_##NAME(node, key);                                \
+      if (index < *internal_node_num_keys(node))                                                   \
+      {                                                                                            \
+        *bound = ((KEY *)(node + INTERNAL_NODE_KEYS_OFFSET))[index];                               \
+      }                                                                                            \
+      page_num = internal_node_child_##NAME(node, index);                                          \
+    }                                                                                              \
+    return page_num;                                                                               \
+  }
+
+SPECIALIZED_NODE_LAYOUTS(DEFINE_NODE_LAYOUT)
+
+/**
+ * Points the cursor at a page and row on the table.
+ * It will be one of three results:
+ *
+  - the position of the key,
+  - the position of another key that we’ll need to move if we want to insert the new key, or
+  - the position one past the last key
+
+ *
+ * table - The table
+ * key - The identifying key for the data object (row)
+ * page_num - The page where the data is to be found
+ * cursor - Filled in with the position
+ *
+*/
+void leaf_node_find(Table *table, uint32_t page_num, uint64_t key, Cursor *cursor)
+{
+  void *node = get_page(table->pager, page_num);
+  // number of cells in the node (page)
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->end_of_table = false;
+  cursor->ring = NULL;
+
+  switch (node_layout)
+  {
+#define NODE_LAYOUT_LEAF_SEARCH(NAME, PAGE, KEY)                \
+  case NODE_LAYOUT_##NAME:                                      \
+    cursor->cell_num = leaf_node_lower_bound_##NAME(node, key); \
+    return;
+    SPECIALIZED_NODE_LAYOUTS(NODE_LAYOUT_LEAF_SEARCH)
+#undef NODE_LAYOUT_LEAF_SEARCH
+  default:
+    break;
+  }
+
+  // the cell that holds the key, or the cell we'll need to move
+  // if we want to insert the key (num_cells if it goes last)
+  cursor->cell_num = key_array_lower_bound(leaf_node_keys(node), num_cells, key);
+}
+
+uint32_t internal_node_find_child(void *parent_node, uint64_t key);
+
+/**
+ * Recursive function to find a cursor pointing to the key
+ * to insert the data.
+ *
+ * 1. Find which child will contain the key
+ * 2. Call the internal_node_find() on the child
+ */
+void internal_node_find(Table *table, uint32_t page_num, uint64_t key, Cursor *cursor)
+{
+  void *node = pinned_page(table->pager, page_num);
+
+  uint32_t child_index = internal_node_find_child(node, key);
+  uint32_t child_num = *internal_node_child(node, child_index);
+
+  // internal nodes are pinned, so a child that is not loaded is a leaf
+  void *child = pinned_page(table->pager, child_num);
+  if (child == NULL || get_node_type(child) == NODE_LEAF)
+  {
+    // find the cell to insert the data into
+    leaf_node_find(table, child_num, key, cursor);
+  }
+  else
+  {
+    // recursive call to find the internal node
+    internal_node_find(table, child_num, key, cursor);
+  }
+}
+
+/**
+ * Points the cursor at a position in the table
+ * cursor points to a cell of a leaf node
+ *
+ * table - The table
+ * key - The identifying key for the data object (row); key
+ *       could be an id.
+ */
+void table_find(Table *table, uint64_t key, Cursor *cursor)
+{
+  switch (node_layout)
+  {
+#define NODE_LAYOUT_TABLE_FIND(NAME, PAGE, KEY) \
+  case NODE_LAYOUT_##NAME:                      \
+    table_find_##NAME(table, key, cursor);      \
+    return;
+    SPECIALIZED_NODE_LAYOUTS(NODE_LAYOUT_TABLE_FIND)
+#undef NODE_LAYOUT_TABLE_FIND
+  default:
+    break;
+  }
+
+  uint32_t root_page_num = table->root_page_num;
+  void *root_node = get_page(table->pager, root_page_num);
+
+  if (get_node_type(root_node) == NODE_LEAF)
+  {
+    leaf_node_find(table, root_page_num, key, cursor);
+  }
+  else
+  {
+    internal_node_find(table, root_page_num, key, cursor);
+  }
+}
+
+// the number of levels of the tree; the leaves are all at the bottom one
+uint32_t table_height(Table *table)
+{
+  uint32_t height = 1;
+  void *node = get_page(table->pager, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    height++;
+    // internal nodes are pinned, so a child that is not loaded is a leaf
+    node = pinned_page(table->pager, *internal_node_child(node, 0));
+    if (node == NULL)
+    {
+      break;
+    }
+  }
+  return height;
+}
+
+/*
+The leaf a key belongs in, found from the internal nodes alone, and the
+largest key that leaf takes (UINT64_MAX for the last leaf). Every
+separator is the largest key under it, so that is the separator of the
+last child on the way down that was not a right child. The leaf itself
+is not read.
+*/
+uint32_t table_find_leaf(Table *table, uint32_t height, uint64_t key, uint64_t *bound)
+{
+  switch (node_layout)
+  {
+#define NODE_LAYOUT_TABLE_FIND_LEAF(NAME, PAGE, KEY) \
+  case NODE_LAYOUT_##NAME:                           \
+    return table_find_leaf_##NAME(table, height, key, bound);
+    SPECIALIZED_NODE_LAYOUTS(NODE_LAYOUT_TABLE_FIND_LEAF)
+#undef NODE_LAYOUT_TABLE_FIND_LEAF
+  default:
+    break;
+  }
+
+  uint32_t page_num = table->root_page_num;
+  *bound = UINT64_MAX;
+  for (uint32_t level = 1; level < height; level++)
+  {
+    void *node = pinned_page(table->pager, page_num);
+    uint32_t index = internal_node_find_child(node, key);
+    if (index < *internal_node_num_keys(node))
+    {
+      *bound = internal_node_key(node, index);
+    }
+    page_num = *internal_node_child(node, index);
+  }
+  return page_num;
+}
+
+// point the cursor at the start of the table
+void table_start(Table *table, Cursor *cursor)
+{
+  // use table_find to get the leftmost leaf
+  table_find(table, 0, cursor);
+
+  void *node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  cursor->end_of_table = (num_cells == 0);
+}
+
+/**
+ * Point the cursor at the first row whose key is >= key
+ *
+ * table_find may leave the cursor one past the last cell of a leaf; a
+ * seek moves on to the start of the next leaf instead, and sets
+ * end_of_table if there are no more rows.
+ */
+void table_seek(Table *table, uint64_t key, Cursor *cursor)
+{
+  table_find(table, key, cursor);
+
+  void *node = get_page(table->pager, cursor->page_num);
+  if (cursor->cell_num < *leaf_node_num_cells(node))
+  {
+    return;
+  }
+
+  uint32_t next_page_num = *leaf_node_next_leaf(node);
+  if (next_page_num == 0)
+  {
+    cursor->end_of_table = true;
+    return;
+  }
+  cursor->page_num = next_page_num;
+  cursor->cell_num = 0;
+}
+
+/**
+ * Point a scan's cursor at the first row whose key is >= key, like
+ * table_seek, reading leaves through the scan's ring (see Scan ring)
+ */
+void table_scan_seek(Table *table, uint64_t key, ScanRing *ring, Cursor *cursor)
+{
+  uint64_t bound;
+  cursor->table = table;
+  cursor->ring = ring;
+  cursor->page_num = table_find_leaf(table, table_height(table), key, &bound);
+  cursor->end_of_table = false;
+
+  void *node = cursor_leaf(cursor);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  cursor->cell_num = key_array_lower_bound(leaf_node_keys(node), num_cells, key);
+  if (cursor->cell_num < num_cells)
+  {
+    return;
+  }
+
+  uint32_t next_page_num = *leaf_node_next_leaf(node);
+  if (next_page_num == 0)
+  {
+    cursor->end_of_table = true;
+    return;
+  }
+  cursor->page_num = next_page_num;
+  cursor->cell_num = 0;
+}
+
+// figure out where to read/write in memory for a row
+// the cursor contains a pointer to the current row
+void *cursor_value(Cursor *cursor)
+{
+  return leaf_node_value(cursor_leaf(cursor), cursor->cell_num);
+}
+
+// move cursor to the next row
+void cursor_advance(Cursor *cursor)
+{
+  void *node = cursor_leaf(cursor);
+
+  stats.cursor_advances++;
+  cursor->cell_num += 1;
+  // When we reach the end of a leaf node
+  if (cursor->cell_num >= (*leaf_node_num_cells(node)))
+  {
+    /* Advance to next leaf node */
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0)
+    {
+      /* This was rightmost leaf */
+      cursor->end_of_table = true;
+    }
+    else
+    {
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+}
+
+/*
+Result cursors
+
+A ScanCursor hands the rows of a key range to a program that embeds the
+engine, in key order, without formatting them or copying them into Rows:
+
+  ScanCursor cursor;
+  RowView row;
+  scan_cursor_open(table, first_key, last_key, &cursor);
+  while (scan_cursor_next(&cursor, &row))
+  {
+    ...
+  }
+  scan_cursor_close(&cursor);
+
+A row's view points into the leaf it is stored on. The cursor reads
+leaves like a scan, through a scan ring of its own (see Scan ring), so a
+view is valid until the next call on the cursor; copy what must be kept.
+scan_cursor_fetch returns up to max rows per call, from no more leaves
+than the ring holds, so every view it returns stays valid until the next
+call too. Nothing may write to the table while a cursor is open.
+*/
+typedef struct
+{
+  Cursor cursor;
+  ScanRing ring;
+  uint64_t last_key;
+} ScanCursor;
+
+// point a cursor at the first row whose key is in [first_key, last_key]
+void scan_cursor_open(Table *table, uint64_t first_key, uint64_t last_key, ScanCursor *scan)
+{
+  scan->last_key = last_key;
+  scan_ring_init(&scan->ring);
+  table_scan_seek(table, first_key, &scan->ring, &scan->cursor);
+}
+
+void scan_cursor_close(ScanCursor *scan)
+{
+  scan_ring_free(&scan->ring);
+}
+
+// the next row of the range; false once there are no more
+bool scan_cursor_next(ScanCursor *scan, RowView *row)
+{
+  Cursor *cursor = &scan->cursor;
+  if (cursor->end_of_table)
+  {
+    return false;
+  }
+
+  void *node = cursor_leaf(cursor);
+  if (leaf_node_key(node, cursor->cell_num) > scan->last_key)
+  {
+    cursor->end_of_table = true;
+    return false;
+  }
+  deserialize_row_view(leaf_node_value(node, cursor->cell_num), row);
+  cursor_advance(cursor);
+  return true;
+}
+
+// up to max rows of the range; 0 once there are no more
+uint32_t scan_cursor_fetch(ScanCursor *scan, RowView *rows, uint32_t max)
+{
+  Cursor *cursor = &scan->cursor;
+  uint32_t count = 0;
+  uint32_t leaves = 0;
+  while (count < max && !cursor->end_of_table && leaves < SCAN_RING_FRAMES)
+  {
+    void *node = cursor_leaf(cursor);
+    leaves++;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (; count < max && cursor->cell_num < num_cells; cursor->cell_num++)
+    {
+      if (leaf_node_key(node, cursor->cell_num) > scan->last_key)
+      {
+        cursor->end_of_table = true;
+        return count;
+      }
+      deserialize_row_view(leaf_node_value(node, cursor->cell_num), &rows[count++]);
+      stats.cursor_advances++;
+    }
+
+    if (cursor->cell_num == num_cells)
+    {
+      uint32_t next_page_num = *leaf_node_next_leaf(node);
+      if (next_page_num == 0)
+      {
+        cursor->end_of_table = true;
+      }
+      else
+      {
+        cursor->page_num = next_page_num;
+        cursor->cell_num = 0;
+      }
+    }
+  }
+  return count;
+}
+
+/**
+ * Pages are not recycled so new pages are at the end of the table
+ *
+ */
+uint32_t get_unused_page_num(Pager *pager)
+{
+  return pager->num_pages;
+}
+
+void create_new_root(Table *table, uint32_t right_child_page_num)
+{
+  /*
+    Handle splitting the root.
+
+    1. Old root copied to new page, becomes left child.
+    2. Address of right child passed in.
+    3. Re-initialize root page to contain the new root node.
+    4. New root node points to two children.
+  */
+
+  void *root = get_page(table->pager, table->root_page_num);
+  void *right_child = get_page(table->pager, right_child_page_num);
+
+  // get an unallocated page to be used as the left child
+  uint32_t left_child_page_num = get_unused_page_num(table->pager);
+  void *left_child = get_page(table->pager, left_child_page_num);
+
+  if (get_node_type(root) == NODE_INTERNAL)
+  {
+    // an internal root is being split; its halves are internal nodes too
+    initialize_internal_node(right_child);
+    initialize_internal_node(left_child);
+  }
+
+  /* Left child has data copied from old root */
+  memcpy(left_child, root, PAGE_SIZE);
+  // left child is no longer the root
+  set_node_root(left_child, false);
+
+  if (get_node_type(left_child) == NODE_INTERNAL)
+  {
+    // the old root's children now hang off the left child
+    void *child;
+    for (uint32_t i = 0; i < *internal_node_num_keys(left_child); i++)
+    {
+      child = get_page(table->pager, *internal_node_child(left_child, i));
+      *node_parent(child) = left_child_page_num;
+    }
+    child = get_page(table->pager, *internal_node_right_child(left_child));
+    *node_parent(child) = left_child_page_num;
+  }
+
+  /* Root node is a new internal node with one key and two children */
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  uint64_t left_child_max_key = get_node_max_key(table->pager, left_child);
+  internal_node_set_key(root, 0, left_child_max_key);
+  *internal_node_right_child(root) = right_child_page_num;
+
+  // Point both children to the parent
+  *node_parent(left_child) = table->root_page_num;
+  *node_parent(right_child) = table->root_page_num;
+}
+
+uint32_t internal_node_find_child(void *parent_node, uint64_t key)
+{
+  switch (node_layout)
+  {
+#define NODE_LAYOUT_INTERNAL_SEARCH(NAME, PAGE, KEY) \
+  case NODE_LAYOUT_##NAME:                           \
+    return internal_node_lower_bound_##NAME(parent_node, key);
+    SPECIALIZED_NODE_LAYOUTS(NODE_LAYOUT_INTERNAL_SEARCH)
+#undef NODE_LAYOUT_INTERNAL_SEARCH
+  default:
+    break;
+  }
+
+  uint32_t num_keys = *internal_node_num_keys(parent_node);
+
+  /**
+   * The child to follow is the first one whose key (its max key) is
+   * >= the key we are looking for. If every key is smaller, this is
+   * num_keys, which internal_node_child maps to the right child.
+   */
+  return key_array_lower_bound(internal_node_keys(parent_node), num_keys, key);
+}
+
+/**
+ * Example:
+ *
+ * Let's say this is the current state of the db:
+ * Internal: *, 5, *
+ * Left child: 1, 5
+ *
+ * Say we add a new cell, 3, and the maximum number of cells is 2.
+ * The db state will become:
+ * Internal: *, 5, *
+ * Left child: 1, 3
+ * Right child: 5
+ * (the left child was split)
+ *
+ * We now want the left key in the parent to point to the left child
+ * The left key should be the max of the left child, 3
+ * So this method will:
+ * i. Find the child at the key 5 (left child)
+ * ii. Change the key that points to the left child in the parent to 3
+ * (so we change the 5 to 3)
+ *
+ * The table now looks like this:
+ * Internal: *, 3, *
+ * Left child: 1, 3
+ * Right child: 5
+ */
+void update_internal_node_key(void *parent_node, uint64_t old_key, uint64_t new_key)
+{
+  // find the child at the old_key position
+  uint32_t old_child_index = internal_node_find_child(parent_node, old_key);
+  // the right child has no key in the parent, so there is nothing to update
+  if (old_child_index < *internal_node_num_keys(parent_node))
+  {
+    internal_node_set_key(parent_node, old_child_index, new_key);
+  }
+}
+
+void internal_node_split_and_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num);
+
+/**
+ * Add a new child/key pair to parent that corresponds to child
+ *
+ * If the parent is full it is split first (internal_node_split_and_insert).
+ * If the parent has no right child yet (it was just created by a split),
+ * the child becomes its right child.
+ */
+void internal_node_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num)
+{
+  void *parent = get_page(table->pager, parent_page_num);
+  void *child = get_page(table->pager, child_page_num);
+  uint64_t child_max_key = get_node_max_key(table->pager, child);
+  uint32_t index = internal_node_find_child(parent, child_max_key);
+
+  // number of keys in the parent before insertion
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS)
+  {
+    // cannot insert in the parent if it has too many keys
+    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+    return;
+  }
+
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  if (right_child_page_num == INVALID_PAGE_NUM)
+  {
+    // an internal node with an empty right child is empty
+    *internal_node_right_child(parent) = child_page_num;
+    return;
+  }
+
+  void *right_child = get_page(table->pager, right_child_page_num);
+  // increase the number of keys in the parent node to make space
+  // for the new child key
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  /* Replace the right child if the max key is greater */
+  uint64_t right_child_max_key = get_node_max_key(table->pager, right_child);
+  if (child_max_key > right_child_max_key)
+  {
+    /* Replace right child */
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    internal_node_set_key(parent, original_num_keys, right_child_max_key);
+    // previous right child was place 1 + original_num_keys
+    *internal_node_right_child(parent) = child_page_num;
+  }
+  else
+  {
+    /* Make room for the new cell */
+    /* Shift all cells, greater than the new cell, to the right */
+    uint32_t num_to_shift = original_num_keys - index;
+    memmove(internal_node_keys(parent) + (index + 1) * INTERNAL_NODE_CELL_KEY_SIZE,
+            internal_node_keys(parent) + index * INTERNAL_NODE_CELL_KEY_SIZE,
+            num_to_shift * INTERNAL_NODE_CELL_KEY_SIZE);
+    memmove(internal_node_cell(parent, index + 1), internal_node_cell(parent, index),
+            num_to_shift * INTERNAL_NODE_CHILD_SIZE);
+    *internal_node_child(parent, index) = child_page_num;
+    internal_node_set_key(parent, index, child_max_key);
+  }
+}
+
+/**
+ * Split a full internal node and insert a new child
+ *
+ * 1. Create a sibling node (or, for the root, a new root with two children)
+ * 2. Move the right child and the upper half of the children to the sibling
+ * 3. The last remaining child of the old node becomes its right child
+ * 4. Insert the new child into whichever half its key belongs to
+ * 5. Fix the old node's key in the parent and add the sibling to the parent
+ */
+void internal_node_split_and_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num)
+{
+  uint32_t old_page_num = parent_page_num;
+  void *old_node = get_page(table->pager, parent_page_num);
+  uint64_t old_max = get_node_max_key(table->pager, old_node);
+
+  void *child = get_page(table->pager, child_page_num);
+  uint64_t child_max = get_node_max_key(table->pager, child);
+
+  uint32_t new_page_num = get_unused_page_num(table->pager);
+  stats.internal_splits++;
+
+  bool splitting_root = is_node_root(old_node);
+
+  void *parent;
+  void *new_node;
+  if (splitting_root)
+  {
+    // the root keeps its page number; its old content moves to the left child
+    create_new_root(table, new_page_num);
+    parent = get_page(table->pager, table->root_page_num);
+    old_page_num = *internal_node_child(parent, 0);
+    old_node = get_page(table->pager, old_page_num);
+    new_node = get_page(table->pager, new_page_num);
+  }
+  else
+  {
+    parent = get_page(table->pager, *node_parent(old_node));
+    new_node = get_page(table->pager, new_page_num);
+    initialize_internal_node(new_node);
+  }
+
+  uint32_t *old_num_keys = internal_node_num_keys(old_node);
+
+  uint32_t cur_page_num = *internal_node_right_child(old_node);
+  void *cur = get_page(table->pager, cur_page_num);
+
+  // the old right child becomes the new node's right child
+  internal_node_insert(table, new_page_num, cur_page_num);
+  *node_parent(cur) = new_page_num;
+  *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
+
+  // move the upper half of the children to the new node
+  for (int32_t i = INTERNAL_NODE_MAX_CELLS - 1; i > (int32_t)INTERNAL_NODE_MAX_CELLS / 2; i--)
+  {
+    cur_page_num = *internal_node_child(old_node, i);
+    cur = get_page(table->pager, cur_page_num);
+
+    internal_node_insert(table, new_page_num, cur_page_num);
+    *node_parent(cur) = new_page_num;
+
+    (*old_num_keys)--;
+  }
+
+  // the highest remaining child becomes the old node's right child
+  *internal_node_right_child(old_node) = *internal_node_child(old_node, *old_num_keys - 1);
+  (*old_num_keys)--;
+
+  // insert the new child into the half it belongs to
+  uint64_t max_after_split = get_node_max_key(table->pager, old_node);
+  uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
+
+  internal_node_insert(table, destination_page_num, child_page_num);
+  *node_parent(child) = destination_page_num;
+
+  update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
+
+  if (!splitting_root)
+  {
+    // set the parent first: if the parent splits too, it may move new_node
+    // to its own new sibling and update this pointer
+    *node_parent(new_node) = *node_parent(old_node);
+    internal_node_insert(table, *node_parent(old_node), new_page_num);
+  }
+}
+
+/**
+ * To split the content of the original page between two pages:
+ *
+ * 1. Create / fetch the new page
+ * 2. Find the middle number
+ * 3. For each cell in the old page, choose whether to move it to the
+ * new_page or keep in the old page, based on its index (key)
+ * if the index is more than a middle number, move to new, if lower, leave in old
+ * 4. Get the destination cell for each index from 3 above
+ * 5. Write the cells to memory:
+ * 5.1. if the index is for the cell to be written, write the data to memory
+ * 5.2. if the index is for any of the existing cells (from old_node), copy
+ * over to the new destination (new_node / old_node)
+ */
+void leaf_node_split_and_insert(Cursor *cursor, uint64_t key, RowView *value)
+{
+  // old_node is the page that's full; new_node is the page we want to split with
+  void *old_node = get_page(cursor->table->pager, cursor->page_num);
+  uint64_t old_max = get_node_max_key(cursor->table->pager, old_node);
+  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
+  void *new_node = get_page(cursor->table->pager, new_page_num);
+  initialize_leaf_node(new_node);
+  stats.leaf_splits++;
+
+  *node_parent(new_node) = *node_parent(old_node);
+  /**
+   * Update the sibling pointers
+   */
+  // new leaf's sibling is the old leaf's sibling
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  // old leaf's sibling becomes the new leaf itself
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  /*
+    All existing keys plus new key should be divided
+    evenly between old (left) and new (right) nodes.
+    The right half is copied out first, while the old node is intact.
+  */
+  for (uint32_t i = LEAF_NODE_LEFT_SPLIT_COUNT; i <= LEAF_NODE_MAX_CELLS; i++)
+  {
+    // index_within_node determines where to write the cell within new_node
+    // For example, for LEAF_NODE_MAX_CELLS of 13, i = 7 - 13 are written
+    // to index_within_node 0 - 6
+    uint32_t index_within_node = i - LEAF_NODE_LEFT_SPLIT_COUNT;
+    // the new node's rows are stored in cell order
+    *leaf_node_slot(new_node, index_within_node) = index_within_node;
+
+    if (i == cursor->cell_num)
+    {
+      leaf_node_set_key(new_node, index_within_node, key);
+      serialize_row_view(value, leaf_node_value(new_node, index_within_node));
+    }
+    else
+    {
+      // cells after the new key's position are shifted right by one
+      uint32_t source_cell = (i > cursor->cell_num) ? i - 1 : i;
+      leaf_node_set_key(new_node, index_within_node, leaf_node_key(old_node, source_cell));
+      memcpy(leaf_node_value(new_node, index_within_node),
+             leaf_node_value(old_node, source_cell), LEAF_NODE_VALUE_SIZE);
+    }
+  }
+
+  /* Update cell count on both leaf nodes */
+  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  if (cursor->cell_num < LEAF_NODE_LEFT_SPLIT_COUNT)
+  {
+    // the new key belongs to the left half; the rows that moved to
+    // new_node left free slots in old_node for it
+    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT - 1;
+    leaf_node_insert_cell(old_node, cursor->cell_num, key, value);
+  }
+  else
+  {
+    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
+  }
+
+  if (is_node_root(old_node))
+  {
+    // if the old_node was a root then we need to create a new root after the split
+    // both the old_node and new_node will then be connected to this new root
+    return create_new_root(cursor->table, new_page_num);
+  }
+  else
+  {
+    /**
+     * 1. get the parent page
+     * 2. get the updated max key in the old node
+     * 3. update the max key for old node in the internal node
+     * with the updated max key
+     * 4. add the new node, keyed by its max key, to the internal node
+     */
+    uint32_t parent_page_num = *node_parent(old_node);
+    void *parent_page = get_page(cursor->table->pager, parent_page_num);
+
+    uint64_t new_max = get_node_max_key(cursor->table->pager, old_node);
+
+    update_internal_node_key(parent_page, old_max, new_max);
+    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+  }
+}
+
+/*
+Inserting a row into the database
+
+The row is inserted as a cell into the leaf node
+*/
+void leaf_node_insert(Cursor *cursor, uint64_t key, RowView *value)
+{
+  // current page
+  void *node = get_page(cursor->table->pager, cursor->page_num);
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells >= LEAF_NODE_MAX_CELLS)
+  {
+    // Node full so we split
+    leaf_node_split_and_insert(cursor, key, value);
+    return;
+  }
+
+  leaf_node_insert_cell(node, cursor->cell_num, key, value);
+}
+
+/**
+ * The number of new pages inserting into a leaf may allocate.
+ *
+ * A full leaf splits into a new page. The split adds a child to the
+ * parent, which splits too if it is full, and so on up the tree.
+ * Splitting the root takes one more page, for the old root's content.
+ */
+uint32_t pages_needed_for_insert(Table *table, uint32_t leaf_page_num)
+{
+  void *node = get_page(table->pager, leaf_page_num);
+  if (*leaf_node_num_cells(node) < LEAF_NODE_MAX_CELLS)
+  {
+    return 0;
+  }
+
+  uint32_t pages_needed = 1;
+  while (!is_node_root(node))
+  {
+    node = get_page(table->pager, *node_parent(node));
+    if (*internal_node_num_keys(node) < INTERNAL_NODE_MAX_CELLS)
+    {
+      return pages_needed;
+    }
+    pages_needed++;
+  }
+  return pages_needed + 1;
+}
+
+/*
+Insert a row at the cursor, which table_find (or leaf_node_find) has
+pointed at the cell its key belongs in
+*/
+ExecuteResult table_insert_at(Table *table, Cursor *cursor, RowView *row_to_insert)
+{
+  uint64_t key_to_insert = row_to_insert->id;
+
+  // the leaf the key belongs in, not necessarily the root
+  void *node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = (*leaf_node_num_cells(node));
+
+  // if the current cell, pointed by the cursor, is not
+  // at the end of the table
+  if (cursor->cell_num < num_cells)
+  {
+    // get the key of the current cell
+    uint64_t key_at_index = leaf_node_key(node, cursor->cell_num);
+    if (key_at_index == key_to_insert)
+    {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+
+  // the split this insert may cause must fit in the page cache
+  if (table->pager->num_pages + pages_needed_for_insert(table, cursor->page_num) > TABLE_MAX_PAGES)
+  {
+    return EXECUTE_TABLE_FULL;
+  }
+
+  // insert the row's id as the key to the cell
+  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement *statement, Table *table)
+{
+  // insert data into a place in the table
+  Cursor cursor;
+  table_find(table, statement->row_to_insert.id, &cursor);
+  return table_insert_at(table, &cursor, &statement->row_to_insert);
+}
+
+/*
+Insert groups
+
+Inserts that come one after another often land on the same leaf, e.g
+ids that count up. An InsertGroup remembers the leaf the last insert
+went to, and the next insert goes straight to that leaf, without
+descending from the root, if the leaf holds its key: the key is between
+the leaf's first and last keys, or after the last if the leaf is the
+rightmost one.
+
+The group is only a hint. The leaf is checked every time, so it stays
+correct whatever changed the tree in between (a split, a new root, a
+defrag); at worst the insert descends as usual.
+*/
+typedef struct
+{
+  bool valid;
+  uint32_t page_num; // the leaf of the last insert
+} InsertGroup;
+
+// whether a descent for the key would end at this node
+bool leaf_node_holds_key(void *node, uint64_t key)
+{
+  if (get_node_type(node) != NODE_LEAF)
+  {
+    return false;
+  }
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells == 0)
+  {
+    // only an empty table has an empty leaf
+    return true;
+  }
+  if (key < leaf_node_key(node, 0))
+  {
+    return false;
+  }
+  return key <= leaf_node_key(node, num_cells - 1) || *leaf_node_next_leaf(node) == 0;
+}
+
+ExecuteResult execute_grouped_insert(Statement *statement, Table *table, InsertGroup *group)
+{
+  uint64_t key = statement->row_to_insert.id;
+  Cursor cursor;
+  if (group->valid && leaf_node_holds_key(get_page(table->pager, group->page_num), key))
+  {
+    stats.inserts_grouped++;
+    leaf_node_find(table, group->page_num, key, &cursor);
+  }
+  else
+  {
+    table_find(table, key, &cursor);
+  }
+
+  group->valid = true;
+  group->page_num = cursor.page_num;
+  return table_insert_at(table, &cursor, &statement->row_to_insert);
+}
+
+/*
+Parallel scan
+
+table_scan_parallel reads the whole table on several threads. The key
+space is split at the separators of the internal nodes: walking the
+internal nodes lists the leaves in key order without reading a leaf,
+and each range of the list covers the keys between two separators. There
+are SCAN_RANGES_PER_WORKER ranges per worker and the workers take them
+in key order until none are left, so a worker that finishes early picks
+up more. A worker asks the kernel to read ahead the next
+SCAN_READ_AHEAD leaves of its range that are not in the page cache, so
+the storage sees as many reads in flight as there are workers times the
+read-ahead.
+
+Unordered, rows are passed to the function on the worker threads as
+they are read; it is given the worker number so it can keep state per
+worker. Ordered, the workers fill batches of rows and the calling thread
+passes them to the function in key order, from worker 0. A range holds
+at most SCAN_QUEUE_BATCHES batches that have not been passed on, so
+memory stays bounded however large the table is.
+
+Nothing is written while a scan runs. Every page other than the leaves
+is pinned, and each worker reads the leaves of its ranges through its
+own scan ring (see Scan ring), so the workers do not wait for each other
+in get_page and the scan leaves the page cache as it found it.
+*/
+#define SCAN_MAX_WORKERS 64
+#define SCAN_RANGES_PER_WORKER 4
+#define SCAN_READ_AHEAD 8
+#define SCAN_BATCH_ROWS 128
+#define SCAN_QUEUE_BATCHES 8
+
+typedef void (*ScanFunction)(Row *row, uint32_t worker, void *context);
+
+typedef struct ScanBatch
+{
+  struct ScanBatch *next;
+  uint32_t count;
+  Row rows[SCAN_BATCH_ROWS];
+} ScanBatch;
+
+typedef struct
+{
+  uint32_t first_leaf; // the range's leaves are leaves[first_leaf, end_leaf)
+  uint32_t end_leaf;
+  ScanBatch *head; // batches waiting to be passed on, when ordered
+  ScanBatch *tail;
+  uint32_t queued;
+  bool done; // the worker has queued its last batch
+} ScanRange;
+
+typedef struct
+{
+  Table *table;
+  uint32_t *leaves;
+  ScanRange *ranges;
+  uint32_t num_ranges;
+  uint32_t next_range; // the range the next idle worker takes
+  bool ordered;
+  ScanFunction function;
+  void *context;
+  pthread_mutex_t lock;
+  pthread_cond_t batch_queued;
+  pthread_cond_t batch_consumed;
+  DbStats worker_stats; // the workers' counters, added up as they finish
+} Scan;
+
+typedef struct
+{
+  Scan *scan;
+  uint32_t worker;
+} ScanWorker;
+
+/*
+Append the leaves under a node to scan_leaves, in key order. depth is
+the number of levels between the node and the leaves; the leaves
+themselves are not read.
+*/
+void scan_collect_leaves(Pager *pager, uint32_t page_num, uint32_t depth, uint32_t **leaves,
+                         uint32_t *num_leaves, uint32_t *capacity)
+{
+  if (depth == 0)
+  {
+    if (*num_leaves == *capacity)
+    {
+      *capacity *= 2;
+      *leaves = realloc(*leaves, *capacity * sizeof(uint32_t));
+    }
+    (*leaves)[(*num_leaves)++] = page_num;
+    return;
+  }
+
+  void *node = get_page(pager, page_num);
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i < num_keys; i++)
+  {
+    scan_collect_leaves(pager, *internal_node_child(node, i), depth - 1, leaves, num_leaves, capacity);
+  }
+  scan_collect_leaves(pager, *internal_node_right_child(node), depth - 1, leaves, num_leaves, capacity);
+}
+
+void scan_queue_batch(Scan *scan, ScanRange *range, ScanBatch *batch)
+{
+  batch->next = NULL;
+  pthread_mutex_lock(&scan->lock);
+  while (range->queued >= SCAN_QUEUE_BATCHES)
+  {
+    pthread_cond_wait(&scan->batch_consumed, &scan->lock);
+  }
+  if (range->tail == NULL)
+  {
+    range->head = batch;
+  }
+  else
+  {
+    range->tail->next = batch;
+  }
+  range->tail = batch;
+  range->queued++;
+  pthread_cond_broadcast(&scan->batch_queued);
+  pthread_mutex_unlock(&scan->lock);
+}
+
+void scan_read_ahead(Pager *pager, uint32_t page_num)
+{
+  if (pager->pages[page_num] == NULL)
+  {
+    posix_fadvise(pager->file_descriptor, (off_t)page_num * PAGE_SIZE, PAGE_SIZE, POSIX_FADV_WILLNEED);
+  }
+}
+
+void scan_range(Scan *scan, ScanRange *range, uint32_t worker)
+{
+  Pager *pager = scan->table->pager;
+  ScanBatch *batch = NULL;
+  Row row;
+  ScanRing ring;
+  scan_ring_init(&ring);
+
+  for (uint32_t i = range->first_leaf; i < range->end_leaf && i < range->first_leaf + SCAN_READ_AHEAD; i++)
+  {
+    scan_read_ahead(pager, scan->leaves[i]);
+  }
+
+  for (uint32_t i = range->first_leaf; i < range->end_leaf; i++)
+  {
+    if (i + SCAN_READ_AHEAD < range->end_leaf)
+    {
+      scan_read_ahead(pager, scan->leaves[i + SCAN_READ_AHEAD]);
+    }
+
+    void *node = scan_ring_page(pager, &ring, scan->leaves[i]);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t cell_num = 0; cell_num < num_cells; cell_num++)
+    {
+      if (!scan->ordered)
+      {
+        deserialize_row(leaf_node_value(node, cell_num), &row);
+        scan->function(&row, worker, scan->context);
+        continue;
+      }
+
+      if (batch == NULL)
+      {
+        batch = malloc(sizeof(ScanBatch));
+        batch->count = 0;
+      }
+      deserialize_row(leaf_node_value(node, cell_num), &batch->rows[batch->count++]);
+      if (batch->count == SCAN_BATCH_ROWS)
+      {
+        scan_queue_batch(scan, range, batch);
+        batch = NULL;
+      }
+    }
+  }
+
+  if (batch != NULL)
+  {
+    scan_queue_batch(scan, range, batch);
+  }
+  scan_ring_free(&ring);
+  pthread_mutex_lock(&scan->lock);
+  range->done = true;
+  pthread_cond_broadcast(&scan->batch_queued);
+  pthread_mutex_unlock(&scan->lock);
+}
+
+void *scan_worker(void *argument)
+{
+  ScanWorker *worker = argument;
+  Scan *scan = worker->scan;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&scan->lock);
+    uint32_t range_num = scan->next_range++;
+    pthread_mutex_unlock(&scan->lock);
+    if (range_num >= scan->num_ranges)
+    {
+      break;
+    }
+    scan_range(scan, &scan->ranges[range_num], worker->worker);
+  }
+
+  pthread_mutex_lock(&scan->lock);
+  stats_add(&scan->worker_stats, &stats);
+  pthread_mutex_unlock(&scan->lock);
+  return NULL;
+}
+
+// pass the queued batches to the function, range by range
+void scan_merge_ordered(Scan *scan)
+{
+  for (uint32_t range_num = 0; range_num < scan->num_ranges; range_num++)
+  {
+    ScanRange *range = &scan->ranges[range_num];
+    for (;;)
+    {
+      pthread_mutex_lock(&scan->lock);
+      while (range->head == NULL && !range->done)
+      {
+        pthread_cond_wait(&scan->batch_queued, &scan->lock);
+      }
+      ScanBatch *batch = range->head;
+      if (batch != NULL)
+      {
+        range->head = batch->next;
+        if (range->head == NULL)
+        {
+          range->tail = NULL;
+        }
+        range->queued--;
+        pthread_cond_broadcast(&scan->batch_consumed);
+      }
+      pthread_mutex_unlock(&scan->lock);
+
+      if (batch == NULL)
+      {
+        break;
+      }
+      for (uint32_t i = 0; i < batch->count; i++)
+      {
+        scan->function(&batch->rows[i], 0, scan->context);
+      }
+      free(batch);
+    }
+  }
+}
+
+/*
+Pass every row of the table to function, reading on up to num_workers
+threads. Ordered, rows arrive in key order on the calling thread;
+otherwise they arrive in any order on the worker threads.
+*/
+void table_scan_parallel(Table *table, uint32_t num_workers, bool ordered, ScanFunction function,
+                         void *context)
+{
+  Pager *pager = table->pager;
+
+  // the depth of the leaves; every leaf is at the same depth
+  uint32_t depth = 0;
+  void *node = get_page(pager, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    node = get_page(pager, *internal_node_child(node, 0));
+    depth++;
+  }
+
+  Scan scan;
+  scan.table = table;
+  scan.ordered = ordered;
+  scan.function = function;
+  scan.context = context;
+  scan.next_range = 0;
+  memset(&scan.worker_stats, 0, sizeof(scan.worker_stats));
+
+  uint32_t num_leaves = 0;
+  uint32_t capacity = 64;
+  scan.leaves = malloc(capacity * sizeof(uint32_t));
+  scan_collect_leaves(pager, table->root_page_num, depth, &scan.leaves, &num_leaves, &capacity);
+
+  if (num_workers > SCAN_MAX_WORKERS)
+  {
+    num_workers = SCAN_MAX_WORKERS;
+  }
+  if (num_workers == 0)
+  {
+    num_workers = 1;
+  }
+  scan.num_ranges = num_workers * SCAN_RANGES_PER_WORKER;
+  if (scan.num_ranges > num_leaves)
+  {
+    scan.num_ranges = num_leaves;
+  }
+  if (num_workers > scan.num_ranges)
+  {
+    num_workers = scan.num_ranges;
+  }
+
+  scan.ranges = malloc(scan.num_ranges * sizeof(ScanRange));
+  for (uint32_t i = 0; i < scan.num_ranges; i++)
+  {
+    scan.ranges[i].first_leaf = (uint64_t)num_leaves * i / scan.num_ranges;
+    scan.ranges[i].end_leaf = (uint64_t)num_leaves * (i + 1) / scan.num_ranges;
+    scan.ranges[i].head = NULL;
+    scan.ranges[i].tail = NULL;
+    scan.ranges[i].queued = 0;
+    scan.ranges[i].done = false;
+  }
+
+  pthread_mutex_init(&scan.lock, NULL);
+  pthread_cond_init(&scan.batch_queued, NULL);
+  pthread_cond_init(&scan.batch_consumed, NULL);
+
+  pthread_t threads[SCAN_MAX_WORKERS];
+  ScanWorker workers[SCAN_MAX_WORKERS];
+  for (uint32_t i = 0; i < num_workers; i++)
+  {
+    workers[i].scan = &scan;
+    workers[i].worker = i;
+    if (pthread_create(&threads[i], NULL, scan_worker, &workers[i]) != 0)
+    {
+      printf("Unable to start scan worker.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (ordered)
+  {
+    scan_merge_ordered(&scan);
+  }
+  for (uint32_t i = 0; i < num_workers; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  stats_add(&stats, &scan.worker_stats);
+
+  pthread_cond_destroy(&scan.batch_consumed);
+  pthread_cond_destroy(&scan.batch_queued);
+  pthread_mutex_destroy(&scan.lock);
+  free(scan.ranges);
+  free(scan.leaves);
+}
+
+// select passes its rows here when it scans in parallel
+void scan_output_row(Row *row, uint32_t worker, void *context)
+{
+  (void)worker;
+  (void)context;
+  output_row(row);
+}
+
+/*
+Bulk load
+
+table_bulk_load builds the tree of an empty table from an array of rows
+in one go, instead of inserting them one at a time, and does the work on
+several threads:
+
+1. sort: the keys are sorted together with the index of their row, so
+   the rows themselves are never moved. Each worker sorts one run, then
+   pairs of runs are merged on separate threads, round after round,
+   until one run is left. A duplicate key is next to its twin.
+2. leaves: the pages of the whole tree are reserved at the end of the
+   file, the leaves first, in key order, then each internal level. The
+   workers fill disjoint ranges of leaves, each leaf full, straight from
+   the sorted keys.
+3. internal levels: built on the calling thread once the leaves are
+   done, from the maximum key of each node below. There is one internal
+   node per INTERNAL_NODE_MAX_CELLS + 1 nodes below, so this is a small
+   part of the work. The single node of the top level goes into the root
+   page.
+
+New pages are reserved by moving num_pages before the workers start, so
+get_page never has to grow the file from a worker.
+The table is left as it was if a key is repeated or the tree does not
+fit in the page cache.
+*/
+#define BULK_PREFETCH_DISTANCE 8
+
+typedef struct
+{
+  uint64_t key;
+  uint32_t row; // the row's index in the input
+} BulkEntry;
+
+int compare_bulk_entries(const void *a, const void *b)
+{
+  uint64_t x = ((const BulkEntry *)a)->key;
+  uint64_t y = ((const BulkEntry *)b)->key;
+  return (x > y) - (x < y);
+}
+
+// one task per thread; tasks[i] is task_size bytes apart
+void bulk_run_tasks(void *(*function)(void *), void *tasks, size_t task_size, uint32_t num_tasks)
+{
+  pthread_t threads[SCAN_MAX_WORKERS];
+  for (uint32_t i = 0; i < num_tasks; i++)
+  {
+    if (pthread_create(&threads[i], NULL, function, (uint8_t *)tasks + i * task_size) != 0)
+    {
+      printf("Unable to start bulk load worker.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (uint32_t i = 0; i < num_tasks; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+typedef struct
+{
+  BulkEntry *left; // right follows left in memory
+  uint64_t left_count;
+  uint64_t right_count;
+  BulkEntry *output; // NULL to sort left in place
+} BulkSortTask;
+
+void *bulk_sort_task(void *argument)
+{
+  BulkSortTask *task = argument;
+  if (task->output == NULL)
+  {
+    qsort(task->left, task->left_count, sizeof(BulkEntry), compare_bulk_entries);
+    return NULL;
+  }
+
+  BulkEntry *left = task->left;
+  BulkEntry *left_end = left + task->left_count;
+  BulkEntry *right = left_end;
+  BulkEntry *right_end = right + task->right_count;
+  BulkEntry *output = task->output;
+  while (left < left_end && right < right_end)
+  {
+    *output++ = (right->key < left->key) ? *right++ : *left++;
+  }
+  memcpy(output, left, (left_end - left) * sizeof(BulkEntry));
+  output += left_end - left;
+  memcpy(output, right, (right_end - right) * sizeof(BulkEntry));
+  return NULL;
+}
+
+// a parallel merge sort of the entries by key
+void bulk_sort(BulkEntry *entries, uint64_t count, uint32_t workers)
+{
+  uint64_t bounds[SCAN_MAX_WORKERS + 1];
+  BulkSortTask tasks[SCAN_MAX_WORKERS];
+  uint32_t runs = workers;
+  for (uint32_t i = 0; i <= runs; i++)
+  {
+    bounds[i] = count * i / runs;
+  }
+  for (uint32_t i = 0; i < runs; i++)
+  {
+    tasks[i] = (BulkSortTask){entries + bounds[i], bounds[i + 1] - bounds[i], 0, NULL};
+  }
+  bulk_run_tasks(bulk_sort_task, tasks, sizeof(BulkSortTask), runs);
+
+  BulkEntry *buffer = malloc(count * sizeof(BulkEntry));
+  BulkEntry *source = entries;
+  BulkEntry *target = buffer;
+  while (runs > 1)
+  {
+    // an odd run out is copied by a merge with an empty right run
+    uint32_t merges = (runs + 1) / 2;
+    for (uint32_t i = 0; i < merges; i++)
+    {
+      uint64_t begin = bounds[2 * i];
+      uint64_t middle = bounds[2 * i + 1];
+      uint64_t end = (2 * i + 2 <= runs) ? bounds[2 * i + 2] : middle;
+      tasks[i] = (BulkSortTask){source + begin, middle - begin, end - middle, target + begin};
+    }
+    bulk_run_tasks(bulk_sort_task, tasks, sizeof(BulkSortTask), merges);
+
+    for (uint32_t i = 0; i < merges; i++)
+    {
+      bounds[i] = bounds[2 * i];
+    }
+    bounds[merges] = count;
+    runs = merges;
+    BulkEntry *sorted = target;
+    target = source;
+    source = sorted;
+  }
+
+  if (source != entries)
+  {
+    memcpy(entries, source, count * sizeof(BulkEntry));
+  }
+  free(buffer);
+}
+
+typedef struct
+{
+  Pager *pager;
+  Row *rows;
+  BulkEntry *entries;
+  uint64_t count;
+  uint32_t first_page; // the page of leaf 0; the leaves are consecutive
+  uint32_t num_leaves;
+  uint32_t begin; // this task fills leaves [begin, end)
+  uint32_t end;
+  DbStats stats;
+} BulkLeafTask;
+
+void *bulk_leaf_task(void *argument)
+{
+  BulkLeafTask *task = argument;
+  for (uint32_t leaf = task->begin; leaf < task->end; leaf++)
+  {
+    void *node = get_page(task->pager, task->first_page + leaf);
+    initialize_leaf_node(node);
+
+    uint64_t first = (uint64_t)leaf * LEAF_NODE_MAX_CELLS;
+    uint32_t num_cells = task->count - first < LEAF_NODE_MAX_CELLS ? task->count - first : LEAF_NODE_MAX_CELLS;
+    for (uint32_t cell_num = 0; cell_num < num_cells; cell_num++)
+    {
+      BulkEntry *entry = &task->entries[first + cell_num];
+      // the rows are read in key order, not in memory order
+      if (first + cell_num + BULK_PREFETCH_DISTANCE < task->count)
+      {
+        uint8_t *ahead = (uint8_t *)&task->rows[entry[BULK_PREFETCH_DISTANCE].row];
+        for (uint32_t offset = 0; offset < sizeof(Row); offset += 64) // a cache line at a time
+        {
+          __builtin_prefetch(ahead + offset);
+        }
+      }
+      leaf_node_set_key(node, cell_num, entry->key);
+      *leaf_node_slot(node, cell_num) = cell_num;
+      serialize_row(&task->rows[entry->row], leaf_node_payload(node, cell_num));
+    }
+    *leaf_node_num_cells(node) = num_cells;
+    *leaf_node_next_leaf(node) = (leaf + 1 < task->num_leaves) ? task->first_page + leaf + 1 : 0;
+  }
+  task->stats = stats;
+  return NULL;
+}
+
+// .import and .load run on every core, or on as many threads as -threads asks for
+uint32_t bulk_load_workers()
+{
+  return shell.threads > 1 ? shell.threads : sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/*
+Build the table from count rows on up to num_workers threads. The table
+must be empty.
+*/
+ExecuteResult table_bulk_load(Table *table, Row *rows, uint32_t count, uint32_t num_workers)
+{
+  Pager *pager = table->pager;
+  if (count == 0)
+  {
+    return EXECUTE_SUCCESS;
+  }
+  if (num_workers > SCAN_MAX_WORKERS)
+  {
+    num_workers = SCAN_MAX_WORKERS;
+  }
+  if (num_workers == 0)
+  {
+    num_workers = 1;
+  }
+
+  BulkEntry *entries = malloc(count * sizeof(BulkEntry));
+  for (uint32_t i = 0; i < count; i++)
+  {
+    entries[i] = (BulkEntry){rows[i].id, i};
+  }
+  bulk_sort(entries, count, count < num_workers ? count : num_workers);
+  for (uint32_t i = 1; i < count; i++)
+  {
+    if (entries[i].key == entries[i - 1].key)
+    {
+      free(entries);
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+
+  // reserve the leaves and every internal level below the root
+  uint32_t num_leaves = (count + LEAF_NODE_MAX_CELLS - 1) / LEAF_NODE_MAX_CELLS;
+  uint32_t fanout = INTERNAL_NODE_MAX_CELLS + 1;
+  uint32_t first_page = num_leaves == 1 ? table->root_page_num : pager->num_pages;
+  uint64_t reserved = num_leaves == 1 ? 0 : num_leaves;
+  for (uint64_t level = num_leaves; level > fanout;)
+  {
+    level = (level + fanout - 1) / fanout;
+    reserved += level;
+  }
+  if (pager->num_pages + reserved > TABLE_MAX_PAGES)
+  {
+    free(entries);
+    return EXECUTE_TABLE_FULL;
+  }
+  pager->num_pages += reserved;
+
+  uint32_t num_tasks = num_leaves < num_workers ? num_leaves : num_workers;
+  BulkLeafTask tasks[SCAN_MAX_WORKERS];
+  for (uint32_t i = 0; i < num_tasks; i++)
+  {
+    tasks[i] = (BulkLeafTask){.pager = pager,
+                              .rows = rows,
+                              .entries = entries,
+                              .count = count,
+                              .first_page = first_page,
+                              .num_leaves = num_leaves,
+                              .begin = (uint64_t)num_leaves * i / num_tasks,
+                              .end = (uint64_t)num_leaves * (i + 1) / num_tasks,
+                              .stats = {0}};
+  }
+  bulk_run_tasks(bulk_leaf_task, tasks, sizeof(BulkLeafTask), num_tasks);
+  for (uint32_t i = 0; i < num_tasks; i++)
+  {
+    stats_add(&stats, &tasks[i].stats);
+  }
+
+  // the maximum key of each node of the level being stitched together
+  uint64_t *max_keys = malloc(num_leaves * sizeof(uint64_t));
+  for (uint32_t leaf = 0; leaf < num_leaves; leaf++)
+  {
+    uint64_t end = (uint64_t)(leaf + 1) * LEAF_NODE_MAX_CELLS;
+    max_keys[leaf] = entries[(end < count ? end : count) - 1].key;
+  }
+
+  uint32_t level_first = first_page;
+  uint32_t level_count = num_leaves;
+  uint32_t next_page = first_page + num_leaves;
+  while (level_count > 1)
+  {
+    uint32_t parents = (level_count + fanout - 1) / fanout;
+    for (uint32_t parent = 0; parent < parents; parent++)
+    {
+      uint32_t page_num = parents == 1 ? table->root_page_num : next_page + parent;
+      void *node = get_page(pager, page_num);
+      initialize_internal_node(node);
+
+      uint32_t first_child = parent * fanout;
+      uint32_t num_children = level_count - first_child < fanout ? level_count - first_child : fanout;
+      *internal_node_num_keys(node) = num_children - 1;
+      for (uint32_t i = 0; i < num_children - 1; i++)
+      {
+        *internal_node_child(node, i) = level_first + first_child + i;
+        internal_node_set_key(node, i, max_keys[first_child + i]);
+      }
+      *internal_node_right_child(node) = level_first + first_child + num_children - 1;
+      for (uint32_t i = 0; i < num_children; i++)
+      {
+        *node_parent(get_page(pager, level_first + first_child + i)) = page_num;
+      }
+      max_keys[parent] = max_keys[first_child + num_children - 1];
+    }
+    level_first = next_page;
+    next_page += parents;
+    level_count = parents;
+  }
+  set_node_root(get_page(pager, table->root_page_num), true);
+
+  free(max_keys);
+  free(entries);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+Multi-row inserts
+
+table_insert_rows inserts many rows at once. The rows are sorted by key
+and go into the leaves in runs: the rows of a run all belong in the same
+leaf, and the whole run goes in together.
+
+- A run is found with one descent through the internal nodes, which
+  gives its leaf and the largest key the leaf takes; the rows up to that
+  key are the run. The descents run INSERT_RUN_PREFETCH_DISTANCE runs
+  ahead of the inserts and prefetch each leaf, so its cache misses
+  overlap with the work on the leaves before it. Splitting a leaf only
+  adds pages after it, so the leaves found ahead stay right.
+- If the run fits, the leaf's keys and slots are merged with it from the
+  back, so each existing cell moves once: one memmove per gap between
+  new keys.
+- If it does not, the leaf's cells and the run are spread evenly over as
+  many pages as they need. The leaf keeps the first share and new pages
+  after it in the leaf chain take the rest; they are then added to the
+  parent, splitting it as needed.
+
+Rows whose key is already in the table, or repeats in the rows, are
+skipped, and the insert returns EXECUTE_DUPLICATE_KEY once the others
+are in, as a script of single inserts would leave the table. A run that
+could need more pages than are left stops the insert with
+EXECUTE_TABLE_FULL; the runs before it, of lower keys, stay inserted.
+*/
+#define INSERT_RUN_PREFETCH_DISTANCE 8
+
+// the rows [start, end) go into the leaf on page_num
+typedef struct
+{
+  uint32_t page_num;
+  uint32_t start;
+  uint32_t end;
+} InsertRun;
+
+// a cell of a leaf being split: an existing cell's slot, or a row to insert
+typedef struct
+{
+  uint64_t key;
+  uint16_t slot;
+  RowView *row;
+} LeafCell;
+
+int compare_row_views(const void *a, const void *b)
+{
+  uint64_t x = ((const RowView *)a)->id;
+  uint64_t y = ((const RowView *)b)->id;
+  return (x > y) - (x < y);
+}
+
+// bring a leaf's header and keys into the cache, or ask the kernel to read it
+void leaf_node_prefetch(Pager *pager, uint32_t page_num)
+{
+  void *page = pager->pages[page_num];
+  if (page == NULL)
+  {
+    scan_read_ahead(pager, page_num);
+    return;
+  }
+  __builtin_prefetch(page);
+  __builtin_prefetch(page + 64);
+}
+
+/*
+Copy the rows of a sorted run that are not in the leaf, and do not
+repeat, to fresh. Returns how many there are.
+*/
+uint32_t leaf_node_new_rows(void *node, RowView *rows, uint32_t run, RowView *fresh)
+{
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t cell = 0;
+  uint32_t num_fresh = 0;
+  for (uint32_t i = 0; i < run; i++)
+  {
+    uint64_t key = rows[i].id;
+    while (cell < num_cells && leaf_node_key(node, cell) < key)
+    {
+      cell++;
+    }
+    bool in_leaf = cell < num_cells && leaf_node_key(node, cell) == key;
+    bool repeated = num_fresh > 0 && fresh[num_fresh - 1].id == key;
+    if (!in_leaf && !repeated)
+    {
+      fresh[num_fresh++] = rows[i];
+    }
+  }
+  return num_fresh;
+}
+
+/*
+The most splits adding `added` children next to each other to an
+internal node with num_keys keys can cause. A split leaves the half the
+next children go to at least half empty.
+*/
+uint32_t internal_node_splits_needed(uint32_t num_keys, uint32_t added)
+{
+  if (num_keys + added <= INTERNAL_NODE_MAX_CELLS)
+  {
+    return 0;
+  }
+  uint32_t room = INTERNAL_NODE_MAX_CELLS / 2 > 1 ? INTERNAL_NODE_MAX_CELLS / 2 - 1 : 1;
+  return (num_keys + added - INTERNAL_NODE_MAX_CELLS + room - 1) / room;
+}
+
+/**
+ * The most pages splitting a leaf into new_leaves + 1 leaves may
+ * allocate: the new leaves, the splits of the internal nodes above it,
+ * and a page for the old root's content each time the root splits.
+ */
+uint32_t pages_needed_for_leaves(Table *table, uint32_t leaf_page_num, uint32_t new_leaves)
+{
+  void *node = get_page(table->pager, leaf_page_num);
+  uint32_t pages = new_leaves;
+  uint32_t added = new_leaves;
+  while (added > 0)
+  {
+    if (is_node_root(node))
+    {
+      // the new root starts with two children, the old root's content
+      // and the first new node, and takes the rest
+      pages++;
+      added = internal_node_splits_needed(1, added - 1);
+      pages += added;
+      continue;
+    }
+    node = get_page(table->pager, *node_parent(node));
+    added = internal_node_splits_needed(*internal_node_num_keys(node), added);
+    pages += added;
+  }
+  return pages;
+}
+
+// merge a sorted run of rows into a leaf that has room for them
+void leaf_node_insert_run(void *node, RowView *rows, uint32_t run)
+{
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  // the payload slots no cell is using; the run's rows go there
+  uint8_t used[LEAF_NODE_MAX_CELLS_LIMIT] = {0};
+  uint16_t free_slots[LEAF_NODE_MAX_CELLS_LIMIT];
+  for (uint32_t i = 0; i < num_cells; i++)
+  {
+    used[*leaf_node_slot(node, i)] = 1;
+  }
+  uint32_t num_free = 0;
+  for (uint32_t slot = 0; slot < LEAF_NODE_MAX_CELLS; slot++)
+  {
+    if (!used[slot])
+    {
+      free_slots[num_free++] = slot;
+    }
+  }
+
+  // from the largest new key down: the cells after it that are still in
+  // their old place move right past it and the new keys before it
+  uint32_t unplaced = num_cells;
+  for (int32_t j = run - 1; j >= 0; j--)
+  {
+    uint32_t position = key_array_lower_bound(leaf_node_keys(node), unplaced, rows[j].id);
+    uint32_t num_to_shift = unplaced - position;
+    memmove(leaf_node_keys(node) + (position + j + 1) * LEAF_NODE_KEY_SIZE,
+            leaf_node_keys(node) + position * LEAF_NODE_KEY_SIZE,
+            num_to_shift * LEAF_NODE_KEY_SIZE);
+    memmove(leaf_node_slot(node, position + j + 1), leaf_node_slot(node, position),
+            num_to_shift * LEAF_NODE_SLOT_SIZE);
+
+    leaf_node_set_key(node, position + j, rows[j].id);
+    *leaf_node_slot(node, position + j) = free_slots[j];
+    serialize_row_view(&rows[j], leaf_node_payload(node, free_slots[j]));
+    unplaced = position;
+  }
+
+  *leaf_node_num_cells(node) = num_cells + run;
+}
+
+// the first cell page p of a split takes when total cells are spread evenly
+uint32_t split_first_cell(uint32_t p, uint32_t total, uint32_t num_pages)
+{
+  uint32_t extra = total % num_pages;
+  return p * (total / num_pages) + (p < extra ? p : extra);
+}
+
+/*
+Spread a leaf's cells and a sorted run of rows over the leaf and as many
+new pages after it as they need, and add the new pages to the tree.
+cells has room for the leaf's cells and the run. Returns the last of the
+pages.
+*/
+uint32_t leaf_node_split_run(Table *table, uint32_t page_num, RowView *rows, uint32_t run, LeafCell *cells)
+{
+  Pager *pager = table->pager;
+  void *node = get_page(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  // an empty leaf is the root, which has no key in a parent
+  uint64_t old_max = num_cells > 0 ? get_node_max_key(pager, node) : 0;
+
+  // the leaf's cells and the run, in key order
+  uint32_t total = num_cells + run;
+  uint32_t existing = 0;
+  uint32_t next_row = 0;
+  for (uint32_t c = 0; c < total; c++)
+  {
+    if (next_row == run || (existing < num_cells && leaf_node_key(node, existing) < rows[next_row].id))
+    {
+      cells[c] = (LeafCell){leaf_node_key(node, existing), *leaf_node_slot(node, existing), NULL};
+      existing++;
+    }
+    else
+    {
+      cells[c] = (LeafCell){rows[next_row].id, 0, &rows[next_row]};
+      next_row++;
+    }
+  }
+
+  // page p takes cells [split_first_cell(p), split_first_cell(p + 1)); page 0 is the leaf
+  uint32_t num_pages = (total + LEAF_NODE_MAX_CELLS - 1) / LEAF_NODE_MAX_CELLS;
+  uint32_t kept = split_first_cell(1, total, num_pages);
+
+  // fill the new pages first, while the rows they copy are still in the leaf
+  uint32_t first_new_page_num = get_unused_page_num(pager);
+  for (uint32_t p = 1; p < num_pages; p++)
+  {
+    uint32_t new_page_num = first_new_page_num + p - 1;
+    void *new_node = get_page(pager, new_page_num);
+    initialize_leaf_node(new_node);
+
+    uint32_t cell_num = 0;
+    uint32_t last = split_first_cell(p + 1, total, num_pages);
+    for (uint32_t c = split_first_cell(p, total, num_pages); c < last; c++, cell_num++)
+    {
+      leaf_node_set_key(new_node, cell_num, cells[c].key);
+      *leaf_node_slot(new_node, cell_num) = cell_num;
+      if (cells[c].row)
+      {
+        serialize_row_view(cells[c].row, leaf_node_payload(new_node, cell_num));
+      }
+      else
+      {
+        memcpy(leaf_node_payload(new_node, cell_num), leaf_node_payload(node, cells[c].slot),
+               LEAF_NODE_VALUE_SIZE);
+      }
+    }
+    *leaf_node_num_cells(new_node) = cell_num;
+    *leaf_node_next_leaf(new_node) = (p == num_pages - 1) ? *leaf_node_next_leaf(node) : new_page_num + 1;
+  }
+
+  // the leaf keeps its first share; the rows it keeps stay in their slots
+  // and the new rows take the slots that are left
+  uint8_t used[LEAF_NODE_MAX_CELLS_LIMIT] = {0};
+  for (uint32_t c = 0; c < kept; c++)
+  {
+    if (cells[c].row == NULL)
+    {
+      used[cells[c].slot] = 1;
+    }
+  }
+  uint32_t slot = 0;
+  for (uint32_t c = 0; c < kept; c++)
+  {
+    if (cells[c].row)
+    {
+      while (used[slot])
+      {
+        slot++;
+      }
+      used[slot] = 1;
+      cells[c].slot = slot;
+      serialize_row_view(cells[c].row, leaf_node_payload(node, slot));
+    }
+    leaf_node_set_key(node, c, cells[c].key);
+    *leaf_node_slot(node, c) = cells[c].slot;
+  }
+  *leaf_node_num_cells(node) = kept;
+  *leaf_node_next_leaf(node) = first_new_page_num;
+  stats.leaf_splits += num_pages - 1;
+
+  /*
+    Add the new pages to the tree, the last first and each of the others
+    just before the one after it. Every node they go into then already
+    holds its largest key, so the separators above it stay right even
+    when the node splits.
+  */
+  uint32_t last_page_num = first_new_page_num + num_pages - 2;
+  if (is_node_root(node))
+  {
+    // the leaf's content moves under a new root, with the last page
+    create_new_root(table, last_page_num);
+  }
+  else
+  {
+    void *parent = get_page(pager, *node_parent(node));
+    update_internal_node_key(parent, old_max, get_node_max_key(pager, node));
+    *node_parent(get_page(pager, last_page_num)) = *node_parent(node);
+    internal_node_insert(table, *node_parent(node), last_page_num);
+  }
+
+  for (uint32_t p = num_pages - 2; p > 0; p--)
+  {
+    uint32_t new_page_num = first_new_page_num + p - 1;
+    // set the parent first: if the parent splits, it may move the page
+    uint32_t parent_page_num = *node_parent(get_page(pager, new_page_num + 1));
+    *node_parent(get_page(pager, new_page_num)) = parent_page_num;
+    internal_node_insert(table, parent_page_num, new_page_num);
+  }
+
+  return last_page_num;
+}
+
+/*
+Insert many rows at once (see Multi-row inserts). The rows are sorted
+by key in place.
+*/
+ExecuteResult table_insert_rows(Table *table, RowView *rows, uint32_t count)
+{
+  Pager *pager = table->pager;
+  qsort(rows, count, sizeof(RowView), compare_row_views);
+
+  RowView *fresh = malloc(count * sizeof(RowView));
+  LeafCell *cells = malloc((LEAF_NODE_MAX_CELLS + count) * sizeof(LeafCell));
+  InsertRun runs[INSERT_RUN_PREFETCH_DISTANCE];
+  uint32_t first_run = 0;
+  uint32_t queued_runs = 0;
+  uint32_t next_row = 0; // the first row not in a queued run
+  uint32_t height = table_height(table);
+  bool duplicate = false;
+  ExecuteResult result = EXECUTE_SUCCESS;
+
+  while (next_row < count || queued_runs > 0)
+  {
+    // find the leaves of the next runs and prefetch them
+    while (next_row < count && queued_runs < INSERT_RUN_PREFETCH_DISTANCE)
+    {
+      InsertRun *run = &runs[(first_run + queued_runs) % INSERT_RUN_PREFETCH_DISTANCE];
+      uint64_t bound;
+      run->page_num = table_find_leaf(table, height, rows[next_row].id, &bound);
+      run->start = next_row;
+      do
+      {
+        next_row++;
+      } while (next_row < count && rows[next_row].id <= bound);
+      run->end = next_row;
+      leaf_node_prefetch(pager, run->page_num);
+      queued_runs++;
+    }
+
+    InsertRun run = runs[first_run];
+    first_run = (first_run + 1) % INSERT_RUN_PREFETCH_DISTANCE;
+    queued_runs--;
+
+    void *node = get_page(pager, run.page_num);
+    uint32_t num_fresh = leaf_node_new_rows(node, rows + run.start, run.end - run.start, fresh);
+    duplicate |= (num_fresh < run.end - run.start);
+    if (num_fresh == 0)
+    {
+      continue;
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells + num_fresh <= LEAF_NODE_MAX_CELLS)
+    {
+      leaf_node_insert_run(node, fresh, num_fresh);
+      continue;
+    }
+
+    uint32_t new_leaves = (num_cells + num_fresh + LEAF_NODE_MAX_CELLS - 1) / LEAF_NODE_MAX_CELLS - 1;
+    if (pager->num_pages + pages_needed_for_leaves(table, run.page_num, new_leaves) > TABLE_MAX_PAGES)
+    {
+      result = EXECUTE_TABLE_FULL;
+      break;
+    }
+    leaf_node_split_run(table, run.page_num, fresh, num_fresh, cells);
+    // the root may have split
+    height = table_height(table);
+  }
+
+  free(cells);
+  free(fresh);
+  if (result == EXECUTE_SUCCESS && duplicate)
+  {
+    result = EXECUTE_DUPLICATE_KEY;
+  }
+  return result;
+}
+
+// insert the rows of an insert statement with more than one
+ExecuteResult execute_insert_rows(Statement *statement, Table *table)
+{
+  RowView *rows = malloc(statement->num_rows * sizeof(RowView));
+  const char *position = statement->values.data;
+  const char *end = statement->values.data + statement->values.length;
+  for (uint32_t i = 0; i < statement->num_rows; i++)
+  {
+    // prepare_insert checked the values
+    StringView id_string;
+    next_token(&position, end, &id_string);
+    next_token(&position, end, &rows[i].username);
+    next_token(&position, end, &rows[i].email);
+    parse_id(id_string, &rows[i].id);
+  }
+
+  ExecuteResult result = table_insert_rows(table, rows, statement->num_rows);
+  free(rows);
+  return result;
+}
+
+/*
+Batch gets
+
+table_get_rows looks up many keys at once. One lookup after another
+waits on a cache miss at every level of the tree; here GET_DESCENTS
+descents are in flight together and take turns. Each turn does the work
+on one node and prefetches the memory the descent needs next (the
+child's header and keys, then the row), so by the time
+the descent's next turn comes round its memory has had time to arrive.
+
+- An internal node turn finds the child and prefetches it.
+- A leaf turn finds the key's cell and prefetches its row. The keys are
+  sorted, so the keys after it that the same leaf takes are taken along
+  without a descent of their own.
+- A row turn copies the rows out and starts the descent of the next key.
+*/
+#define GET_DESCENTS 16
+
+typedef enum
+{
+  GET_NODE, // search the internal node on page_num
+  GET_LEAF, // search the leaf on page_num
+  GET_ROW   // copy the rows of keys [key_index, last_key)
+} GetStep;
+
+typedef struct
+{
+  GetStep step;
+  uint32_t key_index;
+  uint32_t last_key;
+  uint32_t page_num;
+  uint32_t level;
+  uint64_t bound; // the largest key the node takes
+} GetDescent;
+
+/*
+Sort keys with a radix sort, a byte at a time from the lowest. qsort
+calls a comparison function about log2(count) times per key, which
+costs more than a lookup of a key that is in the cache. Bytes that are
+zero in every key are skipped, so 32-bit ids take four passes even in a
+table with 64-bit keys.
+*/
+void sort_keys(uint64_t *keys, uint32_t count)
+{
+  uint64_t used_bits = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    used_bits |= keys[i];
+  }
+
+  uint64_t *scratch = malloc(count * sizeof(uint64_t));
+  uint64_t *from = keys;
+  uint64_t *to = scratch;
+  for (uint32_t shift = 0; shift < 64 && (used_bits >> shift) != 0; shift += 8)
+  {
+    uint32_t offsets[256] = {0};
+    for (uint32_t i = 0; i < count; i++)
+    {
+      offsets[(from[i] >> shift) & 0xff]++;
+    }
+    uint32_t offset = 0;
+    for (uint32_t digit = 0; digit < 256; digit++)
+    {
+      uint32_t digit_count = offsets[digit];
+      offsets[digit] = offset;
+      offset += digit_count;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+      to[offsets[(from[i] >> shift) & 0xff]++] = from[i];
+    }
+    uint64_t *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != keys)
+  {
+    memcpy(keys, from, count * sizeof(uint64_t));
+  }
+  free(scratch);
+}
+
+/*
+Bring the part of a node a search reads into the cache: a leaf's keys
+and slots, or an internal node's header. An internal node's keys take up
+to half the page; prefetching them all would fill the CPU's queue of
+outstanding misses with lines the search mostly does not read, and the
+internal nodes near the leaves are shared by the sorted keys anyway.
+*/
+#define GET_INTERNAL_PREFETCH_BYTES 128
+
+void node_prefetch(Pager *pager, uint32_t page_num, bool leaf)
+{
+  void *page = pager->pages[page_num];
+  if (page == NULL)
+  {
+    scan_read_ahead(pager, page_num);
+    return;
+  }
+  uint32_t size = leaf ? LEAF_NODE_VALUES_OFFSET : GET_INTERNAL_PREFETCH_BYTES;
+  for (uint32_t offset = 0; offset < size; offset += 64)
+  {
+    __builtin_prefetch(page + offset);
+  }
+}
+
+void get_descent_start(GetDescent *descent, Table *table, uint32_t height, uint32_t key_index)
+{
+  descent->key_index = key_index;
+  descent->page_num = table->root_page_num;
+  descent->level = 1;
+  descent->bound = UINT64_MAX;
+  descent->step = height > 1 ? GET_NODE : GET_LEAF;
+}
+
+/*
+Look up many keys at once (see Batch gets). The keys are sorted in
+place and repeats are dropped; the rows of the keys that are in the
+table are copied to rows in key order. Returns the number of rows.
+*/
+uint32_t table_get_rows(Table *table, uint64_t *keys, uint32_t count, Row *rows)
+{
+  Pager *pager = table->pager;
+  sort_keys(keys, count);
+  uint32_t unique = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (unique == 0 || keys[i] != keys[unique - 1])
+    {
+      keys[unique++] = keys[i];
+    }
+  }
+  count = unique;
+
+  bool *found = calloc(count, sizeof(bool));
+  uint32_t height = table_height(table);
+  GetDescent descents[GET_DESCENTS];
+  uint32_t active = 0;
+  uint32_t next_key = 0;
+  while (active < GET_DESCENTS && next_key < count)
+  {
+    get_descent_start(&descents[active++], table, height, next_key++);
+  }
+
+  while (active > 0)
+  {
+    for (uint32_t d = 0; d < active; d++)
+    {
+      GetDescent *descent = &descents[d];
+      uint64_t key = keys[descent->key_index];
+      void *node = descent->step == GET_NODE ? pinned_page(pager, descent->page_num)
+                                             : get_page(pager, descent->page_num);
+
+      switch (descent->step)
+      {
+      case GET_NODE:
+      {
+        uint32_t index = internal_node_find_child(node, key);
+        if (index < *internal_node_num_keys(node))
+        {
+          descent->bound = internal_node_key(node, index);
+        }
+        descent->page_num = *internal_node_child(node, index);
+        descent->level++;
+        descent->step = descent->level < height ? GET_NODE : GET_LEAF;
+        node_prefetch(pager, descent->page_num, descent->step == GET_LEAF);
+        break;
+      }
+      case GET_LEAF:
+      {
+        // take along the keys after this one that no descent has started for
+        descent->last_key = descent->key_index + 1;
+        if (descent->last_key == next_key)
+        {
+          while (next_key < count && keys[next_key] <= descent->bound)
+          {
+            next_key++;
+          }
+          descent->last_key = next_key;
+        }
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t cell = key_array_lower_bound(leaf_node_keys(node), num_cells, key);
+        if (cell < num_cells)
+        {
+          void *value = leaf_node_value(node, cell);
+          for (uint32_t offset = 0; offset < ROW_SIZE; offset += 64)
+          {
+            __builtin_prefetch(value + offset);
+          }
+        }
+        descent->step = GET_ROW;
+        break;
+      }
+      case GET_ROW:
+      {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t cell = 0;
+        for (uint32_t i = descent->key_index; i < descent->last_key; i++)
+        {
+          cell += key_array_lower_bound(leaf_node_keys(node) + cell * LEAF_NODE_KEY_SIZE, num_cells - cell, keys[i]);
+          if (cell < num_cells && leaf_node_key(node, cell) == keys[i])
+          {
+            deserialize_row(leaf_node_value(node, cell), &rows[i]);
+            found[i] = true;
+          }
+        }
+
+        if (next_key < count)
+        {
+          get_descent_start(descent, table, height, next_key++);
+        }
+        else
+        {
+          // the last descent takes this one's place
+          *descent = descents[--active];
+          d--;
+        }
+        break;
+      }
+      }
+    }
+  }
+
+  uint32_t num_rows = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (found[i])
+    {
+      if (num_rows != i)
+      {
+        rows[num_rows] = rows[i];
+      }
+      num_rows++;
+    }
+  }
+  free(found);
+  return num_rows;
+}
+
+// select where id in (...): the rows of the listed ids, in key order
+ExecuteResult execute_select_keys(Statement *statement, Table *table)
+{
+  uint64_t *keys = malloc(statement->num_rows * sizeof(uint64_t));
+  const char *position = statement->values.data;
+  const char *end = statement->values.data + statement->values.length;
+  StringView id_string;
+  for (uint32_t i = 0; i < statement->num_rows; i++)
+  {
+    // prepare_select checked the ids
+    next_list_item(&position, end, &id_string);
+    parse_id(id_string, &keys[i]);
+  }
+
+  Row *rows = malloc(statement->num_rows * sizeof(Row));
+  uint32_t num_rows = table_get_rows(table, keys, statement->num_rows, rows);
+  for (uint32_t i = 0; i < num_rows; i++)
+  {
+    output_row(&rows[i]);
+  }
+
+  free(rows);
+  free(keys);
+  return EXECUTE_SUCCESS;
+}
+
+// select where id between ...: the rows of the range, a batch of views at a time
+ExecuteResult execute_select_range(Statement *statement, Table *table)
+{
+  RowView rows[SCAN_BATCH_ROWS];
+  ScanCursor cursor;
+  scan_cursor_open(table, statement->first_key, statement->last_key, &cursor);
+  uint32_t fetched;
+  while ((fetched = scan_cursor_fetch(&cursor, rows, SCAN_BATCH_ROWS)) > 0)
+  {
+    for (uint32_t i = 0; i < fetched; i++)
+    {
+      output_row_view(&rows[i]);
+    }
+  }
+  scan_cursor_close(&cursor);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_select(Statement *statement, Table *table)
+{
+  if (statement->num_rows > 0)
+  {
+    return execute_select_keys(statement, table);
+  }
+
+  if (statement->first_key != 0 || statement->last_key != MAX_KEY)
+  {
+    return execute_select_range(statement, table);
+  }
+
+  if (shell.threads > 1)
+  {
+    table_scan_parallel(table, shell.threads, true, scan_output_row, NULL);
+    return EXECUTE_SUCCESS;
+  }
+
+  ScanCursor cursor;
+  scan_cursor_open(table, 0, MAX_KEY, &cursor);
+  RowView row;
+  while (scan_cursor_next(&cursor, &row))
+  {
+    output_row_view(&row);
+  }
+  scan_cursor_close(&cursor);
+  return EXECUTE_SUCCESS;
+}
+
+// the latency histogram bucket for a duration: floor(log2(microseconds))
+uint32_t stats_latency_bucket(uint64_t nanoseconds)
+{
+  uint64_t microseconds = nanoseconds / 1000;
+  uint32_t bucket = 0;
+  while (microseconds > 1 && bucket < STATS_LATENCY_BUCKETS - 1)
+  {
+    microseconds >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+/*
+Execute a statement; inserts go through the group if one is given (see
+Insert groups)
+*/
+ExecuteResult execute_grouped_statement(Statement *statement, Table *table, InsertGroup *group)
+{
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  ExecuteResult result;
+  switch (statement->type)
+  {
+  case (STATEMENT_INSERT):
+    if (statement->num_rows > 1)
+    {
+      result = execute_insert_rows(statement, table);
+    }
+    else
+    {
+      result = group ? execute_grouped_insert(statement, table, group) : execute_insert(statement, table);
+    }
+    break;
+  case (STATEMENT_SELECT):
+    result = execute_select(statement, table);
+    break;
+  case (STATEMENT_UPDATE):
+  case (STATEMENT_DELETE):
+  default:
+    result = EXECUTE_SUCCESS;
+    break;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  uint64_t nanoseconds = (finished.tv_sec - started.tv_sec) * 1000000000ULL +
+                         finished.tv_nsec - started.tv_nsec;
+  stats.statements[statement->type]++;
+  stats.latency[statement->type][stats_latency_bucket(nanoseconds)]++;
+
+  return result;
+}
+
+ExecuteResult execute_statement(Statement *statement, Table *table)
+{
+  return execute_grouped_statement(statement, table, NULL);
+}
+
+/*
+The pager communicates directly with memory
+and sends the data to the table
+
+O_RDWR -> Open for reading and writing.
+O_CREAT -> Create file if it does not exist.
+S_IWUSR -> User write permission bit macro (owner permission)
+S_IRUSR -> User read permission bit macro (owner permission)
+*/
+uint32_t db_header_checksum(DbHeader *header)
+{
+  // a version 1 header ends where the key size is now
+  size_t length = header->version == 1 ? offsetof(DbHeader, key_size) : offsetof(DbHeader, checksum);
+  return crc32c_checksum(header, length);
+}
+
+// a new file: write a header page for the chosen page and key sizes
+void pager_write_header(Pager *pager, uint32_t page_size, uint32_t key_size)
+{
+  DbHeader *header = &pager->header;
+  memset(header, 0, sizeof(DbHeader));
+  memcpy(header->magic, DB_HEADER_MAGIC, sizeof(DB_HEADER_MAGIC));
+  header->version = DB_HEADER_VERSION;
+  header->page_size = page_size;
+  header->root_page_num = 1;
+  header->key_size = key_size;
+  header->checksum = db_header_checksum(header);
+
+  void *page = calloc(1, page_size);
+  memcpy(page, header, sizeof(DbHeader));
+  if (pager_write_function(pager->file_descriptor, page, page_size, 0) != page_size)
+  {
+    printf("Error writing db header: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  free(page);
+  stats_unsynced_bytes += page_size;
+  pager->file_length = page_size;
+}
+
+// an existing file: use its header, or the defaults if it predates headers
+void pager_read_header(Pager *pager)
+{
+  DbHeader *header = &pager->header;
+  ssize_t bytes_read = pread(pager->file_descriptor, header, sizeof(DbHeader), 0);
+  if (bytes_read != sizeof(DbHeader) || memcmp(header->magic, DB_HEADER_MAGIC, sizeof(DB_HEADER_MAGIC)) != 0)
+  {
+    memset(header, 0, sizeof(DbHeader));
+    header->page_size = DEFAULT_PAGE_SIZE;
+    header->root_page_num = 0;
+    header->key_size = sizeof(uint32_t);
+    return;
+  }
+
+  if (header->version == 1)
+  {
+    header->checksum = header->key_size;
+  }
+  if (header->checksum != db_header_checksum(header) || header->version > DB_HEADER_VERSION ||
+      !is_valid_page_size(header->page_size))
+  {
+    printf("Invalid db header. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (header->version == 1)
+  {
+    header->key_size = sizeof(uint32_t);
+  }
+  if (!is_valid_key_size(header->key_size))
+  {
+    printf("Invalid db header. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+page_size and key_size are used when the file is new; an existing file
+keeps the sizes it was created with.
+*/
+Pager *pager_open(const char *filename, uint32_t page_size, uint32_t key_size)
+{
+  // open a file for reading or writing O_RDWR
+  // if it doesn't exist, create it O_CREAT
+  // allow reading S_IRUSR and writing S_IWUSR permissions
+  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+
+  if (fd == -1)
+  {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Move the read/write file offset to the beginning of the DB file
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  Pager *pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->file_length = file_length; // size of the db file
+
+  if (file_length == 0)
+  {
+    if (!is_valid_page_size(page_size))
+    {
+      printf("Page size must be a power of two from %d to %d.\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+      exit(EXIT_FAILURE);
+    }
+    if (!is_valid_key_size(key_size))
+    {
+      printf("Key size must be 4 or 8 bytes.\n");
+      exit(EXIT_FAILURE);
+    }
+    pager_write_header(pager, page_size, key_size);
+  }
+  else
+  {
+    pager_read_header(pager);
+  }
+  set_page_layout(&pager->header);
+
+  struct stat file_status;
+  pager->block_size = fstat(fd, &file_status) == 0 ? file_status.st_blksize : PAGE_SIZE;
+  pager->compress = false;
+  pager->compression_buffer = malloc(PAGE_SIZE);
+  pthread_mutex_init(&pager->compression_lock, NULL);
+
+  file_length = pager->file_length;
+  pager->num_pages = (file_length / PAGE_SIZE);
+
+  // DB file must have an exact number of pages
+  if (file_length % PAGE_SIZE != 0)
+  {
+    printf("Db file is not a whole number of pages. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // initialize pages in the pager
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+  {
+    pager->pages[i] = NULL;
+  }
+  for (uint32_t i = 0; i < PAGE_LOAD_STRIPES; i++)
+  {
+    pthread_mutex_init(&pager->load_locks[i], NULL);
+  }
+  pager->frames = page_arena_allocate((size_t)TABLE_MAX_PAGES * PAGE_SIZE, &pager->frames_size);
+
+  return pager;
+}
+
+// load node and the internal nodes under it; levels counts the internal levels from node down
+void pin_internal_level(Pager *pager, uint32_t page_num, uint32_t levels)
+{
+  void *node = get_page(pager, page_num);
+  if (levels == 1)
+  {
+    return;
+  }
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i <= num_keys; i++)
+  {
+    pin_internal_level(pager, *internal_node_child(node, i), levels - 1);
+  }
+}
+
+/*
+Load the root and every internal node of a file that is being opened
+(see Pinned pages). The number of levels is found by walking down the
+left edge through a scan ring, so no leaf is loaded.
+*/
+void pin_internal_nodes(Table *table)
+{
+  Pager *pager = table->pager;
+  ScanRing ring;
+  scan_ring_init(&ring);
+  uint32_t levels = 0;
+  void *node = get_page(pager, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    levels++;
+    node = scan_ring_page(pager, &ring, *internal_node_child(node, 0));
+  }
+  scan_ring_free(&ring);
+
+  if (levels > 0)
+  {
+    pin_internal_level(pager, table->root_page_num, levels);
+  }
+}
+
+/*
+db_open():
+
+1. Opens a database file
+2. Initializing a pager data structure
+3. Initializing a table data structure
+
+The pager is the go between the memory and the table
+
+filename -> The file name for the DB
+page_size -> The page size if the file is created (DEFAULT_PAGE_SIZE, or
+             a power of two from MIN_PAGE_SIZE to MAX_PAGE_SIZE)
+key_size -> The key size in bytes if the file is created (DEFAULT_KEY_SIZE,
+            or 8 for ids up to 2^64 - 1)
+*/
+/*
+The key search and checksum functions are picked for the CPU, and the
+checksum tables built, once per process, before the first database is
+opened and before any thread that could use them is started.
+*/
+pthread_once_t dblite_init_once = PTHREAD_ONCE_INIT;
+
+void dblite_init()
+{
+  key_search_init();
+  crc32c_init();
+}
+
+Table *db_open(const char *filename, uint32_t page_size, uint32_t key_size)
+{
+  pthread_once(&dblite_init_once, dblite_init);
+  Pager *pager = pager_open(filename, page_size, key_size);
+
+  Table *table = malloc(sizeof(Table)); // (size_t)808UL (unsigned long)
+  table->pager = pager;
+  // the root follows the header (page 0 in files without one)
+  table->root_page_num = pager->header.root_page_num;
+  table->defrag_slot = 0;
+  table->defrag_num_pages = 0;
+  table->backup = NULL;
+
+  if (pager->num_pages <= table->root_page_num)
+  {
+    // New database file. Initialize the root page as leaf node
+    void *root_node = get_page(pager, table->root_page_num);
+    initialize_leaf_node(root_node);
+    // The first node in the table is the root
+    set_node_root(root_node, true);
+  }
+  else
+  {
+    pin_internal_nodes(table);
+  }
+
+  return table;
+}
+
+// print indentation in output
+void indent(uint32_t level)
+{
+  for (uint32_t i = 0; i < level; i++)
+  {
+    printf("  ");
+  }
+}
+
+/**
+ * Recursive method to print tree
+ *
+ * 1. Start at root of tree (may be root of entire db or a specific internal node)
+ * 2. If leaf, print size of leaf. Print each key contained in leaf at a higher indentation
+ * level.
+ * 3. If internal, print size of internal node. For each child, run print_tree on child
+ * at a higher indentation level.
+ * 4. If internal, finally, run print_tree on right child.
+ */
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level)
+{
+  void *node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+
+  switch (get_node_type(node))
+  {
+  case (NODE_LEAF):
+    num_keys = *leaf_node_num_cells(node);
+    indent(indentation_level);
+    printf("- leaf (size %d)\n", num_keys);
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+      indent(indentation_level + 1);
+      printf("- %llu\n", (unsigned long long)leaf_node_key(node, i));
+    }
+    break;
+
+  case (NODE_INTERNAL):
+    num_keys = *internal_node_num_keys(node);
+    indent(indentation_level);
+    printf("- internal (size %d)\n", num_keys);
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+      child = *internal_node_child(node, i);
+      print_tree(pager, child, indentation_level + 1);
+
+      indent(indentation_level + 1);
+      printf("- key %llu\n", (unsigned long long)internal_node_key(node, i));
+    }
+    child = *internal_node_right_child(node);
+    print_tree(pager, child, indentation_level + 1);
+    break;
+  }
+}
+
+/*
+Fill in a snapshot of the statistics
+
+The counters are copied as they are. The tree height is the length of
+the path to the leftmost leaf (all leaves are at the same depth), and
+the average leaf fill walks the leaf chain, reading each leaf's cell
+count.
+*/
+void db_stats(Table *table, DbStats *snapshot)
+{
+  // the walk below is not work done for the table; keep it out of the counters
+  DbStats counters = stats;
+  *snapshot = counters;
+
+  snapshot->tree_height = table_height(table);
+
+  // the leaf chain is read like a scan, through a scan ring
+  ScanRing ring;
+  scan_ring_init(&ring);
+  uint64_t bound;
+  uint32_t page_num = table_find_leaf(table, snapshot->tree_height, 0, &bound);
+  uint64_t leaves = 0;
+  uint64_t cells = 0;
+  for (;;)
+  {
+    // page 0 holds the root leaf of a file without a header
+    void *node = scan_ring_page(table->pager, &ring, page_num);
+    leaves++;
+    cells += *leaf_node_num_cells(node);
+    page_num = *leaf_node_next_leaf(node);
+    if (page_num == 0)
+    {
+      break;
+    }
+  }
+  scan_ring_free(&ring);
+  snapshot->average_leaf_fill = (double)cells / (leaves * LEAF_NODE_MAX_CELLS);
+
+  stats = counters;
+}
+
+// zero every counter and histogram
+void db_stats_reset()
+{
+  memset(&stats, 0, sizeof(stats));
+}
+
+void print_stats(Table *table)
+{
+  static const char *statement_names[STATS_STATEMENT_TYPES] = {"insert", "select", "update", "delete"};
+
+  DbStats snapshot;
+  db_stats(table, &snapshot);
+
+  printf("page cache hits: %llu\n", (unsigned long long)snapshot.page_cache_hits);
+  printf("page cache misses: %llu\n", (unsigned long long)snapshot.page_cache_misses);
+  printf("pages read: %llu\n", (unsigned long long)snapshot.pages_read);
+  printf("pages written: %llu\n", (unsigned long long)snapshot.pages_written);
+  printf("bytes fsynced: %llu\n", (unsigned long long)snapshot.bytes_fsynced);
+  printf("leaf splits: %llu\n", (unsigned long long)snapshot.leaf_splits);
+  printf("internal splits: %llu\n", (unsigned long long)snapshot.internal_splits);
+  printf("tree height: %u\n", snapshot.tree_height);
+  printf("average leaf fill: %.1f%%\n", snapshot.average_leaf_fill * 100);
+  printf("cursor advances: %llu\n", (unsigned long long)snapshot.cursor_advances);
+  printf("grouped inserts: %llu\n", (unsigned long long)snapshot.inserts_grouped);
+  printf("scan ring reads: %llu\n", (unsigned long long)snapshot.scan_ring_reads);
+  printf("checksums verified: %llu (%llu bytes)\n", (unsigned long long)snapshot.checksums_verified,
+         (unsigned long long)snapshot.checksum_bytes);
+  printf("pages compressed: %llu (%llu bytes on disk for %llu bytes of pages)\n",
+         (unsigned long long)snapshot.pages_compressed, (unsigned long long)snapshot.compressed_bytes,
+         (unsigned long long)snapshot.pages_compressed * PAGE_SIZE);
+
+  for (uint32_t type = 0; type < STATS_STATEMENT_TYPES; type++)
+  {
+    if (snapshot.statements[type] == 0)
+    {
+      continue;
+    }
+    printf("%s statements: %llu\n", statement_names[type], (unsigned long long)snapshot.statements[type]);
+    for (uint32_t bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++)
+    {
+      if (snapshot.latency[type][bucket] == 0)
+      {
+        continue;
+      }
+      if (bucket == STATS_LATENCY_BUCKETS - 1)
+      {
+        printf("  >= %llu us: ", 1ULL << bucket);
+      }
+      else
+      {
+        printf("  < %llu us: ", 2ULL << bucket);
+      }
+      printf("%llu\n", (unsigned long long)snapshot.latency[type][bucket]);
+    }
+  }
+}
+
+/*
+.analyze
+
+A tree health report that, unlike print_tree, does not walk the tree.
+Pages are visited once in file order. A page that is not in the page
+cache is read into a scratch buffer instead, so analysing a large file
+neither keeps it in memory nor needs more than three pages of it.
+
+- level: a node's height above the leaves (leaves are level 0). An
+  internal node's level is found by following its first child down.
+- fill: cells used out of the node's capacity, in 10% buckets
+- leaf chain: links of leaf_node_next_leaf that point to the next page
+  in the file; any other link is a seek in a full scan
+- free pages: pages that are not the root and not a child of any
+  internal node
+*/
+#define ANALYZE_MAX_LEVELS 32
+#define ANALYZE_FILL_BUCKETS 11
+
+typedef struct
+{
+  uint64_t nodes[ANALYZE_MAX_LEVELS];
+  uint64_t cells[ANALYZE_MAX_LEVELS];
+  uint64_t leaf_fill[ANALYZE_FILL_BUCKETS]; // bucket 10 is completely full
+  uint64_t chain_links;
+  uint64_t chain_sequential;
+  uint64_t chain_backward;
+  uint64_t reachable_pages;
+  uint32_t height;
+} TreeAnalysis;
+
+// a page as it currently is: the cached frame, or a copy read into buffer
+void *analyze_page(Pager *pager, uint32_t page_num, void *buffer)
+{
+  if (pager->pages[page_num] != NULL)
+  {
+    return pager->pages[page_num];
+  }
+  pager_read_page(pager, page_num, buffer);
+  return buffer;
+}
+
+uint32_t analyze_node_level(Pager *pager, void *node, void *buffer)
+{
+  uint32_t level = 0;
+  while (get_node_type(node) == NODE_INTERNAL && level < ANALYZE_MAX_LEVELS - 1)
+  {
+    node = analyze_page(pager, *internal_node_child(node, 0), buffer);
+    level++;
+  }
+  return level;
+}
+
+void analyze_tree(Table *table, TreeAnalysis *analysis)
+{
+  Pager *pager = table->pager;
+  void *page_buffer = malloc(PAGE_SIZE);
+  void *level_buffer = malloc(PAGE_SIZE);
+
+  memset(analysis, 0, sizeof(*analysis));
+  analysis->reachable_pages = 1; // the root
+
+  // pages before the root hold the database header
+  for (uint32_t page_num = table->root_page_num; page_num < pager->num_pages; page_num++)
+  {
+    void *node = analyze_page(pager, page_num, page_buffer);
+    uint32_t level;
+
+    if (get_node_type(node) == NODE_LEAF)
+    {
+      uint32_t num_cells = *leaf_node_num_cells(node);
+      level = 0;
+      analysis->cells[0] += num_cells;
+      analysis->leaf_fill[num_cells * (ANALYZE_FILL_BUCKETS - 1) / LEAF_NODE_MAX_CELLS]++;
+
+      uint32_t next_page_num = *leaf_node_next_leaf(node);
+      if (next_page_num != 0)
+      {
+        analysis->chain_links++;
+        if (next_page_num == page_num + 1)
+        {
+          analysis->chain_sequential++;
+        }
+        else if (next_page_num < page_num)
+        {
+          analysis->chain_backward++;
+        }
+      }
+    }
+    else
+    {
+      uint32_t num_keys = *internal_node_num_keys(node);
+      level = analyze_node_level(pager, node, level_buffer);
+      analysis->cells[level] += num_keys;
+      analysis->reachable_pages += num_keys + 1;
+    }
+
+    analysis->nodes[level]++;
+    if (level + 1 > analysis->height)
+    {
+      analysis->height = level + 1;
+    }
+  }
+
+  free(level_buffer);
+  free(page_buffer);
+}
+
+void print_analysis(Table *table)
+{
+  TreeAnalysis analysis;
+  analyze_tree(table, &analysis);
+
+  uint32_t num_pages = table->pager->num_pages - table->root_page_num;
+  printf("pages: %u\n", num_pages);
+  printf("free pages: %llu\n", (unsigned long long)(num_pages - analysis.reachable_pages));
+  printf("height: %u\n", analysis.height);
+
+  for (uint32_t level = 0; level < analysis.height; level++)
+  {
+    // internal nodes hold one more child than keys
+    uint32_t capacity = level == 0 ? LEAF_NODE_MAX_CELLS : INTERNAL_NODE_MAX_CELLS;
+    printf("level %u: %llu %s, %.1f%% full\n", level, (unsigned long long)analysis.nodes[level],
+           level == 0 ? "leaves" : "internal nodes",
+           100.0 * analysis.cells[level] / (analysis.nodes[level] * capacity));
+  }
+
+  printf("leaf fill:\n");
+  for (uint32_t bucket = 0; bucket < ANALYZE_FILL_BUCKETS; bucket++)
+  {
+    if (analysis.leaf_fill[bucket] == 0)
+    {
+      continue;
+    }
+    if (bucket == ANALYZE_FILL_BUCKETS - 1)
+    {
+      printf("  100%%: ");
+    }
+    else
+    {
+      printf("  %u-%u%%: ", bucket * 10, bucket * 10 + 9);
+    }
+    printf("%llu\n", (unsigned long long)analysis.leaf_fill[bucket]);
+  }
+
+  uint64_t out_of_order = analysis.chain_links - analysis.chain_sequential;
+  printf("leaf chain: %llu links, %llu sequential, %llu forward jumps, %llu backward jumps\n",
+         (unsigned long long)analysis.chain_links, (unsigned long long)analysis.chain_sequential,
+         (unsigned long long)(out_of_order - analysis.chain_backward),
+         (unsigned long long)analysis.chain_backward);
+  printf("fragmentation: %.1f%%\n",
+         analysis.chain_links ? 100.0 * out_of_order / analysis.chain_links : 0.0);
+}
+
+/*
+.defrag
+
+Leaves are allocated in split order, so after random inserts the leaf
+chain jumps back and forth through the file and a full scan seeks for
+almost every leaf. Defragmenting moves the i-th leaf of the chain to
+the i-th page after the root (the root never moves), leaving the
+internal nodes after the leaves.
+
+A page is moved by swapping it with the page in its target slot. Every
+pointer to either page is then rewritten:
+- the parent's child pointer (and the children's node_parent, for an
+  internal node)
+- the previous leaf's leaf_node_next_leaf
+- the swapped nodes' own pointers, which may refer to each other
+
+The work is done in steps of a bounded number of leaves so it can be
+interleaved with statements. A step resumes after the leaf in slot
+defrag_slot - 1: inserts only add pages at the end of the file, so the
+leaves already placed stay in place. Leaves split off in the meantime
+are picked up by the next pass. A pass that ends with as many pages as
+it started with leaves the chain fully sequential.
+*/
+#define DEFRAG_STEP_PAGES 64
+
+uint32_t swapped_page_num(uint32_t page_num, uint32_t a, uint32_t b)
+{
+  if (page_num == a)
+  {
+    return b;
+  }
+  if (page_num == b)
+  {
+    return a;
+  }
+  return page_num;
+}
+
+// rewrite every page number a node holds after pages a and b are swapped
+void swap_node_pointers(void *node, uint32_t a, uint32_t b)
+{
+  if (!is_node_root(node))
+  {
+    *node_parent(node) = swapped_page_num(*node_parent(node), a, b);
+  }
+
+  if (get_node_type(node) == NODE_LEAF)
+  {
+    *leaf_node_next_leaf(node) = swapped_page_num(*leaf_node_next_leaf(node), a, b);
+    return;
+  }
+
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i < num_keys; i++)
+  {
+    *internal_node_cell(node, i) = swapped_page_num(*internal_node_cell(node, i), a, b);
+  }
+  *internal_node_right_child(node) = swapped_page_num(*internal_node_right_child(node), a, b);
+}
+
+/*
+The leaf before a leaf in the chain, or INVALID_PAGE_NUM for the first
+
+Climb until the node is not its parent's first child, then take the
+rightmost leaf under the child to its left.
+*/
+uint32_t leaf_node_previous(Pager *pager, uint32_t page_num)
+{
+  void *node = get_page(pager, page_num);
+  while (!is_node_root(node))
+  {
+    void *parent = get_page(pager, *node_parent(node));
+    uint32_t num_keys = *internal_node_num_keys(parent);
+
+    uint32_t index = 0;
+    while (index < num_keys && *internal_node_child(parent, index) != page_num)
+    {
+      index++;
+    }
+
+    if (index > 0)
+    {
+      page_num = *internal_node_child(parent, index - 1);
+      node = get_page(pager, page_num);
+      while (get_node_type(node) == NODE_INTERNAL)
+      {
+        page_num = *internal_node_right_child(node);
+        node = get_page(pager, page_num);
+      }
+      return page_num;
+    }
+
+    page_num = *node_parent(node);
+    node = parent;
+  }
+  return INVALID_PAGE_NUM;
+}
+
+void add_referrer(uint32_t *referrers, uint32_t *num_referrers, uint32_t page_num)
+{
+  for (uint32_t i = 0; i < *num_referrers; i++)
+  {
+    if (referrers[i] == page_num)
+    {
+      return;
+    }
+  }
+  referrers[(*num_referrers)++] = page_num;
+}
+
+// exchange pages a and b, neither of which is the root
+void swap_pages(Table *table, uint32_t a, uint32_t b, void *scratch)
+{
+  Pager *pager = table->pager;
+
+  // each page, its parent, the leaf before it and its children
+  uint32_t max_referrers = 2 * (3 + INTERNAL_NODE_MAX_CELLS + 1);
+  uint32_t *referrers = malloc(max_referrers * sizeof(uint32_t));
+  uint32_t num_referrers = 0;
+
+  uint32_t pages[2] = {a, b};
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    void *node = get_page(pager, pages[i]);
+    add_referrer(referrers, &num_referrers, pages[i]);
+    add_referrer(referrers, &num_referrers, *node_parent(node));
+
+    if (get_node_type(node) == NODE_LEAF)
+    {
+      uint32_t previous = leaf_node_previous(pager, pages[i]);
+      if (previous != INVALID_PAGE_NUM)
+      {
+        add_referrer(referrers, &num_referrers, previous);
+      }
+    }
+    else
+    {
+      for (uint32_t child = 0; child <= *internal_node_num_keys(node); child++)
+      {
+        add_referrer(referrers, &num_referrers, *internal_node_child(node, child));
+      }
+    }
+  }
+
+  void *page_a = get_page(pager, a);
+  void *page_b = get_page(pager, b);
+  memcpy(scratch, page_a, PAGE_SIZE);
+  memcpy(page_a, page_b, PAGE_SIZE);
+  memcpy(page_b, scratch, PAGE_SIZE);
+
+  // each referrer is rewritten once, at its location after the swap
+  for (uint32_t i = 0; i < num_referrers; i++)
+  {
+    swap_node_pointers(get_page(pager, swapped_page_num(referrers[i], a, b)), a, b);
+  }
+
+  free(referrers);
+}
+
+/*
+Place up to max_pages leaves; returns true once the leaf chain is
+sequential. pages_moved is set to the number of pages swapped.
+*/
+bool table_defrag_step(Table *table, uint32_t max_pages, uint32_t *pages_moved)
+{
+  Pager *pager = table->pager;
+  *pages_moved = 0;
+
+  if (get_node_type(get_page(pager, table->root_page_num)) == NODE_LEAF)
+  {
+    // a single leaf has no chain
+    return true;
+  }
+
+  uint32_t slot = table->defrag_slot;
+  uint32_t page_num;
+  if (slot == 0)
+  {
+    Cursor cursor;
+    table_start(table, &cursor);
+    page_num = cursor.page_num;
+    slot = table->root_page_num + 1;
+    table->defrag_num_pages = pager->num_pages;
+  }
+  else
+  {
+    page_num = *leaf_node_next_leaf(get_page(pager, slot - 1));
+  }
+
+  void *scratch = malloc(PAGE_SIZE);
+  for (uint32_t i = 0; i < max_pages && page_num != 0; i++)
+  {
+    if (page_num != slot)
+    {
+      swap_pages(table, page_num, slot, scratch);
+      (*pages_moved)++;
+    }
+    page_num = *leaf_node_next_leaf(get_page(pager, slot));
+    slot++;
+  }
+  free(scratch);
+
+  if (page_num != 0)
+  {
+    table->defrag_slot = slot;
+    return false;
+  }
+
+  // end of a pass; it is complete unless leaves were split during it
+  table->defrag_slot = 0;
+  return table->defrag_num_pages == pager->num_pages;
+}
+
+/*
+.import <path>
+
+Loads a file in the CSV format select writes in batch mode (id, username
+and email; a field with a separator or a quote is quoted) into an empty
+table with table_bulk_load, on every core. A quoted field may not span
+lines.
+*/
+
 /**
- * Example:
- *
- * Let's say this is the current state of the db:
- * Internal: *, 5, *
- * Left child: 1, 5
- *
- * Say we add a new cell, 3, and the maximum number of cells is 2.
- * The db state will become:
- * Internal: *, 5, *
- * Left child: 1, 3
- * Right child: 5
- * (the left child was split)
- *
- * We now want the left key in the parent to point to the left child
- * The left key should be the max of the left child, 3
- * So this method will:
- * i. Find the child at the key 5 (left child)
- * ii. Change the key that points to the left child in the parent to 3
- * (so we change the 5 to 3)
- *
- * The table now looks like this:
- * Internal: *, 3, *
- * Left child: 1, 3
- * Right child: 5
+ * Copies the next CSV field of the line into field and moves *position
+ * past it and its separator.
+ * Returns false if the field does not fit in capacity bytes (with its
+ * null character) or its quotes are not closed.
  */
-void update_internal_node_key(void *parent_node, uint32_t old_key, uint32_t new_key)
+bool read_csv_field(const char **position, const char *end, char *field, uint32_t capacity)
+{
+  const char *c = *position;
+  uint32_t length = 0;
+  bool quoted = (c < end && *c == '"');
+  if (quoted)
+  {
+    c++;
+  }
+
+  for (; c < end; c++)
+  {
+    if (quoted && *c == '"')
+    {
+      if (c + 1 < end && c[1] == '"')
+      {
+        // a doubled quote stands for one quote
+        c++;
+      }
+      else
+      {
+        quoted = false;
+        continue;
+      }
+    }
+    else if (!quoted && *c == ',')
+    {
+      break;
+    }
+    if (length + 1 >= capacity)
+    {
+      return false;
+    }
+    field[length++] = *c;
+  }
+  field[length] = '\0';
+
+  *position = (c < end) ? c + 1 : c;
+  return !quoted;
+}
+
+bool parse_csv_row(const char *line, size_t length, Row *row)
+{
+  const char *position = line;
+  const char *end = line + length;
+  char id[24];
+
+  memset(row, 0, sizeof(Row));
+  if (!read_csv_field(&position, end, id, sizeof(id)) ||
+      !read_csv_field(&position, end, row->username, sizeof(row->username)) ||
+      !read_csv_field(&position, end, row->email, sizeof(row->email)) ||
+      position != end)
+  {
+    return false;
+  }
+
+  StringView id_view = {id, strlen(id)};
+  return id_view.length > 0 && parse_id(id_view, &row->id) == PREPARE_SUCCESS;
+}
+
+bool table_is_empty(Table *table)
+{
+  void *root = get_page(table->pager, table->root_page_num);
+  return get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+}
+
+void import_csv(Table *table, const char *path)
+{
+  if (!table_is_empty(table))
+  {
+    report_error("Table must be empty to import.\n");
+    return;
+  }
+
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    report_error("Unable to open '%s'\n", path);
+    return;
+  }
+
+  uint32_t count = 0;
+  uint32_t capacity = 1024;
+  Row *rows = malloc(capacity * sizeof(Row));
+  char *line = NULL;
+  size_t line_capacity = 0;
+  ssize_t length;
+  uint32_t line_number = 0;
+  while ((length = getline(&line, &line_capacity, file)) != -1)
+  {
+    line_number++;
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+    {
+      length--;
+    }
+    if (length == 0)
+    {
+      continue;
+    }
+
+    if (count == capacity)
+    {
+      capacity *= 2;
+      rows = realloc(rows, capacity * sizeof(Row));
+    }
+    if (!parse_csv_row(line, length, &rows[count]))
+    {
+      report_error("Line %u of '%s' is not a valid row.\n", line_number, path);
+      free(line);
+      free(rows);
+      fclose(file);
+      return;
+    }
+    count++;
+  }
+  free(line);
+  fclose(file);
+
+  switch (table_bulk_load(table, rows, count, bulk_load_workers()))
+  {
+  case (EXECUTE_SUCCESS):
+    printf("Imported %u rows.\n", count);
+    break;
+  case (EXECUTE_TABLE_FULL):
+    report_error("Error: Table full.\n");
+    break;
+  case (EXECUTE_DUPLICATE_KEY):
+    report_error("Error: Duplicate key.\n");
+    break;
+  }
+  free(rows);
+}
+
+/*
+.dump <path> and .load <path>
+
+.dump writes every row of the table to a file that .load reads back into
+an empty table, without the text formatting and parsing a round trip
+through select and .import costs. The rows are read with a result cursor
+(see Result cursors), which follows the leaves one after the other, and
+loaded with table_bulk_load.
+
+A dump starts with a header:
+
+ * byte 0 - 7: DUMP_MAGIC
+ * byte 8: DUMP_VERSION
+ * byte 9: the size of the ids (the key size of the table dumped)
+ * byte 12 - 15: number of rows, so .load can allocate them up front
+
+followed by chunks of up to DUMP_CHUNK_ROWS rows, in key order:
+
+ * byte 0 - 3: number of rows
+ * byte 4 - 7: length of the rows as stored
+ * byte 8 - 11: length of the rows uncompressed
+ * byte 12 - 15: CRC32C of the rows uncompressed
+ * byte 16 - : the rows
+
+The rows of a chunk are stored by column: the ids, a byte with the
+length of each username, a byte with the length of each email, then the
+usernames and the emails without their padding. A column of similar
+values compresses well, so a chunk is compressed with LZ4 (see PAGE
+COMPRESSION) when that makes it smaller; the two lengths differ when it
+is. Integers are little-endian, like the pages. A table with 64-bit
+keys can load a dump of 32-bit ids, and the other way round if the ids
+fit.
+*/
+#define DUMP_MAGIC "dbldump"
+#define DUMP_VERSION 1
+#define DUMP_HEADER_SIZE 16
+#define DUMP_CHUNK_HEADER_SIZE 16
+#define DUMP_CHUNK_ROWS 4096
+
+// a chunk's columns, filled in as rows are fetched
+typedef struct
+{
+  uint32_t count;
+  uint8_t ids[DUMP_CHUNK_ROWS * sizeof(uint64_t)];
+  uint8_t username_lengths[DUMP_CHUNK_ROWS];
+  uint8_t email_lengths[DUMP_CHUNK_ROWS];
+  uint32_t usernames_length;
+  uint32_t emails_length;
+  char usernames[DUMP_CHUNK_ROWS * COLUMN_USERNAME_SIZE];
+  char emails[DUMP_CHUNK_ROWS * COLUMN_EMAIL_SIZE];
+} DumpChunk;
+
+#define DUMP_CHUNK_MAX_SIZE (DUMP_CHUNK_ROWS * (sizeof(uint64_t) + 2 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE))
+
+void dump_chunk_add(DumpChunk *chunk, RowView *row)
+{
+  memcpy(chunk->ids + chunk->count * ID_SIZE, &row->id, ID_SIZE);
+  chunk->username_lengths[chunk->count] = row->username.length;
+  chunk->email_lengths[chunk->count] = row->email.length;
+  memcpy(chunk->usernames + chunk->usernames_length, row->username.data, row->username.length);
+  chunk->usernames_length += row->username.length;
+  memcpy(chunk->emails + chunk->emails_length, row->email.data, row->email.length);
+  chunk->emails_length += row->email.length;
+  chunk->count++;
+}
+
+// write a chunk's columns out, compressed if that is smaller; false if the file is not written
+bool dump_chunk_write(DumpChunk *chunk, uint8_t *buffer, uint8_t *compressed, FILE *file)
+{
+  uint8_t *position = buffer;
+  memcpy(position, chunk->ids, chunk->count * ID_SIZE);
+  position += chunk->count * ID_SIZE;
+  memcpy(position, chunk->username_lengths, chunk->count);
+  position += chunk->count;
+  memcpy(position, chunk->email_lengths, chunk->count);
+  position += chunk->count;
+  memcpy(position, chunk->usernames, chunk->usernames_length);
+  position += chunk->usernames_length;
+  memcpy(position, chunk->emails, chunk->emails_length);
+  position += chunk->emails_length;
+
+  uint32_t length = position - buffer;
+  uint32_t stored_length = lz4_compress(buffer, length, compressed, length - 1);
+  uint32_t header[DUMP_CHUNK_HEADER_SIZE / sizeof(uint32_t)] = {chunk->count, stored_length, length,
+                                                                crc32c_checksum(buffer, length)};
+  if (stored_length == 0)
+  {
+    header[1] = length;
+  }
+  bool written = fwrite(header, sizeof(header), 1, file) == 1 &&
+                 fwrite(stored_length == 0 ? buffer : compressed, header[1], 1, file) == 1;
+
+  chunk->count = 0;
+  chunk->usernames_length = 0;
+  chunk->emails_length = 0;
+  return written;
+}
+
+void dump_table(Table *table, const char *path)
+{
+  // opening the file truncates it
+  if (is_database_file(table->pager, path))
+  {
+    report_error("Cannot dump the database onto itself.\n");
+    return;
+  }
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+  {
+    report_error("Unable to open '%s'\n", path);
+    return;
+  }
+
+  uint8_t header[DUMP_HEADER_SIZE] = {0};
+  memcpy(header, DUMP_MAGIC, sizeof(DUMP_MAGIC));
+  header[8] = DUMP_VERSION;
+  header[9] = ID_SIZE;
+  bool written = fwrite(header, sizeof(header), 1, file) == 1;
+
+  DumpChunk *chunk = malloc(sizeof(DumpChunk));
+  chunk->count = 0;
+  chunk->usernames_length = 0;
+  chunk->emails_length = 0;
+  uint8_t *buffer = malloc(DUMP_CHUNK_MAX_SIZE);
+  uint8_t *compressed = malloc(DUMP_CHUNK_MAX_SIZE);
+  RowView rows[SCAN_BATCH_ROWS];
+  uint32_t total = 0;
+
+  // a write that fails stops the dump
+  ScanCursor cursor;
+  scan_cursor_open(table, 0, MAX_KEY, &cursor);
+  uint32_t fetched;
+  while (written && (fetched = scan_cursor_fetch(&cursor, rows, SCAN_BATCH_ROWS)) > 0)
+  {
+    // the views are copied out before the next fetch
+    for (uint32_t i = 0; i < fetched && written; i++)
+    {
+      dump_chunk_add(chunk, &rows[i]);
+      if (chunk->count == DUMP_CHUNK_ROWS)
+      {
+        written = dump_chunk_write(chunk, buffer, compressed, file);
+      }
+    }
+    total += fetched;
+  }
+  scan_cursor_close(&cursor);
+  if (written && chunk->count > 0)
+  {
+    written = dump_chunk_write(chunk, buffer, compressed, file);
+  }
+
+  free(compressed);
+  free(buffer);
+  free(chunk);
+
+  written = written && fseek(file, 12, SEEK_SET) == 0 && fwrite(&total, sizeof(total), 1, file) == 1;
+  if (fclose(file) != 0 || !written)
+  {
+    report_error("Unable to write '%s'\n", path);
+    return;
+  }
+  printf("Dumped %u rows.\n", total);
+}
+
+/*
+Read the rows of a chunk, as written by dump_chunk_write, into rows.
+Returns false if the lengths in the chunk do not add up or a value does
+not fit the table.
+*/
+bool dump_chunk_read(const uint8_t *chunk, uint32_t length, uint32_t count, uint32_t id_size, Row *rows)
 {
-  // find the child at the old_key position
-  uint32_t old_child_index = internal_node_find_child(parent_node, old_key);
-  *internal_node_key(parent_node, old_child_index) = new_key;
+  uint64_t fixed_length = (uint64_t)count * (id_size + 2);
+  if (fixed_length > length)
+  {
+    return false;
+  }
+  const uint8_t *ids = chunk;
+  const uint8_t *username_lengths = ids + count * id_size;
+  const uint8_t *email_lengths = username_lengths + count;
+  const uint8_t *usernames = email_lengths + count;
+  uint64_t usernames_length = 0;
+  uint64_t emails_length = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    usernames_length += username_lengths[i];
+    emails_length += email_lengths[i];
+  }
+  if (fixed_length + usernames_length + emails_length != length)
+  {
+    return false;
+  }
+  const uint8_t *emails = usernames + usernames_length;
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    Row *row = &rows[i];
+    memset(row, 0, sizeof(Row));
+    memcpy(&row->id, ids + i * id_size, id_size);
+    if (row->id > MAX_KEY || username_lengths[i] > COLUMN_USERNAME_SIZE)
+    {
+      return false;
+    }
+    memcpy(row->username, usernames, username_lengths[i]);
+    usernames += username_lengths[i];
+    memcpy(row->email, emails, email_lengths[i]);
+    emails += email_lengths[i];
+  }
+  return true;
+}
+
+void load_dump(Table *table, const char *path)
+{
+  if (!table_is_empty(table))
+  {
+    report_error("Table must be empty to load.\n");
+    return;
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    report_error("Unable to open '%s'\n", path);
+    return;
+  }
+
+  uint8_t header[DUMP_HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, DUMP_MAGIC, sizeof(DUMP_MAGIC)) != 0 ||
+      header[8] != DUMP_VERSION || !is_valid_key_size(header[9]))
+  {
+    report_error("'%s' is not a dump file.\n", path);
+    fclose(file);
+    return;
+  }
+  uint32_t id_size = header[9];
+  uint32_t total;
+  memcpy(&total, header + 12, sizeof(total));
+
+  /*
+  The count is only checked against the chunks once they are read, so
+  first check it against what the file could hold: every chunk holds at
+  most DUMP_CHUNK_ROWS rows, and takes its header and at least a byte.
+  Compressed rows can take less than a byte each, so the size of a row
+  does not bound it.
+  */
+  struct stat file_stat;
+  uint64_t max_chunks = 0;
+  if (fstat(fileno(file), &file_stat) == 0 && file_stat.st_size > DUMP_HEADER_SIZE)
+  {
+    max_chunks = (file_stat.st_size - DUMP_HEADER_SIZE) / (DUMP_CHUNK_HEADER_SIZE + 1);
+  }
+  Row *rows = NULL;
+  if (total <= max_chunks * DUMP_CHUNK_ROWS)
+  {
+    // one more byte, so an empty dump gets a pointer too
+    rows = malloc((size_t)total * sizeof(Row) + 1);
+  }
+  if (rows == NULL)
+  {
+    report_error("'%s' is damaged or does not fit the table.\n", path);
+    fclose(file);
+    return;
+  }
+
+  uint32_t count = 0;
+  uint8_t *buffer = malloc(DUMP_CHUNK_MAX_SIZE);
+  uint8_t *compressed = malloc(DUMP_CHUNK_MAX_SIZE);
+  bool valid = true;
+  uint32_t chunk_header[DUMP_CHUNK_HEADER_SIZE / sizeof(uint32_t)];
+  while (valid)
+  {
+    size_t header_length = fread(chunk_header, 1, sizeof(chunk_header), file);
+    if (header_length == 0)
+    {
+      // the end of the dump
+      break;
+    }
+    uint32_t chunk_rows = chunk_header[0];
+    uint32_t stored_length = chunk_header[1];
+    uint32_t length = chunk_header[2];
+    valid = header_length == sizeof(chunk_header) && chunk_rows <= DUMP_CHUNK_ROWS &&
+            chunk_rows <= total - count && length <= DUMP_CHUNK_MAX_SIZE && stored_length <= length;
+    if (!valid)
+    {
+      break;
+    }
+
+    bool is_compressed = stored_length < length;
+    valid = fread(is_compressed ? compressed : buffer, 1, stored_length, file) == stored_length;
+    if (valid && is_compressed)
+    {
+      valid = lz4_decompress(compressed, stored_length, buffer, length) == length;
+    }
+    valid = valid && crc32c_checksum(buffer, length) == chunk_header[3];
+    valid = valid && dump_chunk_read(buffer, length, chunk_rows, id_size, rows + count);
+    count += chunk_rows;
+  }
+  valid = valid && count == total && !ferror(file);
+  free(compressed);
+  free(buffer);
+  fclose(file);
+
+  if (!valid)
+  {
+    report_error("'%s' is damaged or does not fit the table.\n", path);
+    free(rows);
+    return;
+  }
+
+  switch (table_bulk_load(table, rows, count, bulk_load_workers()))
+  {
+  case (EXECUTE_SUCCESS):
+    printf("Loaded %u rows.\n", count);
+    break;
+  case (EXECUTE_TABLE_FULL):
+    report_error("Error: Table full.\n");
+    break;
+  case (EXECUTE_DUPLICATE_KEY):
+    report_error("Error: Duplicate key.\n");
+    break;
+  }
+  free(rows);
+}
+
+// Check if the input buffer holds a meta command
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table)
+{
+  if (strcmp(input_buffer->buffer, ".exit") == 0)
+  {
+    db_close(table);
+    print_batch_summary();
+    exit(EXIT_SUCCESS);
+  }
+  else if (strcmp(input_buffer->buffer, ".btree") == 0)
+  {
+    printf("Tree:\n");
+    print_tree(table->pager, table->root_page_num, 0);
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(input_buffer->buffer, ".help") == 0)
+  {
+    printf(".exit: Exits the REPL\n");
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(input_buffer->buffer, ".analyze") == 0)
+  {
+    printf("Analysis:\n");
+    print_analysis(table);
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(input_buffer->buffer, ".defrag") == 0)
+  {
+    uint32_t pages_moved;
+    bool done = table_defrag_step(table, DEFRAG_STEP_PAGES, &pages_moved);
+    printf("Defrag: moved %u pages, %s\n", pages_moved, done ? "done" : "in progress");
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strncmp(input_buffer->buffer, ".backup ", 8) == 0)
+  {
+    // copied between statements by shell_backup_step
+    backup_begin(table, input_buffer->buffer + 8);
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strncmp(input_buffer->buffer, ".import ", 8) == 0)
+  {
+    import_csv(table, input_buffer->buffer + 8);
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strncmp(input_buffer->buffer, ".dump ", 6) == 0)
+  {
+    dump_table(table, input_buffer->buffer + 6);
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strncmp(input_buffer->buffer, ".load ", 6) == 0)
+  {
+    load_dump(table, input_buffer->buffer + 6);
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(input_buffer->buffer, ".stats") == 0)
+  {
+    printf("Stats:\n");
+    print_stats(table);
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(input_buffer->buffer, ".constants") == 0)
+  {
+    printf("Constants:\n");
+    print_constants();
+    return META_COMMAND_SUCCESS;
+  }
+  else
+  {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+}
+
+/*
+Server mode
+
+`dblite -serve <address> <database>` shares one table, and its page
+cache, between many clients. The address is unix:<path> for a Unix
+socket or <host>:<port> for TCP (an empty host listens on every
+interface).
+
+Protocol
+
+Every message is a frame: a 32 bit length, then a type byte and the
+payload; the length counts the type byte and the payload. Numbers are
+little endian.
+
+client -> server
+  PREPARE  0x01  statement text, e.g "insert ? ? ?" or "select"; a ?
+                 is a parameter, numbered from 0 in the order they appear
+  BIND     0x02  u32 statement, u16 count, then count parameters from 0:
+                 u8 1 + i32 for an integer, u8 2 + u16 length + bytes
+                 for text. Bound values stay until they are bound again.
+  EXECUTE  0x03  u32 statement
+  FINALIZE 0x04  u32 statement
+
+server -> client
+  PREPARED 0x81  u32 statement
+  ROWS     0x82  u32 count, then count rows as in -binary output
+  DONE     0x83  u64 rows inserted or returned
+  ERROR    0x84  message text
+
+PREPARE and EXECUTE are answered in order, BIND and FINALIZE only when
+they fail. A select is answered with ROWS messages of up to
+SERVER_BATCH_ROWS rows, then DONE.
+
+Threads
+
+One epoll instance and a pool of worker threads, one per core. Every
+socket is registered with EPOLLONESHOT, so a connection is handled by
+one worker at a time and is re-armed when the worker is done with it.
+Statements run under a readers-writer lock: inserts one at a time,
+selects alongside each other. A select is produced a batch at a time,
+taking the lock for each batch and carrying on from the key after the
+last row sent, so a slow client never holds the lock or makes the
+server buffer the whole table; when SERVER_OUTPUT_LIMIT bytes are
+waiting to be sent, the connection waits for the client to read them.
+
+SIGINT or SIGTERM stops the workers; the table is then closed as on
+.exit.
+*/
+#define SERVER_MESSAGE_PREPARE 0x01
+#define SERVER_MESSAGE_BIND 0x02
+#define SERVER_MESSAGE_EXECUTE 0x03
+#define SERVER_MESSAGE_FINALIZE 0x04
+#define SERVER_MESSAGE_PREPARED 0x81
+#define SERVER_MESSAGE_ROWS 0x82
+#define SERVER_MESSAGE_DONE 0x83
+#define SERVER_MESSAGE_ERROR 0x84
+
+#define SERVER_PARAMETER_INTEGER 1
+#define SERVER_PARAMETER_TEXT 2
+#define SERVER_PARAMETER_INTEGER_64 3
+
+// a client sending a larger frame is disconnected
+#define SERVER_MAX_MESSAGE (1024 * 1024)
+#define SERVER_MAX_STATEMENTS 64
+#define SERVER_BATCH_ROWS 256
+#define SERVER_OUTPUT_LIMIT (256 * 1024)
+#define SERVER_MAX_EVENTS 64
+// how long the listener rests after an accept error that is not EAGAIN
+// and that the spare descriptor does not help with
+#define SERVER_ACCEPT_BACKOFF_MS 10
+
+typedef struct
+{
+  uint8_t *data;
+  size_t length;
+  size_t capacity;
+} ServerBuffer;
+
+// the columns of an insert, in the order of the statement
+typedef enum
+{
+  COLUMN_ID,
+  COLUMN_USERNAME,
+  COLUMN_EMAIL,
+  NUM_COLUMNS
+} Column;
+
+typedef struct
+{
+  bool in_use;
+  StatementType type;
+  Row row;                            // literals and bound values
+  Column parameters[NUM_COLUMNS];     // the column of each parameter
+  uint32_t num_parameters;
+  uint32_t bound;                     // bit i is set once parameter i is bound
+} ServerStatement;
+
+typedef enum
+{
+  CONNECTION_LISTENER,
+  CONNECTION_SIGNAL,
+  CONNECTION_CLIENT
+} ConnectionType;
+
+typedef struct
+{
+  ConnectionType type;
+  int fd;
+  // EPOLLONESHOT keeps a connection to one worker at a time; holding this
+  // while handling it also orders what one worker did before the next
+  pthread_mutex_t lock;
+  ServerBuffer input;
+  ServerBuffer output;
+  size_t output_sent;
+  ServerStatement statements[SERVER_MAX_STATEMENTS];
+  bool hung_up;  // the client will send nothing more
+  bool scanning; // a select is being sent
+  uint64_t scan_next_key;
+  uint64_t scan_rows;
+} Connection;
+
+typedef struct
+{
+  Table *table;
+  int epoll_fd;
+  pthread_rwlock_t lock;
+  pthread_mutex_t stats_lock;
+  bool stopping;
+  DbStats worker_stats;
+  int spare_fd; // given up to refuse a connection when out of descriptors
+} Server;
+
+void server_buffer_append(ServerBuffer *buffer, const void *data, size_t length)
+{
+  if (buffer->length + length > buffer->capacity)
+  {
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + length)
+    {
+      capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, capacity);
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+// start a frame; returns its offset so server_end_message can fill in the length
+size_t server_begin_message(ServerBuffer *buffer, uint8_t type)
+{
+  size_t start = buffer->length;
+  uint32_t length = 0;
+  server_buffer_append(buffer, &length, sizeof(length));
+  server_buffer_append(buffer, &type, sizeof(type));
+  return start;
+}
+
+void server_end_message(ServerBuffer *buffer, size_t start)
+{
+  uint32_t length = buffer->length - start - sizeof(uint32_t);
+  memcpy(buffer->data + start, &length, sizeof(length));
+}
+
+void server_send_error(Connection *connection, const char *format, ...)
+{
+  char message[256];
+  va_list arguments;
+  va_start(arguments, format);
+  int written = vsnprintf(message, sizeof(message), format, arguments);
+  va_end(arguments);
+  // vsnprintf returns the untruncated length, or a negative number on an encoding error
+  size_t length = written < 0 ? 0 : (size_t)written;
+  if (length >= sizeof(message))
+  {
+    length = sizeof(message) - 1;
+  }
+
+  size_t start = server_begin_message(&connection->output, SERVER_MESSAGE_ERROR);
+  server_buffer_append(&connection->output, message, length);
+  server_end_message(&connection->output, start);
+}
+
+void server_send_done(Connection *connection, uint64_t rows)
+{
+  size_t start = server_begin_message(&connection->output, SERVER_MESSAGE_DONE);
+  server_buffer_append(&connection->output, &rows, sizeof(rows));
+  server_end_message(&connection->output, start);
+}
+
+// a row in the -binary frame format, see write_row_binary
+void server_append_row(ServerBuffer *buffer, RowView *row)
+{
+  uint8_t username_length = row->username.length;
+  uint16_t email_length = row->email.length;
+  uint32_t frame_length = ID_SIZE + sizeof(username_length) + username_length +
+                          sizeof(email_length) + email_length;
+
+  server_buffer_append(buffer, &frame_length, sizeof(frame_length));
+  server_buffer_append(buffer, &row->id, ID_SIZE);
+  server_buffer_append(buffer, &username_length, sizeof(username_length));
+  server_buffer_append(buffer, row->username.data, username_length);
+  server_buffer_append(buffer, &email_length, sizeof(email_length));
+  server_buffer_append(buffer, row->email.data, email_length);
+}
+
+// set a column from a literal or a bound text value; false if it does not fit
+bool server_set_column(Row *row, Column column, const char *data, uint32_t length)
+{
+  char *field = (column == COLUMN_USERNAME) ? row->username : row->email;
+  uint32_t size = (column == COLUMN_USERNAME) ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+  if (length > size)
+  {
+    return false;
+  }
+  memcpy(field, data, length);
+  memset(field + length, 0, size + 1 - length);
+  return true;
+}
+
+void server_prepare(Connection *connection, const char *text, uint32_t length)
+{
+  uint32_t statement_num = 0;
+  while (statement_num < SERVER_MAX_STATEMENTS && connection->statements[statement_num].in_use)
+  {
+    statement_num++;
+  }
+  if (statement_num == SERVER_MAX_STATEMENTS)
+  {
+    server_send_error(connection, "Too many prepared statements.");
+    return;
+  }
+
+  ServerStatement statement;
+  memset(&statement, 0, sizeof(statement));
+  const char *position = text;
+  const char *end = text + length;
+  StringView keyword;
+  if (!next_token(&position, end, &keyword))
+  {
+    server_send_error(connection, "Syntax error. Could not parse statement.");
+    return;
+  }
+
+  if (keyword.length == 6 && strncmp(keyword.data, "select", 6) == 0)
+  {
+    statement.type = STATEMENT_SELECT;
+  }
+  else if (keyword.length == 6 && strncmp(keyword.data, "insert", 6) == 0)
+  {
+    statement.type = STATEMENT_INSERT;
+    for (Column column = COLUMN_ID; column < NUM_COLUMNS; column++)
+    {
+      StringView token;
+      if (!next_token(&position, end, &token))
+      {
+        server_send_error(connection, "Syntax error. Could not parse statement.");
+        return;
+      }
+      if (token.length == 1 && token.data[0] == '?')
+      {
+        statement.parameters[statement.num_parameters++] = column;
+      }
+      else if (column == COLUMN_ID)
+      {
+        PrepareResult result = parse_id(token, &statement.row.id);
+        if (result != PREPARE_SUCCESS)
+        {
+          server_send_error(connection, result == PREPARE_NEGATIVE_ID ? "ID must be positive." : "ID is too large.");
+          return;
+        }
+      }
+      else if (!server_set_column(&statement.row, column, token.data, token.length))
+      {
+        server_send_error(connection, "String is too long.");
+        return;
+      }
+    }
+  }
+  else
+  {
+    server_send_error(connection, "Unrecognized keyword at start of '%.*s'.", (int)length, text);
+    return;
+  }
+
+  StringView extra;
+  if (next_token(&position, end, &extra))
+  {
+    server_send_error(connection, "Syntax error. Could not parse statement.");
+    return;
+  }
+
+  statement.in_use = true;
+  connection->statements[statement_num] = statement;
+  size_t start = server_begin_message(&connection->output, SERVER_MESSAGE_PREPARED);
+  server_buffer_append(&connection->output, &statement_num, sizeof(statement_num));
+  server_end_message(&connection->output, start);
+}
+
+ServerStatement *server_find_statement(Connection *connection, const uint8_t *payload, uint32_t length)
+{
+  uint32_t statement_num;
+  if (length < sizeof(statement_num))
+  {
+    return NULL;
+  }
+  memcpy(&statement_num, payload, sizeof(statement_num));
+  if (statement_num >= SERVER_MAX_STATEMENTS || !connection->statements[statement_num].in_use)
+  {
+    return NULL;
+  }
+  return &connection->statements[statement_num];
+}
+
+void server_bind(Connection *connection, const uint8_t *payload, uint32_t length)
+{
+  ServerStatement *statement = server_find_statement(connection, payload, length);
+  if (statement == NULL)
+  {
+    server_send_error(connection, "No such statement.");
+    return;
+  }
+
+  const uint8_t *position = payload + sizeof(uint32_t);
+  const uint8_t *end = payload + length;
+  uint16_t count;
+  if (end - position < (ptrdiff_t)sizeof(count))
+  {
+    server_send_error(connection, "Malformed bind.");
+    return;
+  }
+  memcpy(&count, position, sizeof(count));
+  position += sizeof(count);
+  if (count > statement->num_parameters)
+  {
+    server_send_error(connection, "Too many parameters.");
+    return;
+  }
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    Column column = statement->parameters[i];
+    if (end - position < 1)
+    {
+      server_send_error(connection, "Malformed bind.");
+      return;
+    }
+    uint8_t type = *position++;
+
+    if (column == COLUMN_ID)
+    {
+      // a 4-byte or an 8-byte integer; ids above 2^31 - 1 need 8 bytes
+      int64_t id;
+      if (type == SERVER_PARAMETER_INTEGER && end - position >= (ptrdiff_t)sizeof(int32_t))
+      {
+        int32_t id_32;
+        memcpy(&id_32, position, sizeof(id_32));
+        position += sizeof(id_32);
+        id = id_32;
+      }
+      else if (type == SERVER_PARAMETER_INTEGER_64 && end - position >= (ptrdiff_t)sizeof(id))
+      {
+        memcpy(&id, position, sizeof(id));
+        position += sizeof(id);
+      }
+      else
+      {
+        server_send_error(connection, "Parameter %u must be an integer.", i);
+        return;
+      }
+      if (id < 0)
+      {
+        server_send_error(connection, "ID must be positive.");
+        return;
+      }
+      if ((uint64_t)id > MAX_KEY)
+      {
+        server_send_error(connection, "ID is too large.");
+        return;
+      }
+      statement->row.id = id;
+    }
+    else
+    {
+      uint16_t text_length;
+      if (type != SERVER_PARAMETER_TEXT || end - position < (ptrdiff_t)sizeof(text_length))
+      {
+        server_send_error(connection, "Parameter %u must be text.", i);
+        return;
+      }
+      memcpy(&text_length, position, sizeof(text_length));
+      position += sizeof(text_length);
+      if (end - position < text_length)
+      {
+        server_send_error(connection, "Malformed bind.");
+        return;
+      }
+      if (!server_set_column(&statement->row, column, (const char *)position, text_length))
+      {
+        server_send_error(connection, "String is too long.");
+        return;
+      }
+      position += text_length;
+    }
+    statement->bound |= 1u << i;
+  }
+}
+
+// send the next batch of a select
+void server_scan_batch(Server *server, Connection *connection)
+{
+  ServerBuffer *output = &connection->output;
+  size_t start = server_begin_message(output, SERVER_MESSAGE_ROWS);
+  size_t count_offset = output->length;
+  uint32_t count = 0;
+  server_buffer_append(output, &count, sizeof(count));
+
+  uint64_t last_key = 0;
+  pthread_rwlock_rdlock(&server->lock);
+  ScanCursor cursor;
+  scan_cursor_open(server->table, connection->scan_next_key, MAX_KEY, &cursor);
+  RowView row;
+  while (count < SERVER_BATCH_ROWS && scan_cursor_next(&cursor, &row))
+  {
+    server_append_row(output, &row);
+    last_key = row.id;
+    count++;
+  }
+  bool finished = cursor.cursor.end_of_table || last_key == MAX_KEY;
+  scan_cursor_close(&cursor);
+  pthread_rwlock_unlock(&server->lock);
+
+  if (count == 0)
+  {
+    output->length = start;
+  }
+  else
+  {
+    memcpy(output->data + count_offset, &count, sizeof(count));
+    server_end_message(output, start);
+  }
+
+  connection->scan_rows += count;
+  connection->scan_next_key = last_key + 1;
+  if (finished)
+  {
+    connection->scanning = false;
+    stats.statements[STATEMENT_SELECT]++;
+    server_send_done(connection, connection->scan_rows);
+  }
 }
 
-/**
- *
- */
-void internal_node_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num)
+/*
+The inserts in one batch of a connection's messages run under one hold
+of the write lock, up to SERVER_BATCH_ROWS of them, and share an insert
+group (see Insert groups), so a client that pipelines inserts pays for
+the lock and the descent once per leaf rather than once per row.
+*/
+typedef struct
 {
-  /*
-  Add a new child/key pair to parent that corresponds to child
-  */
+  bool locked;
+  uint32_t inserts;
+  InsertGroup group;
+} ServerWrites;
 
-  void *parent = get_page(table->pager, parent_page_num);
-  void *child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
+void server_end_writes(Server *server, ServerWrites *writes)
+{
+  if (writes->locked)
+  {
+    pthread_rwlock_unlock(&server->lock);
+    writes->locked = false;
+    writes->inserts = 0;
+  }
+}
 
-  // number of keys in the parent before insertion
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
-  // increase the number of keys in the parent node to make space
-  // for the new child key
-  *internal_node_num_keys(parent) = original_num_keys + 1;
+void server_execute(Server *server, Connection *connection, const uint8_t *payload, uint32_t length,
+                    ServerWrites *writes)
+{
+  ServerStatement *statement = server_find_statement(connection, payload, length);
+  if (statement == NULL)
+  {
+    server_send_error(connection, "No such statement.");
+    return;
+  }
 
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS)
+  if (statement->type == STATEMENT_SELECT)
   {
-    // cannot insert in the parent if it has too many keys
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
+    connection->scanning = true;
+    connection->scan_next_key = 0;
+    connection->scan_rows = 0;
+    return;
   }
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void *right_child = get_page(table->pager, right_child_page_num);
+  if (statement->bound != (1u << statement->num_parameters) - 1)
+  {
+    server_send_error(connection, "Not all parameters are bound.");
+    return;
+  }
 
-  /* Replace the right child if the max key is greater */
-  if (child_max_key > get_node_max_key(right_child))
+  Statement insert;
+  insert.type = STATEMENT_INSERT;
+  insert.num_rows = 1;
+  insert.row_to_insert.id = statement->row.id;
+  insert.row_to_insert.username = (StringView){statement->row.username, strlen(statement->row.username)};
+  insert.row_to_insert.email = (StringView){statement->row.email, strlen(statement->row.email)};
+
+  if (writes->inserts == SERVER_BATCH_ROWS)
   {
-    /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
-    // previous right child was place 1 + original_num_keys
-    *internal_node_right_child(parent) = child_page_num;
+    // let the readers waiting for the lock in
+    server_end_writes(server, writes);
   }
-  else
+  if (!writes->locked)
   {
-    /* Make room for the new cell */
-    /* Shift all cells, greater than the new cell, to the right */
-    for (uint32_t i = original_num_keys; i > index; i--)
-    {
-      void *destination = internal_node_cell(parent, i);
-      void *source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-    }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+    pthread_rwlock_wrlock(&server->lock);
+    writes->locked = true;
+  }
+  writes->inserts++;
+  ExecuteResult result = execute_grouped_statement(&insert, server->table, &writes->group);
+
+  switch (result)
+  {
+  case (EXECUTE_SUCCESS):
+    server_send_done(connection, 1);
+    break;
+  case (EXECUTE_TABLE_FULL):
+    server_send_error(connection, "Error: Table full.");
+    break;
+  case (EXECUTE_DUPLICATE_KEY):
+    server_send_error(connection, "Error: Duplicate key.");
+    break;
   }
 }
 
-/**
- * To split the content of the original page between two pages:
- *
- * 1. Create / fetch the new page
- * 2. Find the middle number
- * 3. For each cell in the old page, choose whether to move it to the
- * new_page or keep in the old page, based on its index (key)
- * if the index is more than a middle number, move to new, if lower, leave in old
- * 4. Get the destination cell for each index from 3 above
- * 5. Write the cells to memory:
- * 5.1. if the index is for the cell to be written, write the data to memory
- * 5.2. if the index is for any of the existing cells (from old_node), copy
- * over to the new destination (new_node / old_node)
- */
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value)
+/*
+Handle the complete messages in the input, stopping at a select until it
+has been sent. Returns false if the client sent a frame that is too
+large or of an unknown type.
+*/
+bool server_process(Server *server, Connection *connection)
 {
-  // old_node is the page that's full; new_node is the page we want to split with
-  void *old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void *new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-
-  *node_parent(new_node) = *node_parent(old_node);
-  /**
-   * Update the sibling pointers
-   */
-  // new leaf's sibling is the old leaf's sibling
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  // old leaf's sibling becomes the new leaf itself
-  *leaf_node_next_leaf(old_node) = new_page_num;
+  ServerBuffer *input = &connection->input;
+  size_t consumed = 0;
+  bool valid = true;
+  ServerWrites writes = {false, 0, {false, 0}};
 
-  /*
-    All existing keys plus new key should be divided
-    evenly between old (left) and new (right) nodes.
-    Starting from the right, move each key to correct position.
-  */
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--)
+  while (valid)
   {
-    void *destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT)
+    if (connection->scanning)
     {
-      destination_node = new_node;
+      server_end_writes(server, &writes);
     }
-    else
+    while (connection->scanning && connection->output.length - connection->output_sent < SERVER_OUTPUT_LIMIT)
+    {
+      server_scan_batch(server, connection);
+    }
+    if (connection->scanning)
     {
-      destination_node = old_node;
+      break;
     }
-    // index_within_node determines where to write the cell within either old or new
-    // the values fall between 0 and LEAF_NODE_LEFT_SPLIT_COUNT
-    // For example, for LEAF_NODE_MAX_CELLS of 21, index_within_node = 0 - 11
-    // So if i is 12, it will be written to index 1 of new_node
-    // if i is 1, it will be written to index 1 of old_node
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void *destination = leaf_node_cell(destination_node, index_within_node);
 
-    if (i == cursor->cell_num)
+    uint32_t length;
+    if (input->length - consumed < sizeof(length))
+    {
+      break;
+    }
+    memcpy(&length, input->data + consumed, sizeof(length));
+    if (length == 0 || length > SERVER_MAX_MESSAGE)
     {
-      serialize_row(value, leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
+      valid = false;
+      break;
     }
-    else if (i > cursor->cell_num)
+    if (input->length - consumed < sizeof(length) + length)
     {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+      break;
     }
-    else
+
+    uint8_t type = input->data[consumed + sizeof(length)];
+    const uint8_t *payload = input->data + consumed + sizeof(length) + 1;
+    uint32_t payload_length = length - 1;
+    consumed += sizeof(length) + length;
+
+    switch (type)
+    {
+    case (SERVER_MESSAGE_PREPARE):
+      server_prepare(connection, (const char *)payload, payload_length);
+      break;
+    case (SERVER_MESSAGE_BIND):
+      server_bind(connection, payload, payload_length);
+      break;
+    case (SERVER_MESSAGE_EXECUTE):
+      server_execute(server, connection, payload, payload_length, &writes);
+      break;
+    case (SERVER_MESSAGE_FINALIZE):
     {
-      // if i is the key for a cell that was written before the last, copy to its
-      // new destination
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+      ServerStatement *statement = server_find_statement(connection, payload, payload_length);
+      if (statement == NULL)
+      {
+        server_send_error(connection, "No such statement.");
+      }
+      else
+      {
+        statement->in_use = false;
+      }
+      break;
+    }
+    default:
+      valid = false;
+      break;
     }
   }
 
-  /* Update cell count on both leaf nodes */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  server_end_writes(server, &writes);
 
-  if (is_node_root(old_node))
+  memmove(input->data, input->data + consumed, input->length - consumed);
+  input->length -= consumed;
+  return valid;
+}
+
+// read what the client has sent; false once it has hung up
+bool server_read(Connection *connection)
+{
+  ServerBuffer *input = &connection->input;
+  for (;;)
   {
-    // if the old_node was a root then we need to create a new root after the split
-    // both the old_node and new_node will then be connected to this new root
-    return create_new_root(cursor->table, new_page_num);
+    if (input->capacity - input->length < 4096)
+    {
+      input->capacity = input->capacity ? input->capacity * 2 : 16384;
+      input->data = realloc(input->data, input->capacity);
+    }
+    ssize_t received = read(connection->fd, input->data + input->length, input->capacity - input->length);
+    if (received > 0)
+    {
+      input->length += received;
+      continue;
+    }
+    if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return true;
+    }
+    if (received == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    return false;
   }
-  else
+}
+
+// send as much of the output as the socket takes; false on error
+bool server_write(Connection *connection)
+{
+  ServerBuffer *output = &connection->output;
+  while (connection->output_sent < output->length)
+  {
+    ssize_t sent = send(connection->fd, output->data + connection->output_sent,
+                        output->length - connection->output_sent, MSG_NOSIGNAL);
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return true;
+    }
+    if (sent == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if (sent == -1)
+    {
+      return false;
+    }
+    connection->output_sent += sent;
+  }
+  output->length = 0;
+  connection->output_sent = 0;
+  return true;
+}
+
+void server_close(Server *server, Connection *connection)
+{
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  free(connection->input.data);
+  free(connection->output.data);
+  pthread_mutex_unlock(&connection->lock);
+  pthread_mutex_destroy(&connection->lock);
+  free(connection);
+}
+
+void server_arm(Server *server, Connection *connection, uint32_t events, int operation)
+{
+  struct epoll_event event;
+  event.events = events | EPOLLONESHOT;
+  event.data.ptr = connection;
+  if (epoll_ctl(server->epoll_fd, operation, connection->fd, &event) == -1)
   {
-    printf("Need to implement updating parent after split\n");
+    printf("Error registering socket: %d\n", errno);
     exit(EXIT_FAILURE);
-    /**
-     * 1. get the parent page [DONE]
-     * 2. get the updated max key in the old node [DONE]
-     * 3. update the max key for old node in the internal node
-     * with the updated max key
-     * 4. get the max key of the new node
-     * 5. add the max key of the new node to the internal node
-     *
-     */
-    uint32_t parent_page_num = *node_parent(old_node);
-    void *parent_page = get_page(cursor->table->pager, parent_page_num);
+  }
+}
 
-    uint32_t new_max = get_node_max_key(old_node);
+Connection *server_new_connection(ConnectionType type, int fd)
+{
+  Connection *connection = calloc(1, sizeof(Connection));
+  connection->type = type;
+  connection->fd = fd;
+  pthread_mutex_init(&connection->lock, NULL);
+  return connection;
+}
 
-    update_internal_node_key(parent_page, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+// accept a connection and close it, with the spare descriptor given up
+// meanwhile; false if there was none to accept
+bool server_refuse(Server *server, Connection *listener)
+{
+  close(server->spare_fd);
+  int fd = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd != -1)
+  {
+    close(fd);
   }
+  server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  return fd != -1;
 }
 
 /*
-Inserting a row into the database
-
-The row is inserted as a cell into the leaf node
+Accept every pending connection, then re-arm the listener.
+
+A connection that cannot be accepted stays pending, and epoll reports
+the listener again as soon as it is re-armed, so the workers would spin
+on it. When the process is out of file descriptors the server gives up
+its spare one for as long as it takes to accept the connection and close
+it, which refuses that client. Any other error (e.g. out of kernel
+memory) leaves the listener disarmed for SERVER_ACCEPT_BACKOFF_MS.
+The listener is EPOLLONESHOT, so one worker at a time runs this.
 */
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value)
+void server_accept(Server *server, Connection *listener)
 {
-  // current page
-  void *node = get_page(cursor->table->pager, cursor->page_num);
+  for (;;)
+  {
+    int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1 && (errno == EINTR || errno == ECONNABORTED))
+    {
+      continue;
+    }
+    if (fd == -1 && (errno == EMFILE || errno == ENFILE) && server->spare_fd != -1)
+    {
+      // accept fails like this even when no connection is pending
+      if (server_refuse(server, listener))
+      {
+        continue;
+      }
+      break;
+    }
+    if (fd == -1)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        struct timespec backoff = {0, SERVER_ACCEPT_BACKOFF_MS * 1000000L};
+        nanosleep(&backoff, NULL);
+      }
+      break;
+    }
+    // replies are small; don't hold them back (fails harmlessly on Unix sockets)
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    server_arm(server, server_new_connection(CONNECTION_CLIENT, fd), EPOLLIN, EPOLL_CTL_ADD);
+  }
+  server_arm(server, listener, EPOLLIN, EPOLL_CTL_MOD);
+}
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS)
+void server_handle_client(Server *server, Connection *connection, uint32_t events)
+{
+  pthread_mutex_lock(&connection->lock);
+  // a client that is done sending may still read the answers to what it sent
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !server_read(connection))
   {
-    // Node full so we split
-    leaf_node_split_and_insert(cursor, key, value);
+    connection->hung_up = true;
+  }
+
+  bool healthy = server_process(server, connection) && server_write(connection);
+  while (healthy && connection->scanning && connection->output.length == 0)
+  {
+    healthy = server_process(server, connection) && server_write(connection);
+  }
+
+  bool answered = connection->output.length == 0 && !connection->scanning;
+  if (!healthy || (connection->hung_up && answered))
+  {
+    server_close(server, connection);
     return;
   }
+  server_arm(server, connection, connection->output.length > 0 ? EPOLLOUT : EPOLLIN, EPOLL_CTL_MOD);
+  pthread_mutex_unlock(&connection->lock);
+}
 
-  if (cursor->cell_num < num_cells)
+void *server_worker(void *argument)
+{
+  Server *server = argument;
+  struct epoll_event events[SERVER_MAX_EVENTS];
+
+  while (!__atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE))
   {
-    // Make room for new cell
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--)
+    int num_events = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, -1);
+    for (int i = 0; i < num_events; i++)
     {
-      // e.g copy content from [2] to [3]
-      // if cell num is 1, copy from [1] to [2] then stop (last copy)
-      // new content will be written at [1]
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+      Connection *connection = events[i].data.ptr;
+      switch (connection->type)
+      {
+      case (CONNECTION_SIGNAL):
+        // left unread, so every worker sees it
+        __atomic_store_n(&server->stopping, true, __ATOMIC_RELEASE);
+        break;
+      case (CONNECTION_LISTENER):
+        server_accept(server, connection);
+        break;
+      case (CONNECTION_CLIENT):
+        server_handle_client(server, connection, events[i].events);
+        break;
+      }
     }
   }
 
-  // increase the number of cells in the page (node)
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+  pthread_mutex_lock(&server->stats_lock);
+  stats_add(&server->worker_stats, &stats);
+  pthread_mutex_unlock(&server->stats_lock);
+  return NULL;
 }
 
-ExecuteResult execute_insert(Statement *statement, Table *table)
+int server_listen(const char *address)
 {
-  void *node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = (*leaf_node_num_cells(node));
-
-  Row *row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  // insert data into a place in the table
-  Cursor *cursor = table_find(table, key_to_insert);
+  int fd = -1;
+  if (strncmp(address, "unix:", 5) == 0)
+  {
+    struct sockaddr_un socket_address;
+    memset(&socket_address, 0, sizeof(socket_address));
+    socket_address.sun_family = AF_UNIX;
+    if (strlen(address + 5) >= sizeof(socket_address.sun_path))
+    {
+      printf("Socket path is too long.\n");
+      exit(EXIT_FAILURE);
+    }
+    strcpy(socket_address.sun_path, address + 5);
+    // a socket left behind by an earlier server
+    unlink(socket_address.sun_path);
 
-  // if the current cell, pointed by the cursor, is not
-  // at the end of the table
-  if (cursor->cell_num < num_cells)
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&socket_address, sizeof(socket_address)) == -1)
+    {
+      printf("Unable to listen on %s: %d\n", address, errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else
   {
-    // get the key of the current cell
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert)
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL)
     {
-      return EXECUTE_DUPLICATE_KEY;
+      printf("Address must be unix:<path> or <host>:<port>.\n");
+      exit(EXIT_FAILURE);
+    }
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *addresses;
+    if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &addresses) != 0)
+    {
+      printf("Unable to resolve %s\n", address);
+      exit(EXIT_FAILURE);
+    }
+    for (struct addrinfo *candidate = addresses; candidate != NULL; candidate = candidate->ai_next)
+    {
+      fd = socket(candidate->ai_family, candidate->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  candidate->ai_protocol);
+      if (fd == -1)
+      {
+        continue;
+      }
+      int enable = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+      if (bind(fd, candidate->ai_addr, candidate->ai_addrlen) == 0)
+      {
+        break;
+      }
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd == -1)
+    {
+      printf("Unable to listen on %s: %d\n", address, errno);
+      exit(EXIT_FAILURE);
     }
   }
 
-  // insert the row's id as the key to the cell
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-
-  free(cursor);
-
-  return EXIT_SUCCESS;
+  if (listen(fd, SOMAXCONN) == -1)
+  {
+    printf("Unable to listen on %s: %d\n", address, errno);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
 }
 
-ExecuteResult execute_select(Statement *statement, Table *table)
+// serve the table until SIGINT or SIGTERM
+void serve(Table *table, const char *address)
 {
-  Cursor *cursor = table_start(table);
+  Server server;
+  server.table = table;
+  server.stopping = false;
+  memset(&server.worker_stats, 0, sizeof(server.worker_stats));
+  pthread_rwlock_init(&server.lock, NULL);
+  pthread_mutex_init(&server.stats_lock, NULL);
+  server.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  // the signals are taken from a signalfd; the threads inherit the mask
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  Connection *listener = server_new_connection(CONNECTION_LISTENER, server_listen(address));
+  server_arm(&server, listener, EPOLLIN, EPOLL_CTL_ADD);
+
+  Connection *signal_source = server_new_connection(CONNECTION_SIGNAL, signalfd(-1, &signals, SFD_CLOEXEC));
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = signal_source;
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, signal_source->fd, &event);
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t num_workers = cores > 0 ? cores : 1;
+  if (num_workers > SCAN_MAX_WORKERS)
+  {
+    num_workers = SCAN_MAX_WORKERS;
+  }
+
+  printf("Listening on %s\n", address);
+  fflush(stdout);
+
+  pthread_t threads[SCAN_MAX_WORKERS];
+  for (uint32_t i = 0; i < num_workers; i++)
+  {
+    if (pthread_create(&threads[i], NULL, server_worker, &server) != 0)
+    {
+      printf("Unable to start server worker.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (uint32_t i = 0; i < num_workers; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  stats_add(&stats, &server.worker_stats);
 
-  Row row;
-  while (!(cursor->end_of_table))
+  // connections still open are dropped with the process
+  close(listener->fd);
+  close(signal_source->fd);
+  close(server.epoll_fd);
+  if (server.spare_fd != -1)
+  {
+    close(server.spare_fd);
+  }
+  if (strncmp(address, "unix:", 5) == 0)
   {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+    unlink(address + 5);
   }
+  free(listener);
+  free(signal_source);
+}
 
-  free(cursor);
+/*
+Running statements
 
-  return EXECUTE_SUCCESS;
+The shell's side of a statement: report why it could not be prepared,
+or execute it and report the result.
+*/
+void report_prepare_error(PrepareResult result, const char *line)
+{
+  switch (result)
+  {
+  case (PREPARE_SUCCESS):
+    break;
+  case (PREPARE_NEGATIVE_ID):
+    report_error("ID must be positive.\n");
+    break;
+  case (PREPARE_ID_TOO_LARGE):
+    report_error("ID is too large.\n");
+    break;
+  case (PREPARE_STRING_TOO_LONG):
+    report_error("String is too long.\n");
+    break;
+  case (PREPARE_SYNTAX_ERROR):
+    report_error("Syntax error. Could not parse statement.\n");
+    break;
+  case (PREPARE_UNRECOGNIZED_STATEMENT):
+    report_error("Unrecognized keyword at start of '%s'.\n", line);
+    break;
+  }
 }
 
-ExecuteResult execute_statement(Statement *statement, Table *table)
+void run_statement(Statement *statement, Table *table, InsertGroup *group)
 {
-  switch (statement->type)
+  shell.statements++;
+  switch (execute_grouped_statement(statement, table, group))
   {
-  case (STATEMENT_INSERT):
-    return execute_insert(statement, table);
-    break;
-  case (STATEMENT_SELECT):
-    return execute_select(statement, table);
+  case (EXECUTE_SUCCESS):
+    if (!shell.batch)
+    {
+      printf("Executed.\n");
+    }
     break;
-  case (STATEMENT_UPDATE):
-    return EXECUTE_SUCCESS;
-  case (STATEMENT_DELETE):
-    return EXECUTE_SUCCESS;
+  case (EXECUTE_TABLE_FULL):
+    report_error("Error: Table full.\n");
     break;
+  case (EXECUTE_DUPLICATE_KEY):
+    report_error("Error: Duplicate key.\n");
   default:
-    return EXECUTE_SUCCESS;
+    break;
   }
 }
 
 /*
-The pager communicates directly with memory
-and sends the data to the table
-
-O_RDWR -> Open for reading and writing.
-O_CREAT -> Create file if it does not exist.
-S_IWUSR -> User write permission bit macro (owner permission)
-S_IRUSR -> User read permission bit macro (owner permission)
+A backup started with .backup is copied a step at a time between
+statements and reported once it is done; whatever is left when the
+database is closed is finished by db_close.
 */
-Pager *pager_open(const char *filename)
+void shell_backup_step(Table *table)
 {
-  // open a file for reading or writing O_RDWR
-  // if it doesn't exist, create it O_CREAT
-  // allow reading S_IRUSR and writing S_IWUSR permissions
-  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-
-  if (fd == -1)
-  {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
-  }
-
-  // Move the read/write file offset to the beginning of the DB file
-  off_t file_length = lseek(fd, 0, SEEK_END);
-
-  Pager *pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length; // size of the db file
-  pager->num_pages = (file_length / PAGE_SIZE);
-
-  // DB file must have an exact number of pages
-  if (file_length % PAGE_SIZE != 0)
+  Backup *backup = table->backup;
+  if (backup == NULL || !backup_step(backup, BACKUP_STEP_PAGES))
   {
-    printf("Db file is not a whole number of pages. Corrupt file.\n");
-    exit(EXIT_FAILURE);
+    return;
   }
+  char *path = strdup(backup->path);
+  uint32_t pages = backup_finish(table, backup);
+  printf("Backup: copied %u pages to %s\n", pages, path);
+  free(path);
+}
 
-  // initialize pages in the pager
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+void run_meta_command(InputBuffer *input_buffer, Table *table)
+{
+  if (do_meta_command(input_buffer, table) == META_COMMAND_UNRECOGNIZED_COMMAND)
   {
-    pager->pages[i] = NULL;
+    report_error("Unrecognized command '%s'\n", input_buffer->buffer);
   }
-
-  return pager;
 }
 
 /*
-db_open():
-
-1. Opens a database file
-2. Initializing a pager data structure
-3. Initializing a table data structure
+Pipelined batch mode
+
+In batch mode the input is read and parsed on its own thread while the
+main thread executes what was parsed before, and the output is written
+by the output writer: reading, executing and writing overlap. The parser
+fills batches of up to PIPELINE_BATCH_LINES lines (or
+PIPELINE_BATCH_BYTES of text), copying the lines out of the input
+buffer, and stays at most PIPELINE_DEPTH batches ahead. Statements are
+prepared on the parser thread and meta commands are left for the main
+thread, which runs everything in input order, so results and errors are
+the same as running the lines one by one. The main thread runs inserts
+through one insert group, so a run of inserts into the same leaf
+descends the tree once.
+
+When the main thread has run everything parsed so far it flushes the
+output before waiting for more, so a program that writes a statement
+and waits for its results gets them.
+*/
+#define PIPELINE_BATCH_LINES 1024
+#define PIPELINE_BATCH_BYTES (256 * 1024)
+#define PIPELINE_DEPTH 2
 
-The pager is the go between the memory and the table
+typedef struct
+{
+  uint64_t line_number;
+  size_t offset; // of the line in the batch's text
+  uint32_t length;
+  bool meta;
+  PrepareResult result;
+  Statement statement; // strings point into the batch's text
+} PipelineLine;
 
-filename -> The file name for the DB
-*/
-Table *db_open(const char *filename)
+typedef struct
 {
-  Pager *pager = pager_open(filename);
+  PipelineLine lines[PIPELINE_BATCH_LINES];
+  uint32_t num_lines;
+  char *text; // the lines, each NUL terminated
+  size_t text_length;
+  size_t text_capacity;
+  bool end_of_input; // no batch follows this one
+} PipelineBatch;
 
-  Table *table = malloc(sizeof(Table)); // (size_t)808UL (unsigned long)
-  table->pager = pager;
-  // the root page is indexed 0 (first) when the db is first opened
-  table->root_page_num = 0;
+typedef struct
+{
+  InputBuffer *input_buffer;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  PipelineBatch batches[PIPELINE_DEPTH];
+  uint32_t first;  // the batch being run or next to be
+  uint32_t parsed; // batches ready to run, from first
+} Pipeline;
+
+// read and prepare the next lines of input into a batch
+void pipeline_fill_batch(Pipeline *pipeline, PipelineBatch *batch, uint64_t *line_number)
+{
+  InputBuffer *input_buffer = pipeline->input_buffer;
+  batch->num_lines = 0;
+  batch->text_length = 0;
+  batch->end_of_input = false;
 
-  if (pager->num_pages == 0)
+  while (batch->num_lines < PIPELINE_BATCH_LINES && batch->text_length < PIPELINE_BATCH_BYTES)
   {
-    // New database file. Initialize page 0 as leaf node
-    void *root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    // The first node in the table is the root
-    set_node_root(root_node, true);
-  }
+    // hand over what we have rather than wait for more input
+    if (batch->num_lines > 0 && !input_line_buffered(input_buffer))
+    {
+      break;
+    }
+    if (!read_input(input_buffer))
+    {
+      batch->end_of_input = true;
+      break;
+    }
+    (*line_number)++;
 
-  return table;
-}
+    // blank lines are skipped in scripts
+    if (input_buffer->input_length == 0)
+    {
+      continue;
+    }
 
-// print indentation in output
-void indent(uint32_t level)
-{
-  for (uint32_t i = 0; i < level; i++)
+    size_t length = input_buffer->input_length;
+    if (batch->text_length + length + 1 > batch->text_capacity)
+    {
+      batch->text_capacity = (batch->text_length + length + 1) * 2;
+      batch->text = realloc(batch->text, batch->text_capacity);
+    }
+    PipelineLine *line = &batch->lines[batch->num_lines++];
+    line->line_number = *line_number;
+    line->offset = batch->text_length;
+    line->length = length;
+    memcpy(batch->text + batch->text_length, input_buffer->buffer, length + 1);
+    batch->text_length += length + 1;
+  }
+
+  // the text no longer moves; point the statements into it
+  for (uint32_t i = 0; i < batch->num_lines; i++)
   {
-    printf("  ");
+    PipelineLine *line = &batch->lines[i];
+    InputBuffer view = {0};
+    view.buffer = batch->text + line->offset;
+    view.input_length = line->length;
+
+    // if the input begins with ".", it is a meta command (.help, .exit e.t.c)
+    line->meta = (view.buffer[0] == '.');
+    if (!line->meta)
+    {
+      line->result = prepare_statement(&view, &line->statement);
+    }
   }
 }
 
-/**
- * Recursive method to print tree
- *
- * 1. Start at root of tree (may be root of entire db or a specific internal node)
- * 2. If leaf, print size of leaf. Print each key contained in leaf at a higher indentation
- * level.
- * 3. If internal, print size of internal node. For each child, run print_tree on child
- * at a higher indentation level.
- * 4. If internal, finally, run print_tree on right child.
- */
-void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level)
+void *pipeline_parser(void *argument)
 {
-  void *node = get_page(pager, page_num);
-  uint32_t num_keys, child;
+  Pipeline *pipeline = argument;
+  uint64_t line_number = 0;
 
-  switch (get_node_type(node))
+  for (;;)
   {
-  case (NODE_LEAF):
-    num_keys = *leaf_node_num_cells(node);
-    indent(indentation_level);
-    printf("- leaf (size %d)\n", num_keys);
-    for (uint32_t i = 0; i < num_keys; i++)
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->parsed == PIPELINE_DEPTH)
     {
-      indent(indentation_level + 1);
-      printf("- %d\n", *leaf_node_key(node, i));
+      pthread_cond_wait(&pipeline->changed, &pipeline->lock);
     }
-    break;
+    PipelineBatch *batch = &pipeline->batches[(pipeline->first + pipeline->parsed) % PIPELINE_DEPTH];
+    pthread_mutex_unlock(&pipeline->lock);
 
-  case (NODE_INTERNAL):
-    num_keys = *internal_node_num_keys(node);
-    indent(indentation_level);
-    printf("- internal (size %d)\n", num_keys);
-    for (uint32_t i = 0; i < num_keys; i++)
-    {
-      child = *internal_node_child(node, i);
-      print_tree(pager, child, indentation_level + 1);
+    pipeline_fill_batch(pipeline, batch, &line_number);
 
-      indent(indentation_level + 1);
-      printf("- key %d\n", *internal_node_key(node, i));
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->parsed++;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (batch->end_of_input)
+    {
+      return NULL;
     }
-    child = *internal_node_right_child(node);
-    print_tree(pager, child, indentation_level + 1);
-    break;
   }
 }
 
-// Check if the input buffer holds a meta command
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table)
+// run the statements of a batch in order
+void pipeline_run_batch(PipelineBatch *batch, Table *table, InsertGroup *group)
 {
-  if (strcmp(input_buffer->buffer, ".exit") == 0)
-  {
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  }
-  else if (strcmp(input_buffer->buffer, ".btree") == 0)
+  for (uint32_t i = 0; i < batch->num_lines; i++)
   {
-    printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
-    return META_COMMAND_SUCCESS;
+    PipelineLine *line = &batch->lines[i];
+    shell.line_number = line->line_number;
+    char *text = batch->text + line->offset;
+
+    if (line->meta)
+    {
+      InputBuffer view = {0};
+      view.buffer = text;
+      view.input_length = line->length;
+      run_meta_command(&view, table);
+    }
+    else if (line->result != PREPARE_SUCCESS)
+    {
+      report_prepare_error(line->result, text);
+    }
+    else
+    {
+      run_statement(&line->statement, table, group);
+    }
+    shell_backup_step(table);
   }
-  else if (strcmp(input_buffer->buffer, ".help") == 0)
+}
+
+// run the input in batch mode until it ends (or .exit)
+void run_pipeline(Table *table, InputBuffer *input_buffer)
+{
+  Pipeline *pipeline = calloc(1, sizeof(Pipeline));
+  pipeline->input_buffer = input_buffer;
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->changed, NULL);
+
+  pthread_t parser;
+  if (pthread_create(&parser, NULL, pipeline_parser, pipeline) != 0)
   {
-    printf(".exit: Exits the REPL\n");
-    return META_COMMAND_SUCCESS;
+    printf("Unable to start the parser thread\n");
+    exit(EXIT_FAILURE);
   }
-  else if (strcmp(input_buffer->buffer, ".constants") == 0)
+
+  InsertGroup group = {false, 0};
+  bool end_of_input = false;
+  while (!end_of_input)
   {
-    printf("Constants:\n");
-    print_constants();
-    return META_COMMAND_SUCCESS;
+    pthread_mutex_lock(&pipeline->lock);
+    if (pipeline->parsed == 0)
+    {
+      pthread_mutex_unlock(&pipeline->lock);
+      fflush(stdout);
+      pthread_mutex_lock(&pipeline->lock);
+    }
+    while (pipeline->parsed == 0)
+    {
+      pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+    PipelineBatch *batch = &pipeline->batches[pipeline->first];
+    pthread_mutex_unlock(&pipeline->lock);
+
+    pipeline_run_batch(batch, table, &group);
+    end_of_input = batch->end_of_input;
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->first = (pipeline->first + 1) % PIPELINE_DEPTH;
+    pipeline->parsed--;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
   }
-  else
+
+  pthread_join(parser, NULL);
+  for (uint32_t i = 0; i < PIPELINE_DEPTH; i++)
   {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+    free(pipeline->batches[i].text);
   }
+  pthread_cond_destroy(&pipeline->changed);
+  pthread_mutex_destroy(&pipeline->lock);
+  free(pipeline);
+}
+
+#ifndef DBLITE_NO_MAIN
+/*
+Programs that drive the engine directly (e.g bench/bench.c) include this
+file with DBLITE_NO_MAIN defined and provide their own main.
+*/
+void print_usage()
+{
+  printf("Usage: dblite [-batch] [-f script] [-csv | -binary] [-pagesize bytes] [-keysize 4|8] [-compress] [-threads n] [-serve address] <database>\n");
 }
 
 // main function will have an infinite loop that prints the prompt,
 // gets a line of input, then processes that line of input:
+//
+// -batch      read statements from stdin without a prompt
+// -f script   read statements from a file (implies -batch)
+// -csv        in batch mode, write rows as CSV (the default)
+// -binary     in batch mode, write rows as length-prefixed frames
+// -pagesize n the page size of a new database, 4096 to 65536
+// -keysize n  the key (id) size of a new database, 4 or 8 bytes
+// -compress   compress the pages written in this session
+// -threads n  scan the table on n threads for select
+// -serve address  serve the table over a socket instead (see Server mode)
 int main(int argc, char *argv[])
 {
-  if (argc < 2)
+  char *filename = NULL;
+  int input_descriptor = STDIN_FILENO;
+  bool binary_output = false;
+  uint32_t page_size = DEFAULT_PAGE_SIZE;
+  uint32_t key_size = DEFAULT_KEY_SIZE;
+  bool compress = false;
+  const char *serve_address = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-batch") == 0)
+    {
+      shell.batch = true;
+    }
+    else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+    {
+      shell.batch = true;
+      input_descriptor = open(argv[++i], O_RDONLY);
+      if (input_descriptor == -1)
+      {
+        printf("Unable to open script '%s'\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-csv") == 0)
+    {
+      binary_output = false;
+    }
+    else if (strcmp(argv[i], "-binary") == 0)
+    {
+      binary_output = true;
+    }
+    else if (strcmp(argv[i], "-pagesize") == 0 && i + 1 < argc)
+    {
+      page_size = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-keysize") == 0 && i + 1 < argc)
+    {
+      key_size = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-compress") == 0)
+    {
+      compress = true;
+    }
+    else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+    {
+      shell.threads = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-serve") == 0 && i + 1 < argc)
+    {
+      serve_address = argv[++i];
+    }
+    else if (argv[i][0] == '-')
+    {
+      print_usage();
+      exit(EXIT_FAILURE);
+    }
+    else
+    {
+      filename = argv[i];
+    }
+  }
+
+  if (filename == NULL)
   {
     printf("Must supply a database filename.\n");
     exit(EXIT_FAILURE);
   }
 
-  char *filename = argv[1];
-  Table *table = db_open(filename);
+  if (shell.batch)
+  {
+    shell.output_mode = binary_output ? OUTPUT_BINARY : OUTPUT_CSV;
+    // results are written in large blocks rather than line by line,
+    // on their own thread
+    output_writer_start();
+    clock_gettime(CLOCK_MONOTONIC, &shell.started);
+  }
+
+  Table *table = db_open(filename, page_size, key_size);
+  table->pager->compress = compress;
 
-  InputBuffer *input_buffer = new_input_buffer(); // initialize input buffer
+  if (serve_address != NULL)
+  {
+    serve(table, serve_address);
+    db_close(table);
+    exit(EXIT_SUCCESS);
+  }
+
+  InputBuffer *input_buffer = new_input_buffer(input_descriptor); // initialize input buffer
+  if (shell.batch)
+  {
+    run_pipeline(table, input_buffer);
+    // the end of a script is an implicit .exit
+    db_close(table);
+    close_input_buffer(input_buffer);
+    print_batch_summary();
+    exit(EXIT_SUCCESS);
+  }
+
+  InsertGroup group = {false, 0};
   for (;;)
   {
+    // a backup in progress takes a step after each statement, and more while the user is idle
+    shell_backup_step(table);
+    while (table->backup != NULL && !input_waiting(input_buffer))
+    {
+      shell_backup_step(table);
+    }
     print_prompt();
-    read_input(input_buffer); // input_buffer is passed by reference
+
+    // input_buffer is passed by reference
+    if (!read_input(input_buffer))
+    {
+      printf("Error reading input\n");
+      exit(EXIT_FAILURE);
+    }
+    shell.line_number++;
 
     // if the input begins with ".", we process it as a meta command (.help, .exit e.t.c)
     if (input_buffer->buffer[0] == '.')
     {
-      switch (do_meta_command(input_buffer, table))
-      {
-      case (META_COMMAND_SUCCESS):
-        // request input again
-        continue;
-      case (META_COMMAND_UNRECOGNIZED_COMMAND):
-        printf("Unrecognized command '%s'\n", input_buffer->buffer);
-        // request input again
-        continue;
-      }
+      run_meta_command(input_buffer, table);
+      // request input again
+      continue;
     }
 
     // if the input does not begin with ".", we process is as a statement
     Statement statement;
-    switch (prepare_statement(input_buffer, &statement))
+    PrepareResult result = prepare_statement(input_buffer, &statement);
+    if (result != PREPARE_SUCCESS)
     {
-    case (PREPARE_SUCCESS):
-      break;
-    case (PREPARE_NEGATIVE_ID):
-      printf("ID must be positive.\n");
-      continue;
-    case (PREPARE_STRING_TOO_LONG):
-      printf("String is too long.\n");
-      continue;
-    case (PREPARE_SYNTAX_ERROR):
-      printf("Syntax error. Could not parse statement.\n");
-      continue;
-    case (PREPARE_UNRECOGNIZED_STATEMENT):
-      printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
+      report_prepare_error(result, input_buffer->buffer);
       // request input again
       continue;
     }
 
-    switch (execute_statement(&statement, table))
-    {
-    case (EXECUTE_SUCCESS):
-      printf("Executed.\n");
-      break;
-    case (EXECUTE_TABLE_FULL):
-      printf("Error: Table full.\n");
-      break;
-    case (EXECUTE_DUPLICATE_KEY):
-      printf("Error: Duplicate key.\n");
-    default:
-      break;
-    }
+    run_statement(&statement, table, &group);
   }
 }
+#endif
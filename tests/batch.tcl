@@ -0,0 +1,100 @@
+puts "spec: BATCH MODE"
+
+# This file implements batch mode tests for DBLite library.
+set workingDir [pwd]
+set dbliteFileName "$workingDir/.bin/dblite"
+
+# Check if file is executable
+set isExecutable [file executable $dbliteFileName]
+if {!$isExecutable} {
+  puts "error"
+}
+
+# Get directory of the test database file
+set dbFile "test.db"
+set dbFileDirectory "$workingDir/$dbFile"
+set scriptFile "test.sql"
+set scriptFileDirectory "$workingDir/$scriptFile"
+
+proc testOutput {description expected actual} {
+  set TEST_FAIL_COLOR "\033\[37;41m"
+  set TEST_PASS_COLOR "\033\[37;42m"
+  set TEST_FAIL_DESC_COLOR "\033\[1;31m"
+  set TEST_PASS_DESC_COLOR "\033\[1;32m"
+  set RESET_COLOR "\033\[0m"
+
+  if {[string compare $actual $expected] != 0} {
+    puts "$TEST_FAIL_COLOR FAIL:$RESET_COLOR $description"
+    puts "Description:\n  $description"
+    puts "Expected result:\n  $TEST_PASS_DESC_COLOR $expected $RESET_COLOR"
+    puts "Received result:\n  $TEST_FAIL_DESC_COLOR $actual $RESET_COLOR"
+  } else {
+    puts "$TEST_PASS_COLOR PASS:$RESET_COLOR $description"
+  }
+}
+
+# Batch mode writes rows as CSV without prompts
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set batchCsvDesc "writes rows as CSV without a prompt in batch mode"
+set batchCsvExpected "1,foo,a@b.c
+2,\"b,r\",d@e.f"
+set batchCsvResult [
+  exec -ignorestderr $dbliteFileName -batch $dbFile << "insert 2 b,r d@e.f\ninsert 1 foo a@b.c\nselect\n"
+]
+
+puts [testOutput $batchCsvDesc $batchCsvExpected $batchCsvResult]
+
+# Errors and the summary go to stderr
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set batchSummaryDesc "reports errors with line numbers and prints a summary"
+set batchSummaryExpected "Line 2: Error: Duplicate key.
+1,foo,a@b.c
+Summary: 3 statements, 1 errors, 1 rows"
+set batchSummaryResult [
+  exec $dbliteFileName -batch $dbFile << "insert 1 foo a@b.c\ninsert 1 bar d@e.f\nselect\n" 2>@1
+]
+regsub {, [0-9.]+ s$} $batchSummaryResult "" batchSummaryResult
+
+puts [testOutput $batchSummaryDesc $batchSummaryExpected $batchSummaryResult]
+
+# Statements can be read from a script file
+
+set scriptFileHandle [open $scriptFileDirectory w]
+puts $scriptFileHandle "insert 3 baz g@h.i\n\nselect"
+close $scriptFileHandle
+
+set batchScriptDesc "runs a script file given with -f"
+set batchScriptExpected "1,foo,a@b.c
+3,baz,g@h.i"
+set batchScriptResult [exec -ignorestderr $dbliteFileName -f $scriptFile $dbFile]
+
+puts [testOutput $batchScriptDesc $batchScriptExpected $batchScriptResult]
+
+file delete $scriptFileDirectory
+
+# Results are written before batch mode waits for more input
+
+set batchWaitDesc "writes the results of the statements read so far before waiting for input"
+set batchWaitExpected "1,foo,a@b.c
+3,baz,g@h.i
+4,qux,j@k.l"
+set batch [open "|$dbliteFileName -batch $dbFile 2>@stderr" r+]
+puts $batch "insert 4 qux j@k.l\nselect"
+flush $batch
+set batchWaitLines {}
+for {set i 0} {$i < 3} {incr i} {
+  lappend batchWaitLines [gets $batch]
+}
+# the end of input ends the run
+close $batch write
+read $batch
+close $batch
+set batchWaitResult [join $batchWaitLines "\n"]
+
+puts [testOutput $batchWaitDesc $batchWaitExpected $batchWaitResult]
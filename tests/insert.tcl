@@ -14,6 +14,8 @@ if {!$isExecutable} {
 set dbFile "test.db"
 set dbFileDirectory "$workingDir/$dbFile"
 
+source [file join [file dirname [info script]] lib small_internal_nodes.tcl]
+
 proc testOutput {description expected actual} {
   set TEST_FAIL_COLOR "\033\[37;41m"
   set TEST_PASS_COLOR "\033\[37;42m"
@@ -110,6 +112,24 @@ set negativeIdInsertResult [exec $dbliteFileName $dbFile << "insert $negativeIns
 
 puts [testOutput $negativeInsertDesc $negativeInsertExpected $negativeIdInsertResult]
 
+# the most negative ids of each key size, and one past them, are rejected
+# without being negated
+file delete $dbFileDirectory
+
+set baseCommand ""
+foreach negativeId {-2147483648 -2147483649 -9223372036854775808 -18446744073709551616} {
+  append baseCommand "insert $negativeId foo foo@bar.com\n"
+}
+set mostNegativeDesc "prints an error message for the most negative ids"
+set mostNegativeExpected "Line 1: ID must be positive.
+Line 2: ID must be positive.
+Line 3: ID must be positive.
+Line 4: ID must be positive."
+set mostNegativeResult [exec $dbliteFileName -batch $dbFile << "${baseCommand}select\n" 2>@1]
+regsub {\nSummary: .*$} $mostNegativeResult "" mostNegativeResult
+
+puts [testOutput $mostNegativeDesc $mostNegativeExpected $mostNegativeResult]
+
 # Print error if duplicate index
 
 # Remove the test database
@@ -126,6 +146,99 @@ set duplicateIdInsertResult [exec $dbliteFileName $dbFile << "insert 1 foo a@b.c
 
 puts [testOutput $duplicateIdInsertDesc $duplicateIdInsertExpected $duplicateIdInsertResult]
 
+# Multi-row insert test
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set multiRowInsertDesc "inserts several rows in one statement and skips duplicate ids"
+set multiRowInsertExpected "db > Executed.
+db > Error: Duplicate key.
+db > (2, b, b@x)
+(5, e, e@x)
+(7, g, g@x)
+(9, i, i@x)
+Executed.
+db > Syntax error. Could not parse statement.
+db > "
+
+set multiRowInsertResult [exec $dbliteFileName $dbFile << "insert 5 e e@x 2 b b@x 9 i i@x\ninsert 7 g g@x 2 z z@x\nselect\ninsert 1 a\n.exit\n"]
+
+puts [testOutput $multiRowInsertDesc $multiRowInsertExpected $multiRowInsertResult]
+
+# Multi-row insert that splits leaves
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set baseCommand "insert"
+for { set a 60} {$a >= 1} {incr a -1} {
+  append baseCommand " $a user$a a$a@b.com"
+}
+append baseCommand "\nselect\n"
+
+set multiRowSplitDesc "prints all rows after a multi-row insert splits the leaves"
+set multiRowSplitExpected ""
+for { set a 1} {$a <= 60} {incr a} {
+  append multiRowSplitExpected "$a,user$a,a$a@b.com\n"
+}
+set multiRowSplitExpected [string trimright $multiRowSplitExpected "\n"]
+
+set multiRowSplitResult [exec -ignorestderr $dbliteFileName -batch $dbFile << $baseCommand]
+
+puts [testOutput $multiRowSplitDesc $multiRowSplitExpected $multiRowSplitResult]
+
+# Multi-row inserts that split internal nodes
+
+# Remove the test database
+file delete $dbFileDirectory
+
+createSmallInternalNodeDb $dbFileDirectory
+
+# 20 statements of 26 new ids in no particular order, each repeating two earlier ids
+set baseCommand ""
+set insertedIds {}
+for { set b 0} {$b < 20} {incr b} {
+  set batchIds {}
+  for { set a [expr {$b * 26 + 1}]} {$a <= [expr {$b * 26 + 26}]} {incr a} {
+    lappend batchIds [expr {$a * 7919 % 100003}]
+  }
+  if {$b > 0} {
+    lappend batchIds [lindex $insertedIds [expr {$b * 13}]] [lindex $insertedIds end]
+  }
+  set insertedIds [concat $insertedIds [lrange $batchIds 0 25]]
+  append baseCommand "insert"
+  foreach id $batchIds {
+    append baseCommand " $id user$id a$id@b.com"
+  }
+  append baseCommand "\n"
+}
+append baseCommand "select\n"
+
+set multiRowInternalSplitDesc "prints all rows in order after multi-row inserts split internal nodes"
+set multiRowInternalSplitExpected ""
+foreach id [lsort -integer $insertedIds] {
+  append multiRowInternalSplitExpected "$id,user$id,a$id@b.com\n"
+}
+set multiRowInternalSplitExpected [string trimright $multiRowInternalSplitExpected "\n"]
+
+set multiRowInternalSplitResult [exec -ignorestderr $dbliteFileName -batch $dbFile << $baseCommand]
+
+puts [testOutput $multiRowInternalSplitDesc $multiRowInternalSplitExpected $multiRowInternalSplitResult]
+
+# .btree indents each level by two spaces
+set multiRowTreeDesc "keeps the rows of a tree with several internal levels after closing the connection"
+set multiRowTreeExpected "$multiRowInternalSplitExpected\n4 internal levels"
+set multiRowTreeOutput [exec -ignorestderr $dbliteFileName -batch $dbFile << "select\n.btree\n"]
+set multiRowTreeLevels 0
+foreach indent [regexp -all -inline -line {^ *(?=- internal)} $multiRowTreeOutput] {
+  set multiRowTreeLevels [expr {max($multiRowTreeLevels, [string length $indent] / 2 + 1)}]
+}
+set multiRowTreeRows [regexp -all -inline -line {^[0-9]+,.*$} $multiRowTreeOutput]
+set multiRowTreeResult "[join $multiRowTreeRows "\n"]\n$multiRowTreeLevels internal levels"
+
+puts [testOutput $multiRowTreeDesc $multiRowTreeExpected $multiRowTreeResult]
+
 # Bulk insert test
 
 # Remove the test database
@@ -153,6 +266,92 @@ set bulkInsertResult [join $resultSubset "\n"]
 
 puts [testOutput $bulkInsertDesc $bulkInsertExpected $bulkInsertResult]
 
+# Select by ids test
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set baseCommand ""
+for { set a 1} {$a <= 100} {incr a} {
+  append baseCommand "insert $a user$a a$a@b.com\n"
+}
+append baseCommand "select where id in (77, 3,100 ,3, 1000, 1)\nselect where id in ()\nselect where id in (-5)\nselect where name = x\n"
+
+set selectKeysDesc "prints the rows of the listed ids in key order"
+set selectKeysExpected "1,user1,a1@b.com
+3,user3,a3@b.com
+77,user77,a77@b.com
+100,user100,a100@b.com"
+
+set selectKeysResult [exec -ignorestderr $dbliteFileName -batch $dbFile << $baseCommand]
+
+puts [testOutput $selectKeysDesc $selectKeysExpected $selectKeysResult]
+
+# Select a range test
+
+# Remove the test database
+file delete $dbFileDirectory
+
+# the even ids 2..400 in scattered order fill about 30 leaves; a range is
+# read 128 rows per fetch, which stops after 4 leaves and resumes mid-leaf
+set baseCommand ""
+for { set a 0} {$a < 200} {incr a} {
+  set id [expr {($a * 73 % 200 + 1) * 2}]
+  append baseCommand "insert $id user$id a$id@b.com\n"
+}
+
+# ranges that start and end on stored ids, between them and outside them
+set ranges {{1 1} {2 2} {3 9} {1 400} {37 301} {120 121} {399 1000} {50 40}}
+set selectRangeExpected ""
+foreach range $ranges {
+  lassign $range first last
+  append baseCommand "select where id between $first and $last\n"
+  for { set id $first} {$id <= $last && $id <= 400} {incr id} {
+    if {$id % 2 == 0} {
+      append selectRangeExpected "$id,user$id,a$id@b.com\n"
+    }
+  }
+}
+set selectRangeExpected [string trimright $selectRangeExpected "\n"]
+
+set selectRangeDesc "prints the rows of an id range in key order"
+set selectRangeResult [exec -ignorestderr $dbliteFileName -batch $dbFile << $baseCommand]
+
+puts [testOutput $selectRangeDesc $selectRangeExpected $selectRangeResult]
+
+set selectRangeErrorDesc "rejects an id range without two ids"
+set selectRangeErrorExpected "Line 1: Syntax error. Could not parse statement.
+Line 2: ID must be positive."
+set selectRangeErrorResult [
+  exec $dbliteFileName -batch $dbFile << "select where id between 5\nselect where id between 5 and -1\n" 2>@1
+]
+regsub {\nSummary: .*$} $selectRangeErrorResult "" selectRangeErrorResult
+
+puts [testOutput $selectRangeErrorDesc $selectRangeErrorExpected $selectRangeErrorResult]
+
+# Parallel scan test
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set parallelScanDesc "prints all rows in key order when select scans on several threads"
+
+set baseCommand ""
+for { set a 60} {$a > 0} {incr a -1} {
+  append baseCommand "insert $a user$a a$a@b.com\n"
+}
+append baseCommand "select\n.exit\n"
+
+set parallelScanExpected ""
+for { set a 1} {$a <= 60} {incr a} {
+  append parallelScanExpected "$a,user$a,a$a@b.com\n"
+}
+set parallelScanExpected [string trimright $parallelScanExpected "\n"]
+
+set parallelScanResult [exec -ignorestderr $dbliteFileName -batch -threads 4 $dbFile << $baseCommand]
+
+puts [testOutput $parallelScanDesc $parallelScanExpected $parallelScanResult]
+
 # Full table test
 
 # Remove the test database
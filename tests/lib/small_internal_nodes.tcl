@@ -0,0 +1,14 @@
+# Helpers for tests that need internal nodes to split.
+#
+# Internal nodes of a 4 KB page hold 509 keys, more leaves than fit in
+# TABLE_MAX_PAGES, so a test cannot fill one. Files from before the
+# database header keep internal nodes of 3 keys
+# (HEADERLESS_INTERNAL_NODE_MAX_CELLS in db.c), so these tests start
+# from an empty file of that kind: a root leaf on page 0.
+proc createSmallInternalNodeDb {path} {
+  set page [binary format ccini 1 1 0 0 0]
+  append page [string repeat "\0" [expr {4096 - [string length $page]}]]
+  set file [open $path wb]
+  puts -nonewline $file $page
+  close $file
+}
@@ -14,6 +14,8 @@ if {!$isExecutable} {
 set dbFile "test.db"
 set dbFileDirectory "$workingDir/$dbFile"
 
+source [file join [file dirname [info script]] lib small_internal_nodes.tcl]
+
 proc testOutput {description expected actual} {
   set TEST_FAIL_COLOR "\033\[37;41m"
   set TEST_PASS_COLOR "\033\[37;42m"
@@ -36,10 +38,10 @@ proc testOutput {description expected actual} {
 set constantsDesc "displays the system's constants"
 set constantsExpected "db > Constants:
 ROW_SIZE: 293
-COMMON_NODE_HEADER_SIZE: 6
-LEAF_NODE_HEADER_SIZE: 14
-LEAF_NODE_CELL_SIZE: 297
-LEAF_NODE_SPACE_FOR_CELLS: 4082
+COMMON_NODE_HEADER_SIZE: 11
+LEAF_NODE_HEADER_SIZE: 19
+LEAF_NODE_CELL_SIZE: 299
+LEAF_NODE_SPACE_FOR_CELLS: 4077
 LEAF_NODE_MAX_CELLS: 13
 db > "
 set constantsResult [exec $dbliteFileName $dbFile << ".constants\n.exit\n"]
@@ -111,3 +113,318 @@ set resultSubset [lrange $resultList 14 end]
 set treeViewBTreeResult [join $resultSubset "\n"]
 
 puts [testOutput $treeViewBTreeDesc $treeViewBTreeExpected $treeViewBTreeResult]
+
+# Runtime statistics
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set statsDesc "counts splits and reports the tree shape in .stats"
+set statsExpected "leaf splits: 1
+internal splits: 0
+tree height: 2
+average leaf fill: 57.7%
+cursor advances: 15
+grouped inserts: 13
+insert statements: 15
+select statements: 1"
+
+set baseCommand ""
+
+for { set a 1} {$a < 16} {incr a} {
+  append baseCommand "insert $a foo a@b.c\n"
+}
+
+append baseCommand "select\n.stats\n.exit\n"
+
+set result [exec $dbliteFileName $dbFile << $baseCommand]
+
+# latencies and cache counts vary from run to run
+set statsLines [regexp -all -inline -line {^(?:leaf splits|internal splits|tree height|average leaf fill|cursor advances|grouped inserts|\w+ statements): .*$} $result]
+set statsResult [join $statsLines "\n"]
+
+puts [testOutput $statsDesc $statsExpected $statsResult]
+
+# A select reads the leaves of a reopened file without loading them
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set baseCommand ""
+for { set a 1} {$a < 16} {incr a} {
+  append baseCommand "insert $a foo a@b.c\n"
+}
+append baseCommand ".exit\n"
+exec $dbliteFileName $dbFile << $baseCommand
+
+set scanRingDesc "reads leaves through the scan ring and loads only the root"
+set scanRingExpected "page cache misses: 1
+scan ring reads: 3"
+
+set result [exec $dbliteFileName $dbFile << "select\n.stats\n.exit\n"]
+
+# the left edge is walked when the file is opened, then select reads both leaves
+set scanRingLines [regexp -all -inline -line {^(?:page cache misses|scan ring reads): .*$} $result]
+set scanRingResult [join $scanRingLines "\n"]
+
+puts [testOutput $scanRingDesc $scanRingExpected $scanRingResult]
+
+# Tree health report
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set analyzeDesc "reports levels, fill and leaf order in .analyze"
+set analyzeExpected "db > Analysis:
+pages: 3
+free pages: 0
+height: 2
+level 0: 2 leaves, 57.7% full
+level 1: 1 internal nodes, 0.2% full
+leaf fill:
+  50-59%: 1
+  60-69%: 1
+leaf chain: 1 links, 0 sequential, 0 forward jumps, 1 backward jumps
+fragmentation: 100.0%
+db > "
+
+set baseCommand ""
+
+for { set a 1} {$a < 16} {incr a} {
+  append baseCommand "insert $a foo a@b.c\n"
+}
+
+append baseCommand ".analyze\n.exit\n"
+
+set result [exec $dbliteFileName $dbFile << $baseCommand]
+
+set resultList [split $result "\n"]
+set analyzeResult [join [lrange $resultList 15 end] "\n"]
+
+puts [testOutput $analyzeDesc $analyzeExpected $analyzeResult]
+
+# Defragmentation
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set defragDesc "moves leaves into key order with .defrag"
+set defragExpected "db > Defrag: moved 1 pages, done
+leaf chain: 1 links, 1 sequential, 0 forward jumps, 0 backward jumps
+db > (1, foo, a@b.c)
+(7, foo, a@b.c)
+(8, foo, a@b.c)
+(14, foo, a@b.c)"
+
+set baseCommand ""
+
+for { set a 1} {$a < 15} {incr a} {
+  append baseCommand "insert $a foo a@b.c\n"
+}
+
+append baseCommand ".defrag\n.analyze\nselect\n.exit\n"
+
+set result [exec $dbliteFileName $dbFile << $baseCommand]
+
+set defragLines [regexp -all -inline -line {^(?:db > )?(?:Defrag: .*|leaf chain: .*|\((?:1|7|8|14), .*)$} $result]
+set defragResult [join $defragLines "\n"]
+
+puts [testOutput $defragDesc $defragExpected $defragResult]
+
+# Bulk import
+
+# Remove the test database
+file delete $dbFileDirectory
+set importFile "import.csv"
+set importFileDirectory "$workingDir/$importFile"
+
+set importFileHandle [open $importFileDirectory w]
+for { set a 30} {$a > 0} {incr a -1} {
+  puts $importFileHandle "$a,user$a,a$a@b.com"
+}
+puts $importFileHandle "31,\"last, user\",\"a\"\"31\"\"@b.com\""
+close $importFileHandle
+
+set importDesc "bulk loads a CSV file into an empty table with .import"
+set importExpected "db > Imported 31 rows.
+db > (1, user1, a1@b.com)
+(2, user2, a2@b.com)
+(30, user30, a30@b.com)
+(31, last, user, a\"31\"@b.com)
+db > Tree:
+- internal (size 2)
+db > Table must be empty to import."
+
+set result [exec $dbliteFileName $dbFile << ".import $importFile\nselect\n.btree\n.import $importFile\n.exit\n"]
+
+set importLines [regexp -all -inline -line {^(?:db > )?(?:Imported .*|Table must .*|Tree:|- internal .*|\((?:1|2|30|31), .*)$} $result]
+set importResult [join $importLines "\n"]
+
+puts [testOutput $importDesc $importExpected $importResult]
+
+# Bulk import of a tree with several internal levels
+
+# Remove the test database
+file delete $dbFileDirectory
+
+createSmallInternalNodeDb $dbFileDirectory
+
+# 900 rows in scattered order fill 70 leaves
+set importFileHandle [open $importFileDirectory w]
+for { set a 1} {$a <= 900} {incr a} {
+  set id [expr {$a * 7919 % 100003}]
+  puts $importFileHandle "$id,user$id,a$id@b.com"
+}
+close $importFileHandle
+
+# -threads 3 sorts three runs and merges them in two rounds, whatever the number of cores
+set importLevelsDesc "bulk loads a tree with several internal levels on several threads"
+set importLevelsExpected "Imported 900 rows.
+900 rows in key order
+93,user93,a93@b.com
+99891,user99891,a99891@b.com
+4 internal levels"
+
+set importLevelsOutput [exec -ignorestderr $dbliteFileName -batch -threads 3 $dbFile << ".import $importFile\n"]
+append importLevelsOutput "\n" [exec -ignorestderr $dbliteFileName -batch $dbFile << "select\n.btree\n"]
+
+# .btree indents each level by two spaces
+set importLevels 0
+foreach indent [regexp -all -inline -line {^ *(?=- internal)} $importLevelsOutput] {
+  set importLevels [expr {max($importLevels, [string length $indent] / 2 + 1)}]
+}
+set importRows [regexp -all -inline -line {^[0-9]+,.*$} $importLevelsOutput]
+set importIds {}
+foreach row $importRows {
+  lappend importIds [lindex [split $row ","] 0]
+}
+set importOrder [expr {$importIds eq [lsort -integer $importIds] ? "in key order" : "out of order"}]
+set importLevelsResult "[lindex [regexp -inline -line {^Imported .*$} $importLevelsOutput] 0]
+[llength $importRows] rows $importOrder
+[lindex $importRows 0]
+[lindex $importRows end]
+$importLevels internal levels"
+
+puts [testOutput $importLevelsDesc $importLevelsExpected $importLevelsResult]
+
+file delete $importFileDirectory
+
+# Dump and load test
+
+# Remove the test database
+file delete $dbFileDirectory
+set dumpFile "rows.dump"
+set dumpFileDirectory "$workingDir/$dumpFile"
+file delete $dumpFileDirectory
+
+set baseCommand ""
+for { set a 40} {$a > 0} {incr a -1} {
+  append baseCommand "insert $a user$a a$a@b.com\n"
+}
+append baseCommand "insert 41 last,user a\"41\"@b.com\n.dump $dumpFile\n.exit\n"
+exec $dbliteFileName $dbFile << $baseCommand
+file delete $dbFileDirectory
+
+set dumpDesc "loads the rows written by .dump into an empty table with .load"
+set dumpExpected "db > Loaded 41 rows.
+db > (1, user1, a1@b.com)
+(2, user2, a2@b.com)
+(40, user40, a40@b.com)
+(41, last,user, a\"41\"@b.com)
+db > Table must be empty to load."
+
+set result [exec $dbliteFileName $dbFile << ".load $dumpFile\nselect\n.load $dumpFile\n.exit\n"]
+
+set dumpLines [regexp -all -inline -line {^(?:db > )?(?:Loaded .*|Table must .*|\((?:1|2|40|41), .*)$} $result]
+set dumpResult [join $dumpLines "\n"]
+
+puts [testOutput $dumpDesc $dumpExpected $dumpResult]
+
+# Remove the test database
+file delete $dbFileDirectory
+
+# flip a byte inside the first chunk
+set damagedFile [open $dumpFileDirectory r+b]
+seek $damagedFile 40
+set byte [read $damagedFile 1]
+seek $damagedFile 40
+puts -nonewline $damagedFile [binary format c [expr {[scan $byte %c] ^ 1}]]
+close $damagedFile
+
+set damagedDumpDesc "rejects a damaged dump"
+set damagedDumpExpected "db > 'rows.dump' is damaged or does not fit the table.
+db > Executed.
+db > "
+set damagedDumpResult [exec $dbliteFileName $dbFile << ".load $dumpFile\nselect\n.exit\n"]
+
+puts [testOutput $damagedDumpDesc $damagedDumpExpected $damagedDumpResult]
+
+# A dump written by another program, with the standard CRC32C of its chunk
+
+proc crc32c {data} {
+  set crc 0xFFFFFFFF
+  binary scan $data cu* bytes
+  foreach byte $bytes {
+    set crc [expr {$crc ^ $byte}]
+    for {set i 0} {$i < 8} {incr i} {
+      set crc [expr {($crc >> 1) ^ (($crc & 1) ? 0x82F63B78 : 0)}]
+    }
+  }
+  return [expr {$crc ^ 0xFFFFFFFF}]
+}
+
+# Remove the test database
+file delete $dbFileDirectory
+
+# two rows, stored by column and not compressed; the first id starts with a zero byte
+set chunkRows [binary format iicccca3a3a3a3 256 257 3 3 3 3 ann bob a@x b@x]
+set chunkLength [string length $chunkRows]
+set dumpContents [binary format a8ccsi dbldump 1 4 0 2]
+append dumpContents [binary format iiii 2 $chunkLength $chunkLength [crc32c $chunkRows]] $chunkRows
+
+set externalDumpFile [open $dumpFileDirectory wb]
+puts -nonewline $externalDumpFile $dumpContents
+close $externalDumpFile
+
+set externalDumpDesc "loads a dump whose chunks carry the standard CRC32C"
+set externalDumpExpected "db > Loaded 2 rows.
+db > (256, ann, a@x)
+(257, bob, b@x)
+Executed.
+db > "
+set externalDumpResult [exec $dbliteFileName $dbFile << ".load $dumpFile\nselect\n.exit\n"]
+
+puts [testOutput $externalDumpDesc $externalDumpExpected $externalDumpResult]
+
+# Remove the test database
+file delete $dbFileDirectory
+
+# the row count in the header, far more than the file can hold
+set damagedFile [open $dumpFileDirectory r+b]
+seek $damagedFile 12
+puts -nonewline $damagedFile [binary format i 0xfffffff0]
+close $damagedFile
+
+set damagedCountDesc "rejects a dump whose row count does not fit the file"
+set damagedCountExpected "db > 'rows.dump' is damaged or does not fit the table.
+db > Executed.
+db > "
+set damagedCountResult [exec $dbliteFileName $dbFile << ".load $dumpFile\nselect\n.exit\n"]
+
+puts [testOutput $damagedCountDesc $damagedCountExpected $damagedCountResult]
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set selfDumpDesc "refuses to dump the database onto itself"
+set selfDumpExpected "db > Executed.
+db > Cannot dump the database onto itself.
+db > db > (1, foo, a@b.c)
+Executed.
+db > "
+set selfDumpResult [exec $dbliteFileName $dbFile << "insert 1 foo a@b.c\n.dump $dbFileDirectory\n.exit\n"]
+append selfDumpResult [exec $dbliteFileName $dbFile << "select\n.exit\n"]
+
+puts [testOutput $selfDumpDesc $selfDumpExpected $selfDumpResult]
+
+file delete $dumpFileDirectory
@@ -49,3 +49,194 @@ puts [testOutput $singleInsertDesc $singleInsertInitialExpected $singleInsertIni
 
 set singleInsertFinalResult [exec $dbliteFileName $dbFile << "select\n.exit\n"]
 puts [testOutput $singleInsertFinalDesc $singleInsertFinalExpected $singleInsertFinalResult]
+
+# Version 1 (interleaved cells) files are upgraded on load
+
+# Remove the test database
+file delete $dbFileDirectory
+
+# leaf page: node type 1 (leaf), is_root 1, parent 0, 2 cells, no next leaf,
+# then [key][id][username][email] cells
+set legacyPage [binary format ccini 1 1 0 2 0]
+foreach {id username email} {1 foo a@b.c 2 bar d@e.f} {
+  append legacyPage [binary format iia33a256 $id $id $username $email]
+}
+append legacyPage [string repeat "\0" [expr {4096 - [string length $legacyPage]}]]
+
+set legacyFile [open $dbFileDirectory wb]
+puts -nonewline $legacyFile $legacyPage
+close $legacyFile
+
+set legacyUpgradeDesc "reads and upgrades a version 1 database file"
+set legacyUpgradeExpected "db > (1, foo, a@b.c)
+(2, bar, d@e.f)
+Executed.
+db > Executed.
+db > "
+set legacyUpgradeResult [exec $dbliteFileName $dbFile << "select\ninsert 3 baz g@h.i\n.exit\n"]
+puts [testOutput $legacyUpgradeDesc $legacyUpgradeExpected $legacyUpgradeResult]
+
+set legacyReopenDesc "keeps upgraded data after closing the connection"
+set legacyReopenExpected "db > (1, foo, a@b.c)
+(2, bar, d@e.f)
+(3, baz, g@h.i)
+Executed.
+db > "
+set legacyReopenResult [exec $dbliteFileName $dbFile << "select\n.exit\n"]
+puts [testOutput $legacyReopenDesc $legacyReopenExpected $legacyReopenResult]
+
+# Pages are checksummed, so a damaged file is detected when it is read
+
+# Remove the test database
+file delete $dbFileDirectory
+
+exec $dbliteFileName $dbFile << "insert 1 foo a@b.c\n.exit\n"
+
+# flip a byte inside the row's username; the root is page 1, after the header
+set corruptFile [open $dbFileDirectory r+b]
+seek $corruptFile [expr {4096 + 125}]
+puts -nonewline $corruptFile "x"
+close $corruptFile
+
+# the root is pinned, so it is read when the file is opened, before the prompt
+set corruptDesc "detects a corrupted page when it is read"
+set corruptExpected "Checksum mismatch on page 1. Corrupt file."
+catch {exec $dbliteFileName $dbFile << "select\n.exit\n"} corruptResult
+regsub {\nchild process exited abnormally$} $corruptResult "" corruptResult
+puts [testOutput $corruptDesc $corruptExpected $corruptResult]
+
+# The page size is chosen when the file is created and kept in its header
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set pageSizeDesc "keeps the page size a database was created with"
+set pageSizeExpected "db > (1, foo, a@b.c)
+Executed.
+db > Constants:
+ROW_SIZE: 293
+COMMON_NODE_HEADER_SIZE: 11
+LEAF_NODE_HEADER_SIZE: 19
+LEAF_NODE_CELL_SIZE: 299
+LEAF_NODE_SPACE_FOR_CELLS: 16365
+LEAF_NODE_MAX_CELLS: 54
+db > "
+exec $dbliteFileName -pagesize 16384 $dbFile << "insert 1 foo a@b.c\n.exit\n"
+set pageSizeResult [exec $dbliteFileName $dbFile << "select\n.constants\n.exit\n"]
+puts [testOutput $pageSizeDesc $pageSizeExpected $pageSizeResult]
+
+set pageSizeFileDesc "writes whole pages of the chosen size"
+set pageSizeFileExpected [expr {2 * 16384}]
+set pageSizeFileResult [file size $dbFileDirectory]
+puts [testOutput $pageSizeFileDesc $pageSizeFileExpected $pageSizeFileResult]
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set badPageSizeDesc "rejects a page size that is not a power of two from 4096 to 65536"
+set badPageSizeExpected "Page size must be a power of two from 4096 to 65536."
+catch {exec $dbliteFileName -pagesize 5000 $dbFile << ".exit\n"} badPageSizeResult
+regsub {\nchild process exited abnormally$} $badPageSizeResult "" badPageSizeResult
+puts [testOutput $badPageSizeDesc $badPageSizeExpected $badPageSizeResult]
+
+# The key size is chosen when the file is created and kept in its header
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set keySizeDesc "keeps 64-bit ids in a database created with -keysize 8"
+set keySizeExpected "db > (5, foo, a@b.c)
+(3000000000, bar, d@e.f)
+(9007199254740993, baz, g@h.i)
+Executed.
+db > ID is too large.
+db > "
+exec $dbliteFileName -keysize 8 $dbFile << "insert 9007199254740993 baz g@h.i\ninsert 3000000000 bar d@e.f\ninsert 5 foo a@b.c\n.exit\n"
+set keySizeResult [exec $dbliteFileName $dbFile << "select\ninsert 18446744073709551616 qux j@k.l\n.exit\n"]
+puts [testOutput $keySizeDesc $keySizeExpected $keySizeResult]
+
+# Remove the test database
+file delete $dbFileDirectory
+
+# 300 ids above 2^32 in scattered order, some above 2^63, split leaves
+# and fill the root with keys
+set keySizeSplitIds {18446744073709551615 9223372036854775808}
+for { set a 1} {$a <= 298} {incr a} {
+  lappend keySizeSplitIds [expr {($a * 7919 % 100003) * 92233720368 + 4294967297}]
+}
+set baseCommand ""
+foreach id $keySizeSplitIds {
+  append baseCommand "insert $id user$id a$id@b.com\n"
+}
+append baseCommand ".exit\n"
+exec $dbliteFileName -keysize 8 $dbFile << $baseCommand
+
+set keySizeSplitDesc "keeps 64-bit ids in order after they split leaves"
+set keySizeSplitExpected ""
+# lsort -integer wraps at 2^63; expr compares ids of any size
+proc compareIds {a b} {
+  expr {$a < $b ? -1 : $a > $b}
+}
+foreach id [lsort -command compareIds $keySizeSplitIds] {
+  append keySizeSplitExpected "$id,user$id,a$id@b.com\n"
+}
+# then the lookup of an id with the top bit set, and of one that is not there
+append keySizeSplitExpected "9223372036854775808,user9223372036854775808,a9223372036854775808@b.com"
+set keySizeSplitResult [exec -ignorestderr $dbliteFileName -batch $dbFile << "select\nselect where id in (9223372036854775808, 4294967296)\n"]
+
+puts [testOutput $keySizeSplitDesc $keySizeSplitExpected $keySizeSplitResult]
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set keySize32Desc "rejects ids that do not fit in 32 bits by default"
+set keySize32Expected "db > Executed.
+db > ID is too large.
+db > (4294967295, foo, a@b.c)
+Executed.
+db > "
+set keySize32Result [exec $dbliteFileName $dbFile << "insert 4294967295 foo a@b.c\ninsert 5000000000 bar d@e.f\nselect\n.exit\n"]
+puts [testOutput $keySize32Desc $keySize32Expected $keySize32Result]
+
+# Compressed pages read back like any other page
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set compressDesc "reads back pages written with -compress"
+set compressExpected "db > (1, foo, a@b.c)
+(2, bar, d@e.f)
+Executed.
+db > "
+exec $dbliteFileName -compress -pagesize 16384 $dbFile << "insert 2 bar d@e.f\ninsert 1 foo a@b.c\n.exit\n"
+set compressResult [exec $dbliteFileName $dbFile << "select\n.exit\n"]
+puts [testOutput $compressDesc $compressExpected $compressResult]
+
+# A backup copies the committed state of an open database
+
+# Remove the test database
+file delete $dbFileDirectory
+set backupFile "$workingDir/backup.db"
+file delete $backupFile
+
+set backupDesc "backs up the committed rows, not those inserted since the file was opened"
+set backupExpected "db > Executed.
+db > Backup: copied 2 pages to backup.db
+db > db > (1, foo, a@b.c)
+Executed.
+db > "
+exec $dbliteFileName $dbFile << "insert 1 foo a@b.c\n.exit\n"
+set backupResult [exec $dbliteFileName $dbFile << "insert 2 bar d@e.f\n.backup backup.db\n.exit\n"]
+append backupResult [exec $dbliteFileName backup.db << "select\n.exit\n"]
+file delete $backupFile
+puts [testOutput $backupDesc $backupExpected $backupResult]
+
+set selfBackupDesc "refuses to back up the database onto itself"
+set selfBackupExpected "db > Cannot back up the database onto itself.
+db > db > (1, foo, a@b.c)
+(2, bar, d@e.f)
+Executed.
+db > "
+set selfBackupResult [exec $dbliteFileName $dbFile << ".backup $dbFileDirectory\n.exit\n"]
+append selfBackupResult [exec $dbliteFileName $dbFile << "select\n.exit\n"]
+puts [testOutput $selfBackupDesc $selfBackupExpected $selfBackupResult]
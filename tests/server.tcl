@@ -0,0 +1,208 @@
+puts "spec: SERVER MODE"
+
+# This file implements server mode tests for DBLite library.
+set workingDir [pwd]
+set dbliteFileName "$workingDir/.bin/dblite"
+
+# Check if file is executable
+set isExecutable [file executable $dbliteFileName]
+if {!$isExecutable} {
+  puts "error"
+}
+
+# Get directory of the test database file
+set dbFile "test.db"
+set dbFileDirectory "$workingDir/$dbFile"
+
+proc testOutput {description expected actual} {
+  set TEST_FAIL_COLOR "\033\[37;41m"
+  set TEST_PASS_COLOR "\033\[37;42m"
+  set TEST_FAIL_DESC_COLOR "\033\[1;31m"
+  set TEST_PASS_DESC_COLOR "\033\[1;32m"
+  set RESET_COLOR "\033\[0m"
+
+  if {[string compare $actual $expected] != 0} {
+    puts "$TEST_FAIL_COLOR FAIL:$RESET_COLOR $description"
+    puts "Description:\n  $description"
+    puts "Expected result:\n  $TEST_PASS_DESC_COLOR $expected $RESET_COLOR"
+    puts "Received result:\n  $TEST_FAIL_DESC_COLOR $actual $RESET_COLOR"
+  } else {
+    puts "$TEST_PASS_COLOR PASS:$RESET_COLOR $description"
+  }
+}
+
+# Protocol helpers; see "Server mode" in db.c
+
+proc sendMessage {sock type payload} {
+  puts -nonewline $sock [binary format iuc [expr {[string length $payload] + 1}] $type]$payload
+  flush $sock
+}
+
+proc textParameter {text} {
+  return [binary format cs 2 [string length $text]]$text
+}
+
+proc integerParameter {value} {
+  return [binary format ci 1 $value]
+}
+
+# read one message and describe it as a line of text
+proc readMessage {sock} {
+  binary scan [read $sock 4] iu length
+  set body [read $sock $length]
+  binary scan $body cu type
+  set payload [string range $body 1 end]
+  switch $type {
+    129 {
+      binary scan $payload iu statement
+      return "prepared $statement"
+    }
+    130 {
+      binary scan $payload iu count
+      set offset 4
+      set rows {}
+      for {set i 0} {$i < $count} {incr i} {
+        binary scan $payload "@${offset}iuiucu" frameLength id usernameLength
+        set username [string range $payload [expr {$offset + 9}] [expr {$offset + 8 + $usernameLength}]]
+        binary scan $payload "@[expr {$offset + 9 + $usernameLength}]su" emailLength
+        set email [string range $payload [expr {$offset + 11 + $usernameLength}] [expr {$offset + 10 + $usernameLength + $emailLength}]]
+        lappend rows "($id, $username, $email)"
+        incr offset [expr {4 + $frameLength}]
+      }
+      return [join $rows "\n"]
+    }
+    131 {
+      binary scan $payload wu rows
+      return "done $rows"
+    }
+    132 {
+      return "error $payload"
+    }
+  }
+  return "unknown $type"
+}
+
+# Clients prepare, bind and execute statements over a socket
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set port [expr {40000 + [pid] % 20000}]
+set server [open "|$dbliteFileName -serve 127.0.0.1:$port $dbFile" r]
+gets $server listening
+
+set sock [socket 127.0.0.1 $port]
+fconfigure $sock -translation binary -buffering none
+
+set serverDesc "prepares, binds and executes statements sent over a socket"
+set serverExpected "prepared 0
+done 1
+done 1
+error Error: Duplicate key.
+prepared 1
+error Not all parameters are bound.
+prepared 2
+(1, foo, a@b.c)
+(2, bar, d@e.f)
+done 2
+error Unrecognized keyword at start of 'drop'."
+
+set serverLines {}
+sendMessage $sock 1 "insert ? ? ?"
+lappend serverLines [readMessage $sock]
+sendMessage $sock 2 [binary format is 0 3][integerParameter 2][textParameter bar][textParameter d@e.f]
+sendMessage $sock 3 [binary format i 0]
+lappend serverLines [readMessage $sock]
+sendMessage $sock 2 [binary format is 0 3][integerParameter 1][textParameter foo][textParameter a@b.c]
+sendMessage $sock 3 [binary format i 0]
+lappend serverLines [readMessage $sock]
+sendMessage $sock 3 [binary format i 0]
+lappend serverLines [readMessage $sock]
+sendMessage $sock 1 "insert 3 ? baz@x.y"
+lappend serverLines [readMessage $sock]
+sendMessage $sock 3 [binary format i 1]
+lappend serverLines [readMessage $sock]
+sendMessage $sock 1 "select"
+lappend serverLines [readMessage $sock]
+sendMessage $sock 3 [binary format i 2]
+lappend serverLines [readMessage $sock]
+lappend serverLines [readMessage $sock]
+sendMessage $sock 1 "drop"
+lappend serverLines [readMessage $sock]
+close $sock
+
+# the server closes the table when it is stopped
+exec kill [pid $server]
+close $server
+
+set serverResult [join $serverLines "\n"]
+
+puts [testOutput $serverDesc $serverExpected $serverResult]
+
+set serverPersistDesc "keeps the rows inserted by clients after the server stops"
+set serverPersistExpected "db > (1, foo, a@b.c)
+(2, bar, d@e.f)
+Executed.
+db > "
+set serverPersistResult [exec $dbliteFileName $dbFile << "select\n.exit\n"]
+
+puts [testOutput $serverPersistDesc $serverPersistExpected $serverPersistResult]
+
+# Clients beyond the descriptor limit are refused, not left waiting
+
+# Remove the test database
+file delete $dbFileDirectory
+
+set server [open "|sh -c \"ulimit -n 16 && exec $dbliteFileName -serve 127.0.0.1:$port $dbFile\"" r]
+gets $server listening
+
+# wait up to two seconds for the server to close a socket
+proc closedByServer {sock} {
+  fconfigure $sock -blocking 0
+  for {set i 0} {$i < 100} {incr i} {
+    read $sock
+    if {[eof $sock]} {
+      return 1
+    }
+    after 20
+  }
+  return 0
+}
+
+set crowd {}
+for {set i 0} {$i < 16} {incr i} {
+  lappend crowd [socket 127.0.0.1 $port]
+}
+set refused [closedByServer [lindex $crowd end]]
+foreach crowdSock $crowd {
+  close $crowdSock
+}
+
+# the server closes the crowd's connections as it notices them go
+for {set i 0} {$i < 100} {incr i} {
+  set sock [socket 127.0.0.1 $port]
+  fconfigure $sock -translation binary -buffering none
+  sendMessage $sock 1 "select"
+  if {[string length [set header [read $sock 4]]] == 4} {
+    break
+  }
+  close $sock
+  after 20
+}
+binary scan $header iu length
+binary scan [read $sock $length] cuiu type statement
+set descriptorLines [list "refused $refused" "prepared $statement"]
+sendMessage $sock 3 [binary format i 0]
+lappend descriptorLines [readMessage $sock]
+close $sock
+
+exec kill [pid $server]
+close $server
+
+set descriptorDesc "refuses clients when out of descriptors and serves the next one"
+set descriptorExpected "refused 1
+prepared 0
+done 0"
+set descriptorResult [join $descriptorLines "\n"]
+
+puts [testOutput $descriptorDesc $descriptorExpected $descriptorResult]
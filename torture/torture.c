@@ -0,0 +1,793 @@
+/*
+DBLite crash consistency harness
+
+Runs randomized workloads against a database, crashes them at each write
+and fsync the pager makes, then opens the file again and checks what is
+left. The pager's I/O goes through pager_write_function and
+pager_sync_function (see Pager I/O), which the harness replaces.
+
+A trial creates a database with some rows and closes it: that is the old
+state. A workload of single and multi-row inserts then runs on the file
+and closes it, which gives the new state. Run once without faults, the
+workload also tells how many I/O operations its close makes. It is then
+run again in a child process for every one of those operations in every
+mode, and the child dies at that operation:
+
+process_crash -> the writes before the fault reach the file, the rest do
+                 not (the process dies, the kernel does not)
+torn_write    -> the same, and the write at the fault reaches the file
+                 cut short at a 512-byte sector boundary
+power_loss    -> writes that were not synced are lost: each one reaches
+                 the file or not at random, and one that does may be torn
+
+Another child then opens the file and checks it:
+- every page the tree refers to is in the file, once, and is a node
+- the keys of every node are in order and within their parent's bounds,
+  and the leaves are all at the same depth
+- the leaf chain visits the leaves in key order
+- every row matches its id, and the rows are the old or the new state
+
+Each fault ends as one of
+
+old       -> the file holds the old state
+new       -> the file holds the new state
+detected  -> opening or reading the file stopped with a "Corrupt file."
+             error: a checksum or a short read caught the damage
+violation -> anything else: a broken invariant, rows from neither state,
+             or a crash or a hang while reading the file
+
+The harness prints the counts per mode and the first violations with the
+arguments that repeat them, and exits with status 1 if there were any.
+
+Build and run with `make torture`. `-trials n` runs n trials (20 by
+default) with seeds from `-seed n` (1) up, `-rows n` caps the rows of a
+trial's old state, and `-mode name` and `-fault n` limit the faults, e.g
+to repeat one.
+*/
+#define DBLITE_NO_MAIN
+#include "../db.c"
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define DEFAULT_TRIALS 20
+#define DEFAULT_MAX_ROWS 400
+#define WORKLOAD_MAX_ROWS 200
+#define INSERT_BATCH_MAX_ROWS 40
+#define SECTOR_SIZE 512
+#define VERIFY_TIMEOUT_SECONDS 10
+#define MAX_REPORTED_VIOLATIONS 10
+
+// the verifier's exit codes; the engine exits with EXIT_FAILURE on damage it finds
+#define VERIFY_OLD 10
+#define VERIFY_NEW 11
+#define VERIFY_VIOLATION 12
+
+/*
+Random numbers
+
+xorshift64*, as in the benchmark harness
+*/
+typedef struct
+{
+  uint64_t state;
+} Random;
+
+uint64_t random_next(Random *random)
+{
+  random->state ^= random->state >> 12;
+  random->state ^= random->state << 25;
+  random->state ^= random->state >> 27;
+  return random->state * 0x2545F4914F6CDD1DULL;
+}
+
+// a uniformly chosen number in [0, bound)
+uint64_t random_below(Random *random, uint64_t bound)
+{
+  return random_next(random) % bound;
+}
+
+void random_seed(Random *random, uint64_t seed)
+{
+  // xorshift never leaves 0
+  random->state = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+/*
+Trials
+
+Every row's username and email are made from its id, so the verifier can
+check a row without the trial's data. A trial's plan is made before any
+child is forked, and the children run it as it is.
+*/
+typedef struct
+{
+  uint64_t seed;
+  uint32_t key_size;
+  uint64_t *old_ids; // sorted
+  uint32_t num_old;
+  uint64_t *new_ids; // sorted: the old ids and the workload's
+  uint32_t num_new;
+  uint64_t *workload; // ids to insert, in the order they are inserted
+  uint32_t num_workload;
+  uint32_t *batches; // the workload's statements: rows per insert
+  uint32_t num_batches;
+} Trial;
+
+void row_strings(uint64_t id, char *username, char *email)
+{
+  snprintf(username, COLUMN_USERNAME_SIZE + 1, "user%llu", (unsigned long long)id);
+  snprintf(email, COLUMN_EMAIL_SIZE + 1, "%llu@example.com", (unsigned long long)id);
+}
+
+int compare_ids(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// count distinct ids from [1, range], in random order
+uint64_t *distinct_ids(Random *random, uint32_t count, uint64_t range)
+{
+  uint64_t *ids = malloc(count * sizeof(uint64_t));
+  uint32_t n = 0;
+  while (n < count)
+  {
+    uint64_t id = random_below(random, range) + 1;
+    bool seen = false;
+    for (uint32_t i = 0; i < n && !seen; i++)
+    {
+      seen = (ids[i] == id);
+    }
+    if (!seen)
+    {
+      ids[n++] = id;
+    }
+  }
+  return ids;
+}
+
+void trial_plan(Trial *trial, uint64_t seed, uint32_t max_rows)
+{
+  Random random;
+  random_seed(&random, seed);
+  trial->seed = seed;
+  trial->key_size = (random_next(&random) & 1) ? sizeof(uint64_t) : sizeof(uint32_t);
+  // large ids in tables with 64-bit keys
+  uint64_t range = trial->key_size == sizeof(uint64_t) ? UINT64_MAX / 2 : 10000;
+
+  trial->num_old = random_below(&random, max_rows + 1);
+  trial->num_workload = 1 + random_below(&random, WORKLOAD_MAX_ROWS);
+  trial->num_new = trial->num_old + trial->num_workload;
+  trial->new_ids = distinct_ids(&random, trial->num_new, range);
+
+  trial->old_ids = malloc((trial->num_old + 1) * sizeof(uint64_t));
+  memcpy(trial->old_ids, trial->new_ids, trial->num_old * sizeof(uint64_t));
+  trial->workload = malloc(trial->num_workload * sizeof(uint64_t));
+  memcpy(trial->workload, trial->new_ids + trial->num_old, trial->num_workload * sizeof(uint64_t));
+  // inserting in key order fills leaves from the left, and splits them differently
+  if (random_next(&random) & 1)
+  {
+    qsort(trial->workload, trial->num_workload, sizeof(uint64_t), compare_ids);
+  }
+
+  trial->batches = malloc(trial->num_workload * sizeof(uint32_t));
+  trial->num_batches = 0;
+  for (uint32_t done = 0; done < trial->num_workload;)
+  {
+    uint32_t rows = (random_next(&random) & 1) ? 1 : 1 + random_below(&random, INSERT_BATCH_MAX_ROWS);
+    if (rows > trial->num_workload - done)
+    {
+      rows = trial->num_workload - done;
+    }
+    trial->batches[trial->num_batches++] = rows;
+    done += rows;
+  }
+
+  qsort(trial->old_ids, trial->num_old, sizeof(uint64_t), compare_ids);
+  qsort(trial->new_ids, trial->num_new, sizeof(uint64_t), compare_ids);
+}
+
+void trial_free(Trial *trial)
+{
+  free(trial->old_ids);
+  free(trial->new_ids);
+  free(trial->workload);
+  free(trial->batches);
+}
+
+void insert_ids(Table *table, uint64_t *ids, uint32_t count)
+{
+  RowView *rows = malloc(count * sizeof(RowView));
+  char (*usernames)[COLUMN_USERNAME_SIZE + 1] = malloc(count * (COLUMN_USERNAME_SIZE + 1));
+  char (*emails)[COLUMN_EMAIL_SIZE + 1] = malloc(count * (COLUMN_EMAIL_SIZE + 1));
+  for (uint32_t i = 0; i < count; i++)
+  {
+    row_strings(ids[i], usernames[i], emails[i]);
+    rows[i].id = ids[i];
+    rows[i].username = (StringView){usernames[i], strlen(usernames[i])};
+    rows[i].email = (StringView){emails[i], strlen(emails[i])};
+  }
+
+  ExecuteResult result;
+  if (count == 1)
+  {
+    Statement statement;
+    statement.type = STATEMENT_INSERT;
+    statement.row_to_insert = rows[0];
+    result = execute_insert(&statement, table);
+  }
+  else
+  {
+    result = table_insert_rows(table, rows, count);
+  }
+  if (result != EXECUTE_SUCCESS)
+  {
+    printf("Insert failed (%d); raise TABLE_MAX_PAGES or lower -rows.\n", result);
+    exit(EXIT_FAILURE);
+  }
+  free(emails);
+  free(usernames);
+  free(rows);
+}
+
+void run_workload(Trial *trial, const char *path)
+{
+  Table *table = db_open(path, DEFAULT_PAGE_SIZE, trial->key_size);
+  uint64_t *ids = trial->workload;
+  for (uint32_t i = 0; i < trial->num_batches; i++)
+  {
+    insert_ids(table, ids, trial->batches[i]);
+    ids += trial->batches[i];
+  }
+  db_close(table);
+}
+
+void copy_file(const char *from, const char *to)
+{
+  FILE *source = fopen(from, "rb");
+  FILE *destination = fopen(to, "wb");
+  if (source == NULL || destination == NULL)
+  {
+    printf("Unable to copy '%s' to '%s'\n", from, to);
+    exit(EXIT_FAILURE);
+  }
+  char buffer[65536];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), source)) > 0)
+  {
+    fwrite(buffer, 1, length, destination);
+  }
+  fclose(source);
+  fclose(destination);
+}
+
+/*
+Fault injection
+
+Pager I/O operations are numbered from 0 as they are made. The operation
+numbered fault_at does not return: the process dies there, leaving the
+file as the mode says. With power_loss, writes are held in memory until
+the next fsync, since only a sync makes them durable.
+*/
+typedef enum
+{
+  FAULT_PROCESS_CRASH,
+  FAULT_TORN_WRITE,
+  FAULT_POWER_LOSS,
+  FAULT_MODES
+} FaultMode;
+
+const char *fault_mode_names[FAULT_MODES] = {"process_crash", "torn_write", "power_loss"};
+
+typedef struct
+{
+  off_t offset;
+  size_t length;
+  uint8_t *data;
+} PendingWrite;
+
+struct
+{
+  FaultMode mode;
+  int64_t fault_at; // -1 never
+  int64_t operations;
+  Random random;
+  PendingWrite *pending;
+  uint32_t num_pending;
+  uint32_t num_writes; // of the operations, how many were writes
+} fault;
+
+void fault_start(FaultMode mode, int64_t fault_at, uint64_t seed)
+{
+  fault.mode = mode;
+  fault.fault_at = fault_at;
+  fault.operations = 0;
+  fault.num_writes = 0;
+  random_seed(&fault.random, seed ^ (uint64_t)fault_at << 32);
+  fault.pending = NULL;
+  fault.num_pending = 0;
+}
+
+// how much of a write reaches the file when it is torn
+size_t torn_length(size_t length)
+{
+  uint32_t sectors = length / SECTOR_SIZE;
+  if (sectors < 2)
+  {
+    return length / 2;
+  }
+  return SECTOR_SIZE * (1 + random_below(&fault.random, sectors - 1));
+}
+
+void fault_crash(int fd, const void *data, size_t length, off_t offset)
+{
+  switch (fault.mode)
+  {
+  case FAULT_PROCESS_CRASH:
+    break;
+  case FAULT_TORN_WRITE:
+    if (data != NULL)
+    {
+      pwrite(fd, data, torn_length(length), offset);
+    }
+    break;
+  case FAULT_POWER_LOSS:
+    for (uint32_t i = 0; i < fault.num_pending; i++)
+    {
+      PendingWrite *write = &fault.pending[i];
+      if (random_next(&fault.random) & 1)
+      {
+        bool torn = random_below(&fault.random, 4) == 0;
+        pwrite(fd, write->data, torn ? torn_length(write->length) : write->length, write->offset);
+      }
+    }
+    break;
+  default:
+    break;
+  }
+  _exit(0);
+}
+
+ssize_t fault_write(int fd, const void *data, size_t length, off_t offset)
+{
+  if (fault.operations++ == fault.fault_at)
+  {
+    fault_crash(fd, data, length, offset);
+  }
+  fault.num_writes++;
+
+  if (fault.mode != FAULT_POWER_LOSS)
+  {
+    return pwrite(fd, data, length, offset);
+  }
+  fault.pending = realloc(fault.pending, (fault.num_pending + 1) * sizeof(PendingWrite));
+  PendingWrite *write = &fault.pending[fault.num_pending++];
+  write->offset = offset;
+  write->length = length;
+  write->data = malloc(length);
+  memcpy(write->data, data, length);
+  return length;
+}
+
+int fault_sync(int fd)
+{
+  if (fault.operations++ == fault.fault_at)
+  {
+    fault_crash(fd, NULL, 0, 0);
+  }
+
+  for (uint32_t i = 0; i < fault.num_pending; i++)
+  {
+    PendingWrite *write = &fault.pending[i];
+    if (pwrite(fd, write->data, write->length, write->offset) != (ssize_t)write->length)
+    {
+      return -1;
+    }
+    free(write->data);
+  }
+  fault.num_pending = 0;
+  return fsync(fd);
+}
+
+/*
+Verification
+
+Runs in a child: the engine exits on damage it detects, and a file it
+does not detect damage in may crash it or send it round a loop.
+*/
+typedef struct
+{
+  Pager *pager;
+  uint32_t file_pages;
+  bool *visited;
+  uint32_t leaf_depth; // 0 until the first leaf
+  uint32_t *leaves;    // in key order
+  uint32_t num_leaves;
+  uint64_t *ids;
+  uint32_t num_ids;
+} Verification;
+
+void verify_fail(const char *format, ...)
+{
+  va_list arguments;
+  va_start(arguments, format);
+  vprintf(format, arguments);
+  va_end(arguments);
+  printf("\n");
+  fflush(stdout);
+  _exit(VERIFY_VIOLATION);
+}
+
+/*
+Check the subtree on page_num, whose keys must be in (low, high]; low is
+ignored for the leftmost subtree at each level, which has_low says.
+*/
+void verify_node(Verification *verification, uint32_t page_num, uint32_t depth, bool has_low, uint64_t low,
+                 uint64_t high)
+{
+  if (page_num == 0 || page_num >= verification->file_pages)
+  {
+    verify_fail("page %u is referred to but is not in the file", page_num);
+  }
+  if (verification->visited[page_num])
+  {
+    verify_fail("page %u is referred to twice", page_num);
+  }
+  verification->visited[page_num] = true;
+
+  void *node = get_page(verification->pager, page_num);
+  NodeType type = get_node_type(node);
+  if (type == NODE_INTERNAL)
+  {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (num_keys == 0 || num_keys > INTERNAL_NODE_MAX_CELLS)
+    {
+      verify_fail("internal node %u has %u keys", page_num, num_keys);
+    }
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+      uint64_t key = internal_node_key(node, i);
+      bool child_has_low = has_low || i > 0;
+      uint64_t child_low = i > 0 ? internal_node_key(node, i - 1) : low;
+      if ((child_has_low && key <= child_low) || key > high)
+      {
+        verify_fail("internal node %u: key %llu is out of order", page_num, (unsigned long long)key);
+      }
+      verify_node(verification, *internal_node_cell(node, i), depth + 1, child_has_low, child_low, key);
+    }
+    verify_node(verification, *internal_node_right_child(node), depth + 1, true,
+                internal_node_key(node, num_keys - 1), high);
+    return;
+  }
+  if (type != NODE_LEAF)
+  {
+    verify_fail("page %u is not a node (type %d)", page_num, type);
+  }
+
+  if (verification->leaf_depth == 0)
+  {
+    verification->leaf_depth = depth;
+  }
+  else if (depth != verification->leaf_depth)
+  {
+    verify_fail("leaf %u is at depth %u, not %u", page_num, depth, verification->leaf_depth);
+  }
+  verification->leaves[verification->num_leaves++] = page_num;
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells > LEAF_NODE_MAX_CELLS)
+  {
+    verify_fail("leaf %u has %u cells", page_num, num_cells);
+  }
+  for (uint32_t i = 0; i < num_cells; i++)
+  {
+    uint64_t key = leaf_node_key(node, i);
+    bool ordered = i > 0 ? key > leaf_node_key(node, i - 1) : (!has_low || key > low);
+    if (!ordered || key > high)
+    {
+      verify_fail("leaf %u: key %llu is out of order", page_num, (unsigned long long)key);
+    }
+
+    Row row;
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+    deserialize_row(leaf_node_value(node, i), &row);
+    row_strings(key, username, email);
+    if (row.id != key || strcmp(row.username, username) != 0 || strcmp(row.email, email) != 0)
+    {
+      verify_fail("leaf %u: the row of key %llu does not match it", page_num, (unsigned long long)key);
+    }
+    verification->ids[verification->num_ids++] = key;
+  }
+}
+
+bool same_ids(uint64_t *a, uint32_t num_a, uint64_t *b, uint32_t num_b)
+{
+  return num_a == num_b && memcmp(a, b, num_a * sizeof(uint64_t)) == 0;
+}
+
+void verify(Trial *trial, const char *path)
+{
+  alarm(VERIFY_TIMEOUT_SECONDS);
+
+  struct stat file_stat;
+  stat(path, &file_stat);
+  Table *table = db_open(path, DEFAULT_PAGE_SIZE, trial->key_size);
+  if (KEY_SIZE != trial->key_size)
+  {
+    verify_fail("the header says %u-byte keys, not %u", KEY_SIZE, trial->key_size);
+  }
+
+  Verification verification = {0};
+  verification.pager = table->pager;
+  verification.file_pages = file_stat.st_size / PAGE_SIZE;
+  verification.visited = calloc(TABLE_MAX_PAGES, sizeof(bool));
+  verification.leaves = malloc(TABLE_MAX_PAGES * sizeof(uint32_t));
+  verification.ids = malloc(TABLE_MAX_PAGES * LEAF_NODE_MAX_CELLS * sizeof(uint64_t));
+  verify_node(&verification, table->root_page_num, 1, false, 0, MAX_KEY);
+
+  for (uint32_t i = 0; i < verification.num_leaves; i++)
+  {
+    uint32_t expected = i + 1 < verification.num_leaves ? verification.leaves[i + 1] : 0;
+    uint32_t next = *leaf_node_next_leaf(get_page(verification.pager, verification.leaves[i]));
+    if (next != expected)
+    {
+      verify_fail("leaf %u links to %u instead of %u", verification.leaves[i], next, expected);
+    }
+  }
+
+  if (same_ids(verification.ids, verification.num_ids, trial->old_ids, trial->num_old))
+  {
+    _exit(VERIFY_OLD);
+  }
+  if (same_ids(verification.ids, verification.num_ids, trial->new_ids, trial->num_new))
+  {
+    _exit(VERIFY_NEW);
+  }
+  verify_fail("the file holds %u rows, from neither the old state (%u) nor the new one (%u)",
+              verification.num_ids, trial->num_old, trial->num_new);
+}
+
+/*
+Results
+*/
+typedef enum
+{
+  OUTCOME_OLD,
+  OUTCOME_NEW,
+  OUTCOME_DETECTED,
+  OUTCOME_VIOLATION,
+  OUTCOMES
+} Outcome;
+
+uint64_t outcomes[FAULT_MODES][OUTCOMES];
+uint32_t num_violations = 0;
+
+// a child that writes nothing to the terminal
+pid_t fork_quiet(int output)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1)
+  {
+    printf("Unable to fork: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0)
+  {
+    dup2(output, STDOUT_FILENO);
+  }
+  return pid;
+}
+
+// verify a file in a child and classify what it finds; message gets its output
+Outcome verify_file(Trial *trial, const char *path, char *message, size_t capacity)
+{
+  int output[2];
+  if (pipe(output) == -1)
+  {
+    printf("Unable to create a pipe: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pid_t pid = fork_quiet(output[1]);
+  if (pid == 0)
+  {
+    close(output[0]);
+    verify(trial, path);
+  }
+  close(output[1]);
+
+  size_t length = 0;
+  ssize_t bytes;
+  while ((bytes = read(output[0], message + length, capacity - 1 - length)) > 0)
+  {
+    length += bytes;
+  }
+  close(output[0]);
+  message[length] = '\0';
+  if (length > 0 && message[length - 1] == '\n')
+  {
+    message[length - 1] = '\0';
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (WIFSIGNALED(status))
+  {
+    snprintf(message, capacity, "the verifier died of signal %d (%s)", WTERMSIG(status),
+             WTERMSIG(status) == SIGALRM ? "a hang" : "a crash");
+    return OUTCOME_VIOLATION;
+  }
+  switch (WEXITSTATUS(status))
+  {
+  case VERIFY_OLD:
+    return OUTCOME_OLD;
+  case VERIFY_NEW:
+    return OUTCOME_NEW;
+  case EXIT_FAILURE:
+    // damage the engine reports as such; any other error did not catch it
+    return strstr(message, "Corrupt file.") != NULL ? OUTCOME_DETECTED : OUTCOME_VIOLATION;
+  default:
+    return OUTCOME_VIOLATION;
+  }
+}
+
+/*
+Run a trial's workload on a copy of the old state, dying at fault_at,
+and verify what it leaves
+*/
+void run_fault(Trial *trial, const char *old_path, const char *work_path, FaultMode mode, int64_t fault_at,
+               int quiet)
+{
+  copy_file(old_path, work_path);
+  pid_t pid = fork_quiet(quiet);
+  if (pid == 0)
+  {
+    fault_start(mode, fault_at, trial->seed);
+    pager_write_function = fault_write;
+    pager_sync_function = fault_sync;
+    run_workload(trial, work_path);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+
+  char message[1024];
+  Outcome outcome = verify_file(trial, work_path, message, sizeof(message));
+  outcomes[mode][outcome]++;
+  if (outcome == OUTCOME_VIOLATION && num_violations++ < MAX_REPORTED_VIOLATIONS)
+  {
+    printf("violation: %s\n  repeat with: -seed %llu -trials 1 -mode %s -fault %lld\n", message,
+           (unsigned long long)trial->seed, fault_mode_names[mode], (long long)fault_at);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t trials = DEFAULT_TRIALS;
+  uint64_t first_seed = 1;
+  uint32_t max_rows = DEFAULT_MAX_ROWS;
+  int only_mode = -1;
+  int64_t only_fault = -1;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-trials") == 0 && i + 1 < argc)
+    {
+      trials = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+    {
+      first_seed = strtoull(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-rows") == 0 && i + 1 < argc)
+    {
+      max_rows = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-fault") == 0 && i + 1 < argc)
+    {
+      only_fault = strtoll(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-mode") == 0 && i + 1 < argc)
+    {
+      i++;
+      for (int mode = 0; mode < FAULT_MODES; mode++)
+      {
+        if (strcmp(argv[i], fault_mode_names[mode]) == 0)
+        {
+          only_mode = mode;
+        }
+      }
+      if (only_mode == -1)
+      {
+        printf("Unknown mode '%s'\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else
+    {
+      printf("Usage: %s [-trials n] [-seed n] [-rows n] [-mode name] [-fault n]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  char directory[] = "/tmp/dblite-torture-XXXXXX";
+  if (mkdtemp(directory) == NULL)
+  {
+    printf("Unable to create a directory for the databases\n");
+    exit(EXIT_FAILURE);
+  }
+  char old_path[64], new_path[64], work_path[64];
+  snprintf(old_path, sizeof(old_path), "%s/old.db", directory);
+  snprintf(new_path, sizeof(new_path), "%s/new.db", directory);
+  snprintf(work_path, sizeof(work_path), "%s/work.db", directory);
+  int quiet = open("/dev/null", O_WRONLY);
+
+  uint64_t operations = 0;
+  for (uint32_t t = 0; t < trials; t++)
+  {
+    Trial trial;
+    trial_plan(&trial, first_seed + t, max_rows);
+
+    unlink(old_path);
+    Table *table = db_open(old_path, DEFAULT_PAGE_SIZE, trial.key_size);
+    if (trial.num_old > 0)
+    {
+      insert_ids(table, trial.old_ids, trial.num_old);
+    }
+    db_close(table);
+
+    // a run without faults counts the operations and must leave the new state
+    copy_file(old_path, new_path);
+    fault_start(FAULT_PROCESS_CRASH, -1, trial.seed);
+    pager_write_function = fault_write;
+    pager_sync_function = fault_sync;
+    run_workload(&trial, new_path);
+    pager_write_function = pwrite;
+    pager_sync_function = fsync;
+    int64_t num_operations = fault.operations;
+    operations += num_operations;
+
+    char message[1024];
+    if (verify_file(&trial, new_path, message, sizeof(message)) != OUTCOME_NEW)
+    {
+      printf("seed %llu: the workload does not leave the new state without faults: %s\n",
+             (unsigned long long)trial.seed, message);
+      exit(EXIT_FAILURE);
+    }
+
+    for (int mode = 0; mode < FAULT_MODES; mode++)
+    {
+      if (only_mode != -1 && mode != only_mode)
+      {
+        continue;
+      }
+      for (int64_t fault_at = 0; fault_at < num_operations; fault_at++)
+      {
+        if (only_fault != -1 && fault_at != only_fault)
+        {
+          continue;
+        }
+        run_fault(&trial, old_path, work_path, mode, fault_at, quiet);
+      }
+    }
+    trial_free(&trial);
+  }
+
+  unlink(old_path);
+  unlink(new_path);
+  unlink(work_path);
+  rmdir(directory);
+
+  printf("%u trials, %llu I/O operations\n", trials, (unsigned long long)operations);
+  printf("%-14s %10s %10s %10s %10s\n", "mode", "old", "new", "detected", "violations");
+  for (int mode = 0; mode < FAULT_MODES; mode++)
+  {
+    printf("%-14s %10llu %10llu %10llu %10llu\n", fault_mode_names[mode],
+           (unsigned long long)outcomes[mode][OUTCOME_OLD], (unsigned long long)outcomes[mode][OUTCOME_NEW],
+           (unsigned long long)outcomes[mode][OUTCOME_DETECTED],
+           (unsigned long long)outcomes[mode][OUTCOME_VIOLATION]);
+  }
+  return num_violations > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}